@@ -13,6 +13,9 @@
 #include "Wad.h"
 #include <vector>
 #include "forcecrc32.h"
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
 typedef std::map< std::string, vec3 > mapStringToVector;
 
@@ -660,36 +663,31 @@ bool Bsp::move(vec3 offset, int modelIdx, bool onlyModel) {
 	LIGHTMAP* newLightmaps = NULL;
 
 	if (hasLighting) {
-		g_progress.update("Calculate lightmaps", faceCount);
+		g_progress.update("Calculate lightmaps", 0);
 
 		oldLightmaps = new LIGHTMAP[faceCount];
 		newLightmaps = new LIGHTMAP[faceCount];
 		memset(oldLightmaps, 0, sizeof(LIGHTMAP) * faceCount);
 		memset(newLightmaps, 0, sizeof(LIGHTMAP) * faceCount);
 
-		for (int i = 0; i < (int)faceCount; i++) {
-			BSPFACE& face = faces[i];
-
-			int size[2];
-			GetFaceLightmapSize(this, i, size);
+		parallelFor(faceCount, [&](int start, int end) {
+			for (int i = start; i < end; i++) {
+				int size[2];
+				GetFaceLightmapSize(this, i, size);
 
-			int lightmapSz = size[0] * size[1];
-			int lightmapCount = lightmap_count(i);
-			oldLightmaps[i].layers = lightmapCount;
-			lightmapSz *= lightmapCount;
-
-			oldLightmaps[i].width = size[0];
-			oldLightmaps[i].height = size[1];
-
-			bool skipResize = i < target.iFirstFace || i >= target.iFirstFace + target.nFaces;
+				oldLightmaps[i].layers = lightmap_count(i);
+				oldLightmaps[i].width = size[0];
+				oldLightmaps[i].height = size[1];
+			}
+		}, 256);
 
-			if (!skipResize) {
-				oldLightmaps[i].luxelFlags = new unsigned char[size[0] * size[1]];
+		// only faces of the moved model are resized. Each face writes only to its own lightmap.
+		parallelFor(target.nFaces, [&](int start, int end) {
+			for (int i = target.iFirstFace + start; i < target.iFirstFace + end; i++) {
+				oldLightmaps[i].luxelFlags = new unsigned char[oldLightmaps[i].width * oldLightmaps[i].height];
 				qrad_get_lightmap_flags(this, i, oldLightmaps[i].luxelFlags);
 			}
-
-			g_progress.tick();
-		}
+		}, 4);
 	}
 
 	g_progress.update("Moving structures", (int)(ents.size() - 1));
@@ -877,36 +875,36 @@ void Bsp::move_texinfo(int idx, vec3 offset) {
 }
 
 void Bsp::resize_lightmaps(LIGHTMAP* oldLightmaps, LIGHTMAP* newLightmaps) {
-	g_progress.update("Recalculate lightmaps", faceCount);
+	g_progress.update("Recalculate lightmaps", 0);
 
 	// calculate new lightmap sizes
+	std::vector<int> layerCounts(faceCount);
+	parallelFor(faceCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			layerCounts[i] = lightmap_count(i);
+			if (layerCounts[i] == 0)
+				continue;
+
+			int size[2];
+			GetFaceLightmapSize(this, i, size);
+
+			newLightmaps[i].width = size[0];
+			newLightmaps[i].height = size[1];
+			newLightmaps[i].layers = oldLightmaps[i].layers;
+		}
+	}, 256);
+
+	// new offsets are assigned in face order, so the lump is the same no matter how many threads are used
+	std::vector<int> newOffsets(faceCount, 0);
 	int newLightDataSz = 0;
-	int totalLightmaps = 0;
 	int lightmapsResizeCount = 0;
 	for (unsigned int i = 0; i < faceCount; i++) {
-		BSPFACE& face = faces[i];
-
-		g_progress.tick();
-
-		if (lightmap_count(i) == 0)
+		if (layerCounts[i] == 0)
 			continue;
 
-		BSPTEXTUREINFO& info = texinfos[face.iTextureInfo];
-		int texOffset = ((int*)textures)[info.iMiptex + 1];
-		BSPMIPTEX& tex = *((BSPMIPTEX*)(textures + texOffset));
+		newOffsets[i] = newLightDataSz;
+		newLightDataSz += (newLightmaps[i].width * newLightmaps[i].height * newLightmaps[i].layers) * sizeof(COLOR3);
 
-		int size[2];
-		GetFaceLightmapSize(this, i, size);
-
-		int lightmapSz = size[0] * size[1];
-
-		newLightmaps[i].width = size[0];
-		newLightmaps[i].height = size[1];
-		newLightmaps[i].layers = oldLightmaps[i].layers;
-
-		newLightDataSz += (lightmapSz * newLightmaps[i].layers) * sizeof(COLOR3);
-
-		totalLightmaps += newLightmaps[i].layers;
 		if (oldLightmaps[i].width != newLightmaps[i].width || oldLightmaps[i].height != newLightmaps[i].height) {
 			lightmapsResizeCount += newLightmaps[i].layers;
 		}
@@ -915,44 +913,49 @@ void Bsp::resize_lightmaps(LIGHTMAP* oldLightmaps, LIGHTMAP* newLightmaps) {
 	if (lightmapsResizeCount > 0) {
 		//logf("%d lightmap(s) to resize\n", lightmapsResizeCount);
 
-		g_progress.update("Resize lightmaps", faceCount);
+		g_progress.update("Resize lightmaps", 0);
 
 		int newColorCount = newLightDataSz / sizeof(COLOR3);
 		COLOR3* newLightData = new COLOR3[newColorCount];
 		memset(newLightData, 255, newColorCount * sizeof(COLOR3));
-		int lightmapOffset = 0;
 
+		// lightmaps that keep their size are copied as-is
+		std::vector<int> resizeFaces;
 		for (unsigned int i = 0; i < faceCount; i++) {
-			BSPFACE& face = faces[i];
-
-			g_progress.tick();
-
-			if (lightmap_count(i) == 0) // no lighting
+			if (layerCounts[i] == 0) // no lighting
 				continue;
 
 			LIGHTMAP& oldLight = oldLightmaps[i];
 			LIGHTMAP& newLight = newLightmaps[i];
-			int oldLayerSz = (oldLight.width * oldLight.height) * sizeof(COLOR3);
-			int newLayerSz = (newLight.width * newLight.height) * sizeof(COLOR3);
-			int oldSz = oldLayerSz * oldLight.layers;
-			int newSz = newLayerSz * newLight.layers;
-
-			totalLightmaps++;
 
-			bool faceMoved = oldLightmaps[i].luxelFlags;
+			bool faceMoved = oldLight.luxelFlags;
 			bool lightmapResized = oldLight.width != newLight.width || oldLight.height != newLight.height;
 
-			if (!faceMoved || !lightmapResized) {
-				memcpy((unsigned char*)newLightData + lightmapOffset, (unsigned char*)lightdata + face.nLightmapOffset, oldSz);
-				newLight.luxelFlags = NULL;
+			if (faceMoved && lightmapResized) {
+				resizeFaces.push_back(i);
+				continue;
 			}
-			else {
+
+			int oldSz = (oldLight.width * oldLight.height) * sizeof(COLOR3) * oldLight.layers;
+			memcpy((unsigned char*)newLightData + newOffsets[i], (unsigned char*)lightdata + faces[i].nLightmapOffset, oldSz);
+			newLight.luxelFlags = NULL;
+		}
+
+		// each face writes to its own range of the new lump
+		parallelFor((int)resizeFaces.size(), [&](int start, int end) {
+			for (int k = start; k < end; k++) {
+				int i = resizeFaces[k];
+				BSPFACE& face = faces[i];
+
+				LIGHTMAP& oldLight = oldLightmaps[i];
+				LIGHTMAP& newLight = newLightmaps[i];
+				int oldLayerSz = (oldLight.width * oldLight.height) * sizeof(COLOR3);
+				int newLayerSz = (newLight.width * newLight.height) * sizeof(COLOR3);
+				int lightmapOffset = newOffsets[i];
+
 				newLight.luxelFlags = new unsigned char[newLight.width * newLight.height];
 				qrad_get_lightmap_flags(this, i, newLight.luxelFlags);
 
-				int maxWidth = std::min(newLight.width, oldLight.width);
-				int maxHeight = std::min(newLight.height, oldLight.height);
-
 				int srcOffsetX, srcOffsetY;
 				get_lightmap_shift(oldLight, newLight, srcOffsetX, srcOffsetY);
 
@@ -986,12 +989,15 @@ void Bsp::resize_lightmaps(LIGHTMAP* oldLightmaps, LIGHTMAP* newLightmaps) {
 					}
 				}
 			}
+		}, 4);
 
-			face.nLightmapOffset = lightmapOffset;
-			lightmapOffset += newSz;
+		for (unsigned int i = 0; i < faceCount; i++) {
+			if (layerCounts[i] != 0) {
+				faces[i].nLightmapOffset = newOffsets[i];
+			}
 		}
 
-		replace_lump(LUMP_LIGHTING, newLightData, lightmapOffset);
+		replace_lump(LUMP_LIGHTING, newLightData, newLightDataSz);
 	}
 }
 
@@ -1058,7 +1064,7 @@ void Bsp::split_shared_model_structures(int modelIdx) {
 	memcpy(newClipnodes, clipnodes, clipnodeCount * sizeof(BSPCLIPNODE));
 
 	BSPTEXTUREINFO* newTexinfos = new BSPTEXTUREINFO[newTexinfoCount];
-	memcpy(newTexinfos, texinfos, newTexinfoCount * sizeof(BSPTEXTUREINFO));
+	memcpy(newTexinfos, texinfos, texinfoCount * sizeof(BSPTEXTUREINFO));
 
 	int addIdx = planeCount;
 	for (unsigned int i = 0; i < shouldNotMove.count.planes; i++) {
@@ -1308,37 +1314,346 @@ unsigned int Bsp::remove_unused_textures(bool* usedTextures, int* remappedIndexe
 	return removeCount;
 }
 
+void Bsp::compact_lightmaps(const bool* usedFaces, std::vector<unsigned char>& newData, std::vector<int>& newOffsets, int& sharedFaces) {
+	std::vector<int> lightmapSizes(faceCount, 0);
+	std::vector<unsigned int> hashes(faceCount, 0);
+
+	parallelFor(faceCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			if (!usedFaces[i]) {
+				continue;
+			}
+			BSPFACE& face = faces[i];
+			lightmapSizes[i] = GetFaceLightmapSizeBytes(this, i);
+			if (lightmapSizes[i] && lightmap_in_bounds(i, lightmapSizes[i])) {
+				hashes[i] = hashBytes(lightdata + face.nLightmapOffset, lightmapSizes[i]);
+			}
+		}
+	}, 256);
+
+	newData.clear();
+	newOffsets.resize(faceCount);
+	sharedFaces = 0;
+
+	// lightmap hash -> offsets in the new lump
+	std::unordered_map<unsigned int, std::vector<int>> copies;
+
+	for (unsigned int i = 0; i < faceCount; i++) {
+		BSPFACE& face = faces[i];
+		newOffsets[i] = face.nLightmapOffset;
+
+		if (!usedFaces[i] || !lightmap_in_bounds(i, lightmapSizes[i])) {
+			continue;
+		}
+
+		int sz = lightmapSizes[i];
+		const unsigned char* src = lightdata + face.nLightmapOffset;
+
+		if (sz) {
+			std::vector<int>& candidates = copies[hashes[i]];
+			bool found = false;
+			for (int offset : candidates) {
+				if (offset + sz <= (int)newData.size() && memcmp(&newData[offset], src, sz) == 0) {
+					newOffsets[i] = offset;
+					found = true;
+					break;
+				}
+			}
+			if (found) {
+				sharedFaces++;
+				continue;
+			}
+			candidates.push_back((int)newData.size());
+		}
+
+		newOffsets[i] = (int)newData.size();
+		newData.insert(newData.end(), src, src + sz);
+	}
+}
+
 unsigned int Bsp::remove_unused_lightmaps(bool* usedFaces) {
 	int oldLightdataSize = lightDataLength;
 
-	int* lightmapSizes = new int[faceCount];
+	std::vector<unsigned char> newData;
+	std::vector<int> newOffsets;
+	int sharedFaces = 0;
+	compact_lightmaps(usedFaces, newData, newOffsets, sharedFaces);
 
-	int newLightDataSize = 0;
 	for (unsigned int i = 0; i < faceCount; i++) {
-		if (usedFaces[i]) {
-			lightmapSizes[i] = GetFaceLightmapSizeBytes(this, i);
-			newLightDataSize += lightmapSizes[i];
-		}
+		faces[i].nLightmapOffset = newOffsets[i];
 	}
 
+	int newLightDataSize = (int)newData.size();
 	unsigned char* newColorData = new unsigned char[newLightDataSize];
+	if (newLightDataSize) {
+		memcpy(newColorData, &newData[0], newLightDataSize);
+	}
+
+	replace_lump(LUMP_LIGHTING, newColorData, newLightDataSize);
+
+	return (unsigned int)(oldLightdataSize - newLightDataSize);
+}
+
+unsigned int Bsp::deduplicate_lightmaps(int* sharedFaces) {
+	if (sharedFaces) {
+		*sharedFaces = 0;
+	}
+	if (lightDataLength == 0 || faceCount == 0) {
+		return 0;
+	}
+
+	bool* usedFaces = new bool[faceCount];
+	for (unsigned int i = 0; i < faceCount; i++) {
+		usedFaces[i] = true;
+	}
+
+	std::vector<unsigned char> newData;
+	std::vector<int> newOffsets;
+	int shared = 0;
+	compact_lightmaps(usedFaces, newData, newOffsets, shared);
+	delete[] usedFaces;
+
+	// faces that overlapped in the original lump are split apart, so the new lump isn't always smaller
+	if (newData.size() >= lightDataLength) {
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < faceCount; i++) {
+		faces[i].nLightmapOffset = newOffsets[i];
+	}
+
+	unsigned int saved = lightDataLength - (unsigned int)newData.size();
+	unsigned char* newColorData = new unsigned char[newData.size()];
+	if (newData.size()) {
+		memcpy(newColorData, &newData[0], newData.size());
+	}
+	replace_lump(LUMP_LIGHTING, newColorData, (int)newData.size());
+
+	if (sharedFaces) {
+		*sharedFaces = shared;
+	}
+	return saved;
+}
+
+bool Bsp::unshare_lightmap(int faceIdx) {
+	BSPFACE& face = faces[faceIdx];
+	int sz = GetFaceLightmapSizeBytes(this, faceIdx);
+	if (sz == 0 || !lightmap_in_bounds(faceIdx, sz)) {
+		return false;
+	}
+
+	int start = face.nLightmapOffset;
+	int end = start + sz;
+	bool shared = false;
+	for (unsigned int i = 0; i < faceCount && !shared; i++) {
+		int otherStart = faces[i].nLightmapOffset;
+		if ((int)i == faceIdx || otherStart < 0 || otherStart >= end) {
+			continue;
+		}
+		shared = otherStart + GetFaceLightmapSizeBytes(this, i) > start;
+	}
+
+	if (!shared) {
+		return false;
+	}
+
+	unsigned char* newColorData = new unsigned char[lightDataLength + sz];
+	memcpy(newColorData, lightdata, lightDataLength);
+	memcpy(newColorData + lightDataLength, lightdata + start, sz);
+	face.nLightmapOffset = lightDataLength;
+	replace_lump(LUMP_LIGHTING, newColorData, lightDataLength + sz);
+
+	return true;
+}
+
+void Bsp::find_unlit_light_styles(bool* neverOn) {
+	memset(neverOn, 0, 256 * sizeof(bool));
+
+	// anything that mentions a targetname might trigger it (including multi_manager keys)
+	std::unordered_set<std::string> referencedNames;
+	for (Entity* ent : ents) {
+		for (const std::string& key : ent->keyOrder) {
+			if (key != "targetname" && key != "classname") {
+				referencedNames.insert(ent->keyvalues[key]);
+			}
+		}
+		std::vector<std::string> targets = ent->getTargets();
+		referencedNames.insert(targets.begin(), targets.end());
+	}
+
+	// switchable styles are only turned on by the lights that use them. A style that no light
+	// uses is never set by the game, and renders at normal brightness.
+	bool hasLight[256] = { false };
+	bool canTurnOn[256] = { false };
+	for (Entity* ent : ents) {
+		if (!ent->hasKey("style")) {
+			continue;
+		}
+		int style = atoi(ent->keyvalues["style"].c_str());
+		if (style < 32 || style >= 255) {
+			continue;
+		}
+
+		hasLight[style] = true;
+
+		int spawnflags = atoi(ent->keyvalues["spawnflags"].c_str());
+		bool startsOff = spawnflags & 1;
+		std::string targetname = ent->hasKey("targetname") ? ent->keyvalues["targetname"] : "";
+		bool triggered = !targetname.empty() && referencedNames.count(targetname);
+
+		if (!startsOff || triggered) {
+			canTurnOn[style] = true;
+		}
+	}
+
+	for (int i = 32; i < 255; i++) {
+		neverOn[i] = hasLight[i] && !canTurnOn[i];
+	}
+}
+
+// marks lightmap layers that can't be seen. Layer 0 is always kept.
+static void find_prunable_layers(Bsp* map, const bool* neverOn, std::vector<unsigned char>& dropLayers,
+	std::vector<unsigned char>& blackLayers)
+{
+	dropLayers.assign(map->faceCount, 0);
+	blackLayers.assign(map->faceCount, 0);
+
+	parallelFor(map->faceCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			BSPFACE& face = map->faces[i];
+			if (face.nStyles[0] == 255 || !map->lightmap_in_bounds(i, GetFaceLightmapSizeBytes(map, i))) {
+				continue;
+			}
+
+			int size[2];
+			GetFaceLightmapSize(map, i, size);
+			int layerSz = size[0] * size[1] * sizeof(COLOR3);
+
+			for (int s = 1; s < MAXLIGHTMAPS && face.nStyles[s] != 255; s++) {
+				const unsigned char* layer = map->lightdata + face.nLightmapOffset + s * layerSz;
+				bool black = true;
+				for (int k = 0; k < layerSz && black; k++) {
+					black = layer[k] == 0;
+				}
+
+				if (black) {
+					blackLayers[i] |= 1 << s;
+				}
+				if (black || neverOn[face.nStyles[s]]) {
+					dropLayers[i] |= 1 << s;
+				}
+			}
+		}
+	}, 256);
+}
+
+void Bsp::analyze_light_styles(std::vector<LightStyleUsage>& usage) {
+	bool neverOn[256];
+	find_unlit_light_styles(neverOn);
+
+	std::vector<unsigned char> dropLayers, blackLayers;
+	find_prunable_layers(this, neverOn, dropLayers, blackLayers);
+
+	usage.resize(256);
+	for (int i = 0; i < 256; i++) {
+		usage[i] = LightStyleUsage();
+		usage[i].neverOn = neverOn[i];
+	}
 
-	int offset = 0;
 	for (unsigned int i = 0; i < faceCount; i++) {
 		BSPFACE& face = faces[i];
+		if (!lightmap_in_bounds(i, GetFaceLightmapSizeBytes(this, i))) {
+			continue;
+		}
+
+		int size[2];
+		GetFaceLightmapSize(this, i, size);
+		int layerSz = size[0] * size[1] * sizeof(COLOR3);
+
+		for (int s = 0; s < MAXLIGHTMAPS && face.nStyles[s] != 255; s++) {
+			LightStyleUsage& use = usage[face.nStyles[s]];
+			use.layers++;
+			use.bytes += layerSz;
+			if (blackLayers[i] & (1 << s)) {
+				use.blackLayers++;
+			}
+			if (dropLayers[i] & (1 << s)) {
+				use.prunableBytes += layerSz;
+			}
+		}
+	}
+}
+
+int Bsp::prune_light_styles(unsigned int* bytesSaved) {
+	if (bytesSaved) {
+		*bytesSaved = 0;
+	}
+
+	bool neverOn[256];
+	find_unlit_light_styles(neverOn);
+
+	std::vector<unsigned char> dropLayers, blackLayers;
+	find_prunable_layers(this, neverOn, dropLayers, blackLayers);
 
-		if (usedFaces[i] && (face.nLightmapOffset + lightmapSizes[i]) <= (unsigned int)lightDataLength) {
-			memcpy(newColorData + offset, lightdata + face.nLightmapOffset, lightmapSizes[i]);
-			face.nLightmapOffset = offset;
-			offset += lightmapSizes[i];
+	int droppedLayers = 0;
+	for (unsigned int i = 0; i < faceCount; i++) {
+		for (int s = 1; s < MAXLIGHTMAPS; s++) {
+			droppedLayers += (dropLayers[i] >> s) & 1;
 		}
 	}
+	if (!droppedLayers) {
+		return 0;
+	}
 
-	delete[] lightmapSizes;
+	unsigned int oldLightDataLength = lightDataLength;
 
-	replace_lump(LUMP_LIGHTING, newColorData, newLightDataSize);
+	std::vector<unsigned char> newData;
+	newData.reserve(lightDataLength);
 
-	return (unsigned int)(oldLightdataSize - newLightDataSize);
+	for (unsigned int i = 0; i < faceCount; i++) {
+		BSPFACE& face = faces[i];
+		int sz = GetFaceLightmapSizeBytes(this, i);
+		if (!lightmap_in_bounds(i, sz)) {
+			// the old offset won't point at anything useful in the new lump
+			face.nLightmapOffset = -1;
+			memset(face.nStyles, 255, MAXLIGHTMAPS);
+			continue;
+		}
+
+		int size[2];
+		GetFaceLightmapSize(this, i, size);
+		int layerSz = size[0] * size[1] * sizeof(COLOR3);
+		int layerCount = layerSz ? sz / layerSz : 0;
+
+		const unsigned char* src = lightdata + face.nLightmapOffset;
+		face.nLightmapOffset = (int)newData.size();
+
+		unsigned char newStyles[MAXLIGHTMAPS] = { 255, 255, 255, 255 };
+		int newCount = 0;
+		for (int s = 0; s < layerCount; s++) {
+			if (dropLayers[i] & (1 << s)) {
+				continue;
+			}
+			newStyles[newCount++] = face.nStyles[s];
+			newData.insert(newData.end(), src + s * layerSz, src + (s + 1) * layerSz);
+		}
+		memcpy(face.nStyles, newStyles, MAXLIGHTMAPS);
+	}
+
+	unsigned char* newColorData = new unsigned char[newData.size()];
+	if (newData.size()) {
+		memcpy(newColorData, &newData[0], newData.size());
+	}
+	replace_lump(LUMP_LIGHTING, newColorData, (int)newData.size());
+
+	// faces that shared lightmaps were copied separately
+	deduplicate_lightmaps();
+
+	if (bytesSaved) {
+		*bytesSaved = oldLightDataLength > lightDataLength ? oldLightDataLength - lightDataLength : 0;
+	}
+
+	return droppedLayers;
 }
 
 unsigned int Bsp::remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, int oldLeafCount) {
@@ -1354,39 +1669,90 @@ unsigned int Bsp::remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, in
 	unsigned int oldVisRowSize = ((oldVisLeafCount + 63) & ~63) >> 3;
 	unsigned int newVisRowSize = ((newVisLeafCount + 63) & ~63) >> 3;
 
-	int decompressedVisSize = oldLeafCount * oldVisRowSize;
-	unsigned char* decompressedVis = new unsigned char[decompressedVisSize];
-	memset(decompressedVis, 0, decompressedVisSize);
-	decompress_vis_lump(oldLeaves, lumps[LUMP_VISIBILITY], decompressedVis,
-		oldWorldLeaves, oldVisLeafCount, oldVisLeafCount);
+	// world leaves keep their indexes, so each row only needs to be resized. Rows are decompressed
+	// and recompressed one at a time instead of decompressing the whole vis lump.
+	int rowCount = std::max(0, std::min(newWorldLeaves, newVisLeafCount));
+	std::vector<int> visOffsets(rowCount);
+
+	VisLumpWriter visWriter;
+	if (oldVisRowSize <= newVisRowSize) {
+		visWriter.addRows(rowCount, newVisRowSize, [&](int i, unsigned char* row) {
+			decompress_vis_row(oldLeaves[i + 1], lumps[LUMP_VISIBILITY], row, oldWorldLeaves, oldVisLeafCount, oldVisLeafCount);
+		}, rowCount ? &visOffsets[0] : NULL);
+	}
+	else {
+		// rows are decompressed at the old size and truncated
+		visWriter.addRows(rowCount, newVisRowSize, [&](int i, unsigned char* row) {
+			std::vector<unsigned char> oldRow(oldVisRowSize);
+			decompress_vis_row(oldLeaves[i + 1], lumps[LUMP_VISIBILITY], &oldRow[0], oldWorldLeaves, oldVisLeafCount, oldVisLeafCount);
+			memcpy(row, &oldRow[0], newVisRowSize);
+		}, rowCount ? &visOffsets[0] : NULL);
+	}
+
+	for (int i = 0; i < rowCount; i++) {
+		leaves[i + 1].nVisOffset = visOffsets[i];
+	}
+
+	int newVisLen = visWriter.size();
+	replace_lump(LUMP_VISIBILITY, visWriter.copyData(), newVisLen);
+
+	return (unsigned int)(oldVisLength - newVisLen);
+}
+
+unsigned int Bsp::deduplicate_visdata() {
+	if (visDataLength <= 0 || leafCount <= 1) {
+		return 0;
+	}
 
-	if (oldVisRowSize != newVisRowSize) {
-		int newDecompressedVisSize = oldLeafCount * newVisRowSize;
-		unsigned char* newDecompressedVis = new unsigned char[decompressedVisSize];
-		memset(newDecompressedVis, 0, newDecompressedVisSize);
+	// find the compressed size of every row without decompressing it. Rows that run past the end of
+	// the lump keep all the bytes up to the end, so that the same data is read as before.
+	int visLeaves = leafCount - 1;
+	const unsigned char* visEnd = visdata + visDataLength;
+	std::vector<int> rowLens(leafCount, 0);
+	std::atomic<bool> badOffset(false);
+
+	parallelFor(leafCount - 1, [&](int start, int end) {
+		for (int i = start + 1; i < end + 1; i++) {
+			int offset = leaves[i].nVisOffset;
+			if (offset < 0) {
+				continue;
+			}
+			if (offset >= visDataLength) {
+				badOffset = true;
+				continue;
+			}
 
-		int minRowSize = std::min(oldVisRowSize, newVisRowSize);
-		for (int i = 0; i < oldWorldLeaves; i++) {
-			memcpy(newDecompressedVis + i * newVisRowSize, decompressedVis + i * oldVisRowSize, minRowSize);
+			int len = CompressedVisRowLength(visdata + offset, visEnd, visLeaves);
+			rowLens[i] = len >= 0 ? len : visDataLength - offset;
 		}
+	}, 256);
 
-		delete[] decompressedVis;
-		decompressedVis = newDecompressedVis;
+	if (badOffset) {
+		logf("Can't deduplicate VIS rows: some leaves have invalid VIS offsets\n");
+		return 0;
 	}
 
-	unsigned char* compressedVis = new unsigned char[decompressedVisSize];
-	memset(compressedVis, 0, decompressedVisSize);
-	int64_t newVisLen = CompressAll(leaves, decompressedVis, compressedVis, newVisLeafCount, newWorldLeaves, decompressedVisSize);
+	VisLumpWriter visWriter;
+	std::vector<int> newOffsets(leafCount, -1);
+	for (int i = 1; i < leafCount; i++) {
+		if (leaves[i].nVisOffset >= 0) {
+			newOffsets[i] = visWriter.addCompressedRow(visdata + leaves[i].nVisOffset, rowLens[i]);
+		}
+	}
 
-	unsigned char* compressedVisResized = new unsigned char[newVisLen];
-	memcpy(compressedVisResized, compressedVis, newVisLen);
+	// rows can overlap in the original lump, so the new lump isn't always smaller
+	if (visWriter.size() >= visDataLength) {
+		return 0;
+	}
 
-	replace_lump(LUMP_VISIBILITY, compressedVisResized, newVisLen);
+	for (int i = 1; i < leafCount; i++) {
+		leaves[i].nVisOffset = newOffsets[i];
+	}
 
-	delete[] decompressedVis;
-	delete[] compressedVis;
+	unsigned int saved = visDataLength - visWriter.size();
+	replace_lump(LUMP_VISIBILITY, visWriter.copyData(), visWriter.size());
 
-	return (unsigned int)(oldVisLength - newVisLen);
+	return saved;
 }
 
 STRUCTCOUNT Bsp::remove_unused_model_structures(bool export_bsp_with_clipnodes) {
@@ -1403,20 +1769,13 @@ STRUCTCOUNT Bsp::remove_unused_model_structures(bool export_bsp_with_clipnodes)
 		}
 	}
 
-	// reversed so models can be deleted without shifting the next delete index
-	if (modelCount > 0)
-	{
-		for (int i = (int)modelCount - 1; i >= 0; i--) {
-			if (!usedModels[i]) {
-				delete_model(i);
-			}
-			else {
-				mark_model_structures(i, &usedStructures, false);
-			}
-		}
-	}
+	delete_models(usedModels);
 	delete[] usedModels;
 
+	for (unsigned int i = 0; i < modelCount; i++) {
+		mark_model_structures(i, &usedStructures, false);
+	}
+
 	STRUCTREMAP remap(this);
 	STRUCTCOUNT removeCount;
 	memset(&removeCount, 0, sizeof(STRUCTCOUNT));
@@ -1511,27 +1870,12 @@ STRUCTCOUNT Bsp::remove_unused_model_structures(bool export_bsp_with_clipnodes)
 }
 
 bool Bsp::has_hull2_ents() {
-	// monsters that use hull 2 by default
-	static std::set<std::string> largeMonsters{
-		"monster_alien_grunt",
-		"monster_alien_tor",
-		"monster_alien_voltigore",
-		"monster_babygarg",
-		"monster_bigmomma",
-		"monster_bullchicken",
-		"monster_gargantua",
-		"monster_ichthyosaur",
-		"monster_kingpin",
-		"monster_apache",
-		"monster_blkop_apache"
-		// osprey, nihilanth, and tentacle are huge but are basically nonsolid (no brush collision or triggers)
-	};
-
 	for (int i = 0; i < ents.size(); i++) {
 		std::string cname = ents[i]->keyvalues["classname"];
 		//std::string tname = ents[i]->keyvalues["targetname"];
+		int rules = ents[i]->getClassnameRules();
 
-		if (cname.find("monster_") == 0) {
+		if (cname.find("monster_") == 0 || (rules & CNAME_LARGE_MONSTER)) {
 			vec3 minhull;
 			vec3 maxhull;
 
@@ -1542,7 +1886,7 @@ bool Bsp::has_hull2_ents() {
 
 			if (minhull == vec3(0, 0, 0) && maxhull == vec3(0, 0, 0)) {
 				// monster is using its default hull size
-				if (largeMonsters.find(cname) != largeMonsters.end()) {
+				if (rules & CNAME_LARGE_MONSTER) {
 					return true;
 				}
 			}
@@ -1577,11 +1921,13 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 
 	int deletedHulls = 0;
 
+	std::vector<std::vector<int>> modelEnts = get_model_ents_map();
+
 	for (unsigned int i = 1; i < modelCount; i++) {
 		if (!g_verbose && !noProgress)
 			g_progress.tick();
 
-		std::vector<Entity*> usageEnts = get_model_ents(i);
+		std::vector<Entity*> usageEnts = get_model_ents(i, modelEnts);
 
 		if (usageEnts.size() == 0) {
 			debugf("Deleting unused model %d\n", i);
@@ -1589,52 +1935,11 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 			for (int k = 0; k < MAX_MAP_HULLS; k++)
 				deletedHulls += models[i].iHeadnodes[k] >= 0;
 
-			delete_model(i);
-			//modelCount--; automatically updated when lump is replaced
-			i--;
+			// deleted along with the other unused models in remove_unused_model_structures,
+			// so that model indexes stay valid for the rest of this pass
 			continue;
 		}
 
-		std::set<std::string> conditionalPointEntTriggers;
-		conditionalPointEntTriggers.insert("trigger_once");
-		conditionalPointEntTriggers.insert("trigger_multiple");
-		conditionalPointEntTriggers.insert("trigger_counter");
-		conditionalPointEntTriggers.insert("trigger_gravity");
-		conditionalPointEntTriggers.insert("trigger_teleport");
-
-		std::set<std::string> entsThatNeverNeedAnyHulls;
-		entsThatNeverNeedAnyHulls.insert("env_bubbles");
-		entsThatNeverNeedAnyHulls.insert("func_tankcontrols");
-		entsThatNeverNeedAnyHulls.insert("func_traincontrols");
-		entsThatNeverNeedAnyHulls.insert("func_vehiclecontrols");
-		entsThatNeverNeedAnyHulls.insert("trigger_autosave"); // obsolete in sven
-		entsThatNeverNeedAnyHulls.insert("trigger_endsection"); // obsolete in sven
-
-		std::set<std::string> entsThatNeverNeedCollision;
-		entsThatNeverNeedCollision.insert("func_illusionary");
-		entsThatNeverNeedCollision.insert("func_mortar_field");
-
-		std::set<std::string> passableEnts;
-		passableEnts.insert("func_door");
-		passableEnts.insert("func_door_rotating");
-		passableEnts.insert("func_pendulum");
-		passableEnts.insert("func_tracktrain");
-		passableEnts.insert("func_train");
-		passableEnts.insert("func_water");
-		passableEnts.insert("momentary_door");
-
-		std::set<std::string> playerOnlyTriggers;
-		playerOnlyTriggers.insert("func_ladder");
-		playerOnlyTriggers.insert("game_zone_player");
-		playerOnlyTriggers.insert("player_respawn_zone");
-		playerOnlyTriggers.insert("trigger_cdaudio");
-		playerOnlyTriggers.insert("trigger_changelevel");
-		playerOnlyTriggers.insert("trigger_transition");
-
-		std::set<std::string> monsterOnlyTriggers;
-		monsterOnlyTriggers.insert("func_monsterclip");
-		monsterOnlyTriggers.insert("trigger_monsterjump");
-
 		std::string uses;
 		bool needsPlayerHulls = false; // HULL 1 + HULL 3
 		bool needsMonsterHulls = false; // All HULLs
@@ -1643,29 +1948,30 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 			std::string cname = usageEnts[k]->keyvalues["classname"];
 			std::string tname = usageEnts[k]->keyvalues["targetname"];
 			int spawnflags = atoi(usageEnts[k]->keyvalues["spawnflags"].c_str());
+			int rules = usageEnts[k]->getClassnameRules();
 
 			if (k != 0) {
 				uses += ", ";
 			}
 			uses += "\"" + tname + "\" (" + cname + ")";
 
-			if (entsThatNeverNeedAnyHulls.find(cname) != entsThatNeverNeedAnyHulls.end()) {
+			if (rules & CNAME_NEVER_NEEDS_HULLS) {
 				continue; // no collision or faces needed at all
 			}
-			else if (entsThatNeverNeedCollision.find(cname) != entsThatNeverNeedCollision.end()) {
+			else if (rules & CNAME_NEVER_NEEDS_COLLISION) {
 				needsVisibleHull = !is_invisible_solid(usageEnts[k]);
 			}
-			else if (passableEnts.find(cname) != passableEnts.end()) {
+			else if (rules & CNAME_PASSABLE) {
 				needsPlayerHulls = needsMonsterHulls = !(spawnflags & 8); // "Passable" or "Not solid" unchecked
 				needsVisibleHull = !(spawnflags & 8) || !is_invisible_solid(usageEnts[k]);
 			}
+			else if (rules & CNAME_CONDITIONAL_TRIGGER) {
+				needsVisibleHull = spawnflags & 8; // "Everything else" flag checked
+				needsPlayerHulls = !(spawnflags & 2); // "No clients" unchecked
+				needsMonsterHulls = (spawnflags & 1) || (spawnflags & 4); // "monsters" or "pushables" checked
+			}
 			else if (cname.find("trigger_") == 0) {
-				if (conditionalPointEntTriggers.find(cname) != conditionalPointEntTriggers.end()) {
-					needsVisibleHull = spawnflags & 8; // "Everything else" flag checked
-					needsPlayerHulls = !(spawnflags & 2); // "No clients" unchecked
-					needsMonsterHulls = (spawnflags & 1) || (spawnflags & 4); // "monsters" or "pushables" checked
-				}
-				else if (cname == "trigger_push") {
+				if (cname == "trigger_push") {
 					needsPlayerHulls = !(spawnflags & 8); // "No clients" unchecked
 					needsMonsterHulls = (spawnflags & 4) || !(spawnflags & 16); // "Pushables" checked or "No monsters" unchecked
 					needsVisibleHull = true; // needed for point-ent pushing
@@ -1704,10 +2010,10 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 				needsPlayerHulls = true;
 				needsVisibleHull = true;
 			}
-			else if (playerOnlyTriggers.find(cname) != playerOnlyTriggers.end()) {
+			else if (rules & CNAME_PLAYER_ONLY_TRIGGER) {
 				needsPlayerHulls = true;
 			}
-			else if (monsterOnlyTriggers.find(cname) != monsterOnlyTriggers.end()) {
+			else if (rules & CNAME_MONSTER_ONLY_TRIGGER) {
 				needsMonsterHulls = true;
 			}
 			else {
@@ -1773,6 +2079,307 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 	return removed;
 }
 
+STRUCTCOUNT Bsp::weld_vertices(float epsilon) {
+	STRUCTCOUNT removed;
+	memset(&removed, 0, sizeof(STRUCTCOUNT));
+
+	if (vertCount == 0 || edgeCount == 0) {
+		return removed;
+	}
+
+	g_progress.update("Welding vertices", 0);
+
+	// vertices are welded into the first vertex found within epsilon on every axis. The grid cells
+	// are at least epsilon wide, so only the 27 cells around a vertex need to be searched.
+	float cellSize = epsilon > 0 ? epsilon : 1.0f;
+	std::vector<int> cellX(vertCount), cellY(vertCount), cellZ(vertCount);
+	parallelFor(vertCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			cellX[i] = (int)floorf(verts[i].x / cellSize);
+			cellY[i] = (int)floorf(verts[i].y / cellSize);
+			cellZ[i] = (int)floorf(verts[i].z / cellSize);
+		}
+	}, 1024);
+
+	auto cellKey = [](int x, int y, int z) {
+		return ((uint64_t)(unsigned int)x * 73856093ULL) ^ ((uint64_t)(unsigned int)y * 19349663ULL) ^ ((uint64_t)(unsigned int)z * 83492791ULL);
+	};
+
+	// moving a vertex can change the texture extents of its faces, which would break the lightmaps.
+	// Faces that change get their vertices pinned and the weld is retried.
+	std::vector<int> oldMins(faceCount * 2), oldMaxs(faceCount * 2);
+	parallelFor(faceCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			GetFaceExtents(this, i, &oldMins[i * 2], &oldMaxs[i * 2]);
+		}
+	});
+
+	std::vector<vec3> oldVerts(verts, verts + vertCount);
+	std::vector<bool> pinned(vertCount, false);
+	std::vector<int> weldedTo(vertCount);
+	std::vector<int> nextInCell(vertCount);
+
+	while (true) {
+		std::unordered_map<uint64_t, int> cellHeads;
+		cellHeads.reserve(vertCount);
+
+		for (int i = 0; i < vertCount; i++) {
+			weldedTo[i] = i;
+
+			if (!pinned[i]) {
+				for (int x = -1; x <= 1 && weldedTo[i] == i; x++) {
+					for (int y = -1; y <= 1 && weldedTo[i] == i; y++) {
+						for (int z = -1; z <= 1 && weldedTo[i] == i; z++) {
+							auto head = cellHeads.find(cellKey(cellX[i] + x, cellY[i] + y, cellZ[i] + z));
+							if (head == cellHeads.end())
+								continue;
+
+							for (int k = head->second; k != -1; k = nextInCell[k]) {
+								vec3 delta = oldVerts[k] - oldVerts[i];
+								if (fabs(delta.x) <= epsilon && fabs(delta.y) <= epsilon && fabs(delta.z) <= epsilon) {
+									weldedTo[i] = k;
+									break;
+								}
+							}
+						}
+					}
+				}
+			}
+
+			if (weldedTo[i] == i) {
+				uint64_t key = cellKey(cellX[i], cellY[i], cellZ[i]);
+				auto head = cellHeads.find(key);
+				nextInCell[i] = head != cellHeads.end() ? head->second : -1;
+				cellHeads[key] = i;
+			}
+		}
+
+		for (int i = 0; i < vertCount; i++) {
+			verts[i] = oldVerts[weldedTo[i]];
+		}
+
+		std::vector<unsigned char> changedFaces(faceCount, 0);
+		std::atomic<int> changedCount(0);
+		parallelFor(faceCount, [&](int start, int end) {
+			for (int i = start; i < end; i++) {
+				int mins[2], maxs[2];
+				GetFaceExtents(this, i, mins, maxs);
+				if (mins[0] != oldMins[i * 2] || mins[1] != oldMins[i * 2 + 1] ||
+					maxs[0] != oldMaxs[i * 2] || maxs[1] != oldMaxs[i * 2 + 1]) {
+					changedFaces[i] = 1;
+					changedCount++;
+				}
+			}
+		});
+
+		if (changedCount == 0) {
+			break;
+		}
+
+		int newPins = 0;
+		for (int i = 0; i < faceCount; i++) {
+			if (!changedFaces[i])
+				continue;
+
+			BSPFACE& face = faces[i];
+			for (int e = 0; e < face.nEdges; e++) {
+				BSPEDGE& edge = edges[abs(surfedges[face.iFirstEdge + e])];
+				for (int v = 0; v < 2; v++) {
+					if (weldedTo[edge.iVertex[v]] != edge.iVertex[v] && !pinned[edge.iVertex[v]]) {
+						pinned[edge.iVertex[v]] = true;
+						newPins++;
+					}
+				}
+			}
+		}
+		memcpy(verts, &oldVerts[0], vertCount * sizeof(vec3));
+
+		if (newPins == 0) {
+			break; // extents changed without any welded vertices (shouldn't happen)
+		}
+	}
+	memcpy(verts, &oldVerts[0], vertCount * sizeof(vec3));
+
+	for (int i = 0; i < edgeCount; i++) {
+		edges[i].iVertex[0] = weldedTo[edges[i].iVertex[0]];
+		edges[i].iVertex[1] = weldedTo[edges[i].iVertex[1]];
+	}
+
+	// edges with the same vertices are merged into the first one. Edges used in the opposite
+	// direction flip the sign of the surfedges that reference them.
+	// edge 0 can't be referenced by a negative surfedge, so it is never a merge target.
+	std::vector<int> edgeRemap(edgeCount);
+	std::vector<bool> degenerateEdges(edgeCount, false);
+	std::unordered_map<uint64_t, int> edgeLookup;
+	edgeLookup.reserve(edgeCount);
+	edgeRemap[0] = 0;
+
+	for (int i = 1; i < edgeCount; i++) {
+		unsigned int v0 = edges[i].iVertex[0];
+		unsigned int v1 = edges[i].iVertex[1];
+		edgeRemap[i] = i;
+
+		if (v0 == v1) {
+			degenerateEdges[i] = true;
+			continue;
+		}
+
+		auto same = edgeLookup.find(((uint64_t)v0 << 32) | v1);
+		if (same != edgeLookup.end()) {
+			edgeRemap[i] = same->second;
+			continue;
+		}
+
+		auto flipped = edgeLookup.find(((uint64_t)v1 << 32) | v0);
+		if (flipped != edgeLookup.end()) {
+			edgeRemap[i] = -flipped->second;
+			continue;
+		}
+
+		edgeLookup[((uint64_t)v0 << 32) | v1] = i;
+	}
+
+	// surfedges on welded edges are dropped, unless that would leave a face with less than 3 edges
+	bool* usedSurfedges = new bool[surfedgeCount];
+	memset(usedSurfedges, 0, surfedgeCount * sizeof(bool));
+
+	parallelFor(surfedgeCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			int e = surfedges[i];
+			int newEdge = edgeRemap[abs(e)];
+			surfedges[i] = e >= 0 ? newEdge : -newEdge;
+		}
+	}, 1024);
+
+	for (int i = 0; i < faceCount; i++) {
+		BSPFACE& face = faces[i];
+
+		int keepCount = 0;
+		for (int e = 0; e < face.nEdges; e++) {
+			keepCount += !degenerateEdges[abs(surfedges[face.iFirstEdge + e])];
+		}
+
+		for (int e = 0; e < face.nEdges; e++) {
+			if (keepCount < 3 || !degenerateEdges[abs(surfedges[face.iFirstEdge + e])])
+				usedSurfedges[face.iFirstEdge + e] = true;
+		}
+	}
+
+	// remaining surfedges shift down to fill the gaps
+	std::vector<int> keptBefore(surfedgeCount + 1);
+	keptBefore[0] = 0;
+	for (int i = 0; i < surfedgeCount; i++) {
+		keptBefore[i + 1] = keptBefore[i] + usedSurfedges[i];
+	}
+
+	parallelFor(faceCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			BSPFACE& face = faces[i];
+			int first = face.iFirstEdge;
+			face.iFirstEdge = keptBefore[first];
+			face.nEdges = keptBefore[first + face.nEdges] - keptBefore[first];
+		}
+	});
+
+	int* remappedSurfedges = new int[surfedgeCount];
+	removed.surfEdges = remove_unused_structs(LUMP_SURFEDGES, usedSurfedges, remappedSurfedges);
+	delete[] remappedSurfedges;
+	delete[] usedSurfedges;
+
+	bool* usedEdges = new bool[edgeCount];
+	memset(usedEdges, 0, edgeCount * sizeof(bool));
+	usedEdges[0] = true;
+	for (int i = 0; i < surfedgeCount; i++) {
+		usedEdges[abs(surfedges[i])] = true;
+	}
+
+	int* remappedEdges = new int[edgeCount];
+	removed.edges = remove_unused_structs(LUMP_EDGES, usedEdges, remappedEdges);
+	delete[] usedEdges;
+
+	parallelFor(surfedgeCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			int e = surfedges[i];
+			surfedges[i] = e >= 0 ? remappedEdges[e] : -remappedEdges[-e];
+		}
+	}, 1024);
+	delete[] remappedEdges;
+
+	bool* usedVerts = new bool[vertCount];
+	memset(usedVerts, 0, vertCount * sizeof(bool));
+	for (int i = 0; i < edgeCount; i++) {
+		usedVerts[edges[i].iVertex[0]] = true;
+		usedVerts[edges[i].iVertex[1]] = true;
+	}
+
+	int* remappedVerts = new int[vertCount];
+	removed.verts = remove_unused_structs(LUMP_VERTICES, usedVerts, remappedVerts);
+	delete[] usedVerts;
+
+	for (int i = 0; i < edgeCount; i++) {
+		edges[i].iVertex[0] = remappedVerts[edges[i].iVertex[0]];
+		edges[i].iVertex[1] = remappedVerts[edges[i].iVertex[1]];
+	}
+	delete[] remappedVerts;
+
+	g_progress.clear();
+
+	return removed;
+}
+
+unsigned int Bsp::strip_default_keyvalues(Fgd* fgd, bool allDefaults) {
+	update_ent_lump();
+	unsigned int oldEntLength = header.lump[LUMP_ENTITIES].nLength;
+
+	// strippable default values per classname, built before the parallel pass so
+	// that the worker threads only read shared data
+	std::map<std::string, hashmap> classDefaults;
+	for (int i = 0; i < ents.size(); i++) {
+		std::string cname = ents[i]->keyvalues["classname"];
+		if (classDefaults.find(cname) != classDefaults.end()) {
+			continue;
+		}
+
+		hashmap& defaults = classDefaults[cname];
+		FgdClass* fgdClass = fgd ? fgd->getFgdClass(cname) : NULL;
+		if (!fgdClass) {
+			continue;
+		}
+
+		for (int k = 0; k < fgdClass->keyvalues.size(); k++) {
+			KeyvalueDef& def = fgdClass->keyvalues[k];
+			if (def.iType == FGD_KEY_FLAGS || def.defaultValue.empty()) {
+				continue;
+			}
+			if (allDefaults || isZeroValue(def.defaultValue)) {
+				defaults[def.name] = def.defaultValue;
+			}
+		}
+	}
+
+	std::atomic<int> removedKeys(0);
+
+	parallelFor((int)ents.size(), [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			Entity* ent = ents[i];
+			const hashmap& defaults = classDefaults.find(ent->keyvalues["classname"])->second;
+
+			int removed = ent->clearEmptyKeyvalues(&defaults);
+			if (removed) {
+				debugf("Stripped %d default keyvalues from entity %d (%s)\n", removed, i, ent->keyvalues["classname"].c_str());
+			}
+			removedKeys += removed;
+		}
+	});
+
+	update_ent_lump();
+
+	unsigned int newEntLength = header.lump[LUMP_ENTITIES].nLength;
+	logf("Stripped %d default keyvalues\n", removedKeys.load());
+
+	return oldEntLength - newEntLength;
+}
+
 bool Bsp::is_invisible_solid(Entity* ent) {
 	if (!ent->isBspModel())
 		return false;
@@ -1800,6 +2407,10 @@ bool Bsp::is_invisible_solid(Entity* ent) {
 	};
 
 	for (int i = 0; i < ents.size(); i++) {
+		if (!(ents[i]->getClassnameRules() & CNAME_RENDER_CHANGER)) {
+			continue;
+		}
+
 		std::string cname = ents[i]->keyvalues["classname"];
 
 		if (cname == "env_render") {
@@ -1834,6 +2445,9 @@ bool Bsp::is_invisible_solid(Entity* ent) {
 				return false; // assume the target is visible
 			}
 		}
+		else {
+			return false; // a render changer from a rules file. Its keys are unknown, so assume it affects the brush
+		}
 	}
 
 	return true;
@@ -1905,30 +2519,7 @@ void Bsp::get_lightmap_shift(const LIGHTMAP& oldLightmap, const LIGHTMAP& newLig
 }
 
 void Bsp::update_ent_lump(bool stripNodes) {
-	std::stringstream ent_data;
-
-	for (int i = 0; i < ents.size(); i++) {
-		if (stripNodes) {
-			std::string cname = ents[i]->keyvalues["classname"];
-			if (cname == "info_node" || cname == "info_node_air") {
-				continue;
-			}
-		}
-
-		ent_data << "{\n";
-
-		for (int k = 0; k < ents[i]->keyOrder.size(); k++) {
-			std::string key = ents[i]->keyOrder[k];
-			ent_data << "\"" << key << "\" \"" << ents[i]->keyvalues[key] << "\"\n";
-		}
-
-		ent_data << "}";
-		if (i < ents.size() - 1) {
-			ent_data << "\n"; // trailing newline crashes sven, and only sven, and only sometimes
-		}
-	}
-
-	std::string str_data = ent_data.str();
+	std::string str_data = serializeEntities(ents, stripNodes);
 
 	unsigned char* newEntData = new unsigned char[str_data.size() + 1];
 	memcpy(newEntData, str_data.c_str(), str_data.size());
@@ -1948,6 +2539,11 @@ vec3 Bsp::get_model_center(int modelIdx) {
 	return model.nMins + (model.nMaxs - model.nMins) * 0.5f;
 }
 
+bool Bsp::lightmap_in_bounds(int faceIdx, int sz) {
+	unsigned int offset = faces[faceIdx].nLightmapOffset;
+	return offset != (unsigned int)-1 && (uint64_t)offset + (uint64_t)sz <= (uint64_t)lightDataLength;
+}
+
 int Bsp::lightmap_count(int faceIdx) {
 	BSPFACE& face = faces[faceIdx];
 
@@ -2123,117 +2719,7 @@ void Bsp::load_ents()
 		delete ents[i];
 	ents.clear();
 
-	bool verbose = true;
-	membuf sbuf((char*)lumps[LUMP_ENTITIES], header.lump[LUMP_ENTITIES].nLength);
-	std::istream in(&sbuf);
-
-	int lineNum = 0;
-	int lastBracket = -1;
-	Entity* ent = NULL;
-
-	std::string line;
-	while (std::getline(in, line))
-	{
-		lineNum++;
-
-		while (line[0] == ' ' || line[0] == '\t' || line[0] == '\r')
-		{
-			line.erase(line.begin());
-		}
-
-		if (line.length() < 1 || line[0] == '\n')
-			continue;
-
-		if (line[0] == '{')
-		{
-			if (lastBracket == 0)
-			{
-				logf("%s.bsp ent data (line %d): Unexpected '{'\n", path.c_str(), lineNum);
-				continue;
-			}
-			lastBracket = 0;
-			if (ent)
-				delete ent;
-			ent = new Entity();
-
-			if (line.find('}') == std::string::npos &&
-				line.find('\"') == std::string::npos)
-			{
-				continue;
-			}
-		}
-		if (line[0] == '}')
-		{
-			if (lastBracket == 1)
-				logf("%s.bsp ent data (line %d): Unexpected '}'\n", path.c_str(), lineNum);
-			lastBracket = 1;
-			if (!ent)
-				continue;
-
-			if (ent->keyvalues.count("classname"))
-				ents.push_back(ent);
-			else
-				logf("Found unknown classname entity. Skip it.\n");
-
-			ent = NULL;
-
-			// you can end/start an ent on the same line, you know
-			if (line.find('{') != std::string::npos)
-			{
-				ent = new Entity();
-				lastBracket = 0;
-
-				if (line.find('\"') == std::string::npos)
-				{
-					continue;
-				}
-				line.erase(line.begin());
-			}
-		}
-		if (lastBracket == 0 && ent) // currently defining an entity
-		{
-			Keyvalues k(line);
-			for (int i = 0; i < k.keys.size(); i++)
-			{
-				ent->addKeyvalue(k.keys[i],k.values[i]);
-			}
-
-			if (line.find('}') != std::string::npos)
-			{
-				lastBracket = 1;
-
-				if (ent->keyvalues.count("classname"))
-					ents.push_back(ent);
-				else
-					logf("Found unknown classname entity. Skip it.\n");
-				ent = NULL;
-			}
-			if (line.find('{') != std::string::npos)
-			{
-				ent = new Entity();
-				lastBracket = 0;
-			}
-		}
-	}
-
-	if (ents.size() > 1)
-	{
-		if (ents[0]->keyvalues["classname"] != "worldspawn")
-		{
-			logf("First entity has classname different from 'woldspawn', we do fixup it\n");
-			for (int i = 1; i < ents.size(); i++)
-			{
-				if (ents[i]->keyvalues["classname"] == "worldspawn")
-				{
-					std::swap(ents[0], ents[i]);
-					break;
-				}
-			}
-		}
-	}
-
-	if (ent)
-		delete ent;
+	parseEntities((char*)lumps[LUMP_ENTITIES], header.lump[LUMP_ENTITIES].nLength, path, ents);
 }
 
 void Bsp::print_stat(const std::string& name, unsigned int val, unsigned int max, bool isMem) {
@@ -2637,6 +3123,17 @@ void Bsp::print_model_hull(int modelIdx, int hull_number) {
 		print_clipnode_tree(model.iHeadnodes[hull_number], 0);
 }
 
+std::vector<std::vector<int>> Bsp::get_model_ents_map(bool force) {
+	std::vector<std::vector<int>> modelEnts(modelCount);
+	for (int i = 0; i < ents.size(); i++) {
+		int modelIdx = force ? ents[i]->getBspModelIdxForce() : ents[i]->getBspModelIdx();
+		if (modelIdx >= 0 && modelIdx < (int)modelCount) {
+			modelEnts[modelIdx].push_back(i);
+		}
+	}
+	return modelEnts;
+}
+
 std::string Bsp::get_model_usage(int modelIdx) {
 	for (int i = 0; i < ents.size(); i++) {
 		if (ents[i]->getBspModelIdx() == modelIdx) {
@@ -2656,6 +3153,17 @@ std::vector<Entity*> Bsp::get_model_ents(int modelIdx) {
 	return uses;
 }
 
+std::vector<Entity*> Bsp::get_model_ents(int modelIdx, const std::vector<std::vector<int>>& modelEnts) {
+	std::vector<Entity*> uses;
+	if (modelIdx >= 0 && modelIdx < (int)modelEnts.size()) {
+		uses.reserve(modelEnts[modelIdx].size());
+		for (int entIdx : modelEnts[modelIdx]) {
+			uses.push_back(ents[entIdx]);
+		}
+	}
+	return uses;
+}
+
 std::vector<int> Bsp::get_model_ents_ids(int modelIdx) {
 	std::vector<int> uses;
 	for (int i = 0; i < ents.size(); i++) {
@@ -2666,6 +3174,13 @@ std::vector<int> Bsp::get_model_ents_ids(int modelIdx) {
 	return uses;
 }
 
+std::vector<int> Bsp::get_model_ents_ids(int modelIdx, const std::vector<std::vector<int>>& modelEnts) {
+	if (modelIdx < 0 || modelIdx >= (int)modelEnts.size()) {
+		return std::vector<int>();
+	}
+	return modelEnts[modelIdx];
+}
+
 void Bsp::recurse_node(short nodeIdx, int depth) {
 	for (int i = 0; i < depth; i++) {
 		logf("    ");
@@ -2992,6 +3507,48 @@ void Bsp::delete_hull(int hull_number, int modelIdx, int redirect) {
 	}
 }
 
+void Bsp::delete_models(const bool* usedModels) {
+	// old model index -> new model index, or -1 if deleted
+	std::vector<int> remap(modelCount);
+	int newModelCount = 0;
+	for (unsigned int i = 0; i < modelCount; i++) {
+		remap[i] = usedModels[i] ? newModelCount++ : -1;
+	}
+
+	int deletedCount = (int)modelCount - newModelCount;
+	if (deletedCount == 0) {
+		return;
+	}
+
+	int newSize = newModelCount * sizeof(BSPMODEL);
+	unsigned char* newModels = new unsigned char[newSize];
+	for (unsigned int i = 0; i < modelCount; i++) {
+		if (remap[i] >= 0) {
+			memcpy(newModels + remap[i] * sizeof(BSPMODEL), &models[i], sizeof(BSPMODEL));
+		}
+	}
+
+	int oldModelCount = modelCount;
+	replace_lump(LUMP_MODELS, newModels, newSize);
+
+	// update model index references (same results as calling delete_model for each model)
+	for (int i = 0; i < ents.size(); i++) {
+		int entModel = ents[i]->getBspModelIdx();
+		if (entModel < 0) {
+			continue;
+		}
+		if (entModel >= oldModelCount) {
+			ents[i]->setOrAddKeyvalue("model", "*" + std::to_string(entModel - deletedCount));
+		}
+		else if (remap[entModel] < 0) {
+			ents[i]->setOrAddKeyvalue("model", "error.mdl");
+		}
+		else if (remap[entModel] != entModel) {
+			ents[i]->setOrAddKeyvalue("model", "*" + std::to_string(remap[entModel]));
+		}
+	}
+}
+
 void Bsp::delete_model(int modelIdx) {
 	unsigned char* oldModels = (unsigned char*)models;
 
@@ -4392,6 +4949,8 @@ void Bsp::ExportToObjWIP(std::string path)
 		int materialid = 0;
 		int lastmaterialid = -1;
 
+		std::vector<std::vector<int>> modelEnts = get_model_ents_map(true);
+
 		for (unsigned int i = 0; i < faceCount; i++)
 		{
 			RenderFace* rface;
@@ -4407,7 +4966,7 @@ void Bsp::ExportToObjWIP(std::string path)
 			BSPMIPTEX* tex = ((BSPMIPTEX*)(textures + texOffset));
 
 			int mdlid = get_model_from_face(i);
-			std::vector<int> entIds = get_model_ents_ids(mdlid);
+			std::vector<int> entIds = get_model_ents_ids(mdlid, modelEnts);
 
 			if (entIds.size() == 0)
 			{
@@ -3,6 +3,7 @@
 #include <ctime> 
 #include "Wad.h"
 #include "Entity.h"
+#include "EntLump.h"
 #include "bsplimits.h"
 #include "rad.h"
 #include <string.h>
@@ -11,13 +12,7 @@
 #include "bsptypes.h"
 
 class BspRenderer;
-
-struct membuf : std::streambuf
-{
-	membuf(char* begin, int len) {
-		this->setg(begin, begin, begin + len);
-	}
-};
+class Fgd;
 
 class Bsp
 {
@@ -75,6 +70,9 @@ public:
 	void write(std::string path);
 
 	void print_info(bool perModelStats, int perModelLimit, int sortMode);
+
+	// prints a row of the info table. Values above max are shown as overflows.
+	static void print_stat(const std::string &name, unsigned int val, unsigned int max, bool isMem);
 	void print_model_hull(int modelIdx, int hull);
 	void print_clipnode_tree(int iNode, int depth);
 	void recurse_node(short node, int depth);
@@ -138,18 +136,55 @@ public:
 	// returns the number of lightmaps applied to the face, or 0 if it has no lighting
 	int lightmap_count(int faceIdx);
 
+	// returns true if the face has a lightmap and sz bytes starting at its offset are inside the lighting lump
+	bool lightmap_in_bounds(int faceIdx, int sz);
+
 	bool isValid(); // check if any lumps are overflowed
 
+	// points leaves with identical compressed VIS rows at a single copy of the row, and drops rows
+	// that no leaf uses. Rows aren't decompressed. Returns the number of bytes removed.
+	unsigned int deduplicate_visdata();
+
+	// points faces with identical lightmaps (all styles) at a single copy, and drops lightmap data
+	// that no face uses. Returns the number of bytes removed.
+	unsigned int deduplicate_lightmaps(int* sharedFaces = NULL);
+
+	// gives the face its own copy of its lightmaps if another face uses the same data.
+	// Call this before editing lightmaps in place. Returns true if the lightmaps were copied.
+	bool unshare_lightmap(int faceIdx);
+
+	// counts lightmap layers and bytes per light style. Layers are prunable if they're completely black
+	// or use a switchable style that can never be turned on (see find_unlit_light_styles).
+	void analyze_light_styles(std::vector<LightStyleUsage>& usage);
+
+	// deletes prunable lightmap layers (never the first layer of a face), then shares duplicate lightmaps.
+	// Returns the number of layers deleted
+	int prune_light_styles(unsigned int* bytesSaved = NULL);
+
 	// delete structures not used by the map (needed after deleting models/hulls)
 	STRUCTCOUNT remove_unused_model_structures(bool export_bsp_with_clipnodes = false);
 	void delete_model(int modelIdx);
 
+	// deletes all models not marked as used in a single pass and updates entity model references
+	void delete_models(const bool* usedModels);
+
 	// conditionally deletes hulls for entities that aren't using them
 	STRUCTCOUNT delete_unused_hulls(bool noProgress = false);
 
+	// merges vertices that are within epsilon of each other on every axis, then merges edges that
+	// share the same vertices and drops edges that were collapsed to a point. Vertices are not moved
+	// if that would change the lightmap extents of a face.
+	STRUCTCOUNT weld_vertices(float epsilon);
+
 	// returns true if the map has eny entities that make use of hull 2
 	bool has_hull2_ents();
 
+	// deletes keyvalues that have the same effect as a missing key (empty values, zero spawnflags,
+	// and values equal to a zero/empty FGD default). allDefaults = also strip values equal to non-zero
+	// FGD defaults, which is only safe if the game uses the same defaults as the FGD.
+	// Returns the number of bytes removed from the entity lump
+	unsigned int strip_default_keyvalues(Fgd* fgd, bool allDefaults = false);
+
 	// check for bad indexes
 	bool validate();
 
@@ -224,6 +259,13 @@ public:
 
 private:
 	unsigned int remove_unused_lightmaps(bool* usedFaces);
+
+	// copies the lightmaps of used faces into newData. Faces with identical lightmaps share a copy.
+	// newOffsets gets the new lightmap offset of every face (unused faces keep their old offset).
+	void compact_lightmaps(const bool* usedFaces, std::vector<unsigned char>& newData, std::vector<int>& newOffsets, int& sharedFaces);
+	// marks switchable styles (32+) whose lights all start off and are never triggered.
+	// neverOn must have room for 256 styles.
+	void find_unlit_light_styles(bool* neverOn);
 	unsigned int remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, int oldLeafCount); // called after removing unused leaves
 	unsigned int remove_unused_textures(bool* usedTextures, int* remappedIndexes);
 	unsigned int remove_unused_structs(int lumpIdx, bool* usedStructs, int* remappedIndexes);
@@ -240,12 +282,18 @@ private:
 	void print_model_bsp(int modelIdx);
 	void print_leaf(const BSPLEAF &leaf);
 	void print_node(const BSPNODE& node);
-	void print_stat(const std::string &name, unsigned int val, unsigned int max, bool isMem);
 	void print_model_stat(STRUCTUSAGE* modelInfo, unsigned int val, unsigned int max, bool isMem);
 
+	// reverse lookup of model index -> entity indexes that use the model.
+	// Build once per pass instead of scanning every entity for each model.
+	// force = ignore cached model indexes (see Entity::getBspModelIdxForce)
+	std::vector<std::vector<int>> get_model_ents_map(bool force = false);
+
 	std::string get_model_usage(int modelIdx);
 	std::vector<Entity*> get_model_ents(int modelIdx);
+	std::vector<Entity*> get_model_ents(int modelIdx, const std::vector<std::vector<int>>& modelEnts);
 	std::vector<int> get_model_ents_ids(int modelIdx);
+	std::vector<int> get_model_ents_ids(int modelIdx, const std::vector<std::vector<int>>& modelEnts);
 
 	void write_csg_polys(short nodeIdx, FILE* fout, int flipPlaneSkip, bool debug);
 
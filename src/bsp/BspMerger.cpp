@@ -1,11 +1,30 @@
 #include "BspMerger.h"
 #include <algorithm>
+#include <cfloat>
+#include <climits>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include "vis.h"
+#include "MappedFile.h"
 
+// hash table keys that compare structs by their bytes, like memcmp
+template<typename T>
+struct BytesHash {
+	size_t operator()(const T& v) const { return hashBytes(&v, sizeof(T)); }
+};
 
-Bsp* BspMerger::merge(std::vector<Bsp*> maps, const vec3 & gap, const std::string & output_name, bool noripent, bool noscript) {
+template<typename T>
+struct BytesEqual {
+	bool operator()(const T& a, const T& b) const { return memcmp(&a, &b, sizeof(T)) == 0; }
+};
+
+template<typename T>
+using StructIndexMap = std::unordered_map<T, int, BytesHash<T>, BytesEqual<T>>;
+
+
+Bsp* BspMerger::merge(std::vector<Bsp*> maps, const vec3 & gap, const std::string & output_name, bool noripent, bool noscript,
+	bool pairwise) {
 	if (maps.size() < 1) {
 		logf("\nMore than 1 map is required for merging. Aborting merge.\n");
 		return NULL;
@@ -37,74 +56,405 @@ Bsp* BspMerger::merge(std::vector<Bsp*> maps, const vec3 & gap, const std::strin
 	}
 
 
-	// Merge order matters. 
-	// The bounding box of a merged map is expanded to contain both maps, and bounding boxes cannot overlap.
-	// TODO: Don't merge linearly. Merge gradually bigger chunks to minimize BSP tree depth.
-	//       Not worth it until more than 27 maps are merged together (merge cube bigger than 3x3x3)
-
 	logf("\nMerging %d maps:\n", maps.size());
 
+	Bsp* output = NULL;
+	if (pairwise) {
+		output = merge_pairwise(blocks, (int)maps.size());
+	}
+	else if (merge_all(maps)) {
+		output = maps[0];
+	}
+	if (!output) {
+		return NULL;
+	}
 
-	// merge maps along X axis to form rows of maps
-	int rowId = 0;
-	int mergeCount = 1;
+	if (!noripent) {
+		std::vector<MAPBLOCK> flattenedBlocks;
+		for (int z = 0; z < blocks.size(); z++)
+			for (int y = 0; y < blocks[z].size(); y++)
+				for (int x = 0; x < blocks[z][y].size(); x++)
+					flattenedBlocks.push_back(blocks[z][y][x]);
+
+		logf("\nUpdating map series entity logic:\n");
+		update_map_series_entity_logic(output, flattenedBlocks, maps, output_name, maps[0]->name, noscript);
+	}
+
+	return output;
+}
+
+bool BspMerger::project_merge(std::vector<Bsp*> maps, const vec3& gap, STRUCTCOUNT& counts, int& entCount) {
+	if (maps.size() < 2) {
+		logf("\nMore than 1 map is required for merging.\n");
+		return false;
+	}
+
+	// moving can split shared structures and change lightmap sizes, so the counts are taken after moving
+	std::vector<std::vector<std::vector<MAPBLOCK>>> blocks = separate(maps, gap);
 	for (int z = 0; z < blocks.size(); z++) {
 		for (int y = 0; y < blocks[z].size(); y++) {
-			MAPBLOCK& rowStart = blocks[z][y][0];
 			for (int x = 0; x < blocks[z][y].size(); x++) {
 				MAPBLOCK& block = blocks[z][y][x];
-
-				if (x != 0) {
-					//logf("Merge %d,%d,%d -> %d,%d,%d\n", x, y, z, 0, y, z);
-					std::string merge_name = ++mergeCount < maps.size() ? "row_" + std::to_string(rowId) : "result";
-					merge(rowStart, block, merge_name);
+				if (block.offset.x != 0 || block.offset.y != 0 || block.offset.z != 0) {
+					block.map->move(block.offset);
 				}
 			}
-			rowId++;
 		}
 	}
+	g_progress.clear();
+
+	logf("\nProjecting merge of %d maps:\n", maps.size());
+
+	MERGEPLAN plan;
+	if (!plan_merge_all(maps, plan)) {
+		return false;
+	}
+
+	int visLen = 0;
+	build_merged_vis(maps, plan, visLen, true);
+	g_progress.clear();
+
+	counts = STRUCTCOUNT();
+	counts.planes = (unsigned int)plan.planes.size();
+	counts.texInfos = (unsigned int)plan.texinfos.size();
+	counts.leaves = plan.leafCount;
+	counts.nodes = plan.nodeCount;
+	counts.clipnodes = plan.clipnodeCount;
+	counts.verts = plan.vertCount;
+	counts.faces = plan.faceCount;
+	counts.textures = (unsigned int)plan.textures.size();
+	counts.markSurfs = plan.markSurfCount;
+	counts.surfEdges = plan.surfedgeCount;
+	counts.edges = plan.edgeCount;
+	counts.models = plan.modelCount;
+	counts.lightdata = plan.lightingLen;
+	counts.visdata = visLen;
+
+	// worldspawn is only kept from the first map
+	entCount = 0;
+	for (int i = 0; i < maps.size(); i++) {
+		entCount += (int)maps[i]->ents.size() - (i > 0 ? 1 : 0);
+	}
+
+	return true;
+}
+
+static void free_mapped_bsp(Bsp* map) {
+	// the lumps belong to the mapped file
+	memset(map->lumps, 0, sizeof(unsigned char*) * HEADER_LUMPS);
+	delete map;
+}
+
+// creates a Bsp that reads its lumps directly from a mapped file. The lumps must not be edited or
+// replaced, and the Bsp must be deleted with free_mapped_bsp.
+static Bsp* load_mapped_bsp(MappedFile& file, const std::string& path) {
+	if (file.getSize() < sizeof(BSPHEADER)) {
+		logf("%s is not a valid BSP file\n", path.c_str());
+		return NULL;
+	}
+
+	Bsp* map = new Bsp();
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		delete[] map->lumps[i];
+		map->lumps[i] = NULL;
+	}
+
+	unsigned char* data = (unsigned char*)file.getData();
+	memcpy(&map->header, data, sizeof(BSPHEADER));
+
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		BSPLUMP& lump = map->header.lump[i];
+		if (lump.nOffset < 0 || (size_t)lump.nOffset + lump.nLength > file.getSize()) {
+			logf("%s has an invalid %s lump\n", path.c_str(), g_lump_names[i]);
+			free_mapped_bsp(map);
+			return NULL;
+		}
+		map->lumps[i] = lump.nLength ? data + lump.nOffset : NULL;
+	}
+	if (!map->lumps[LUMP_TEXTURES]) {
+		logf("%s has no texture lump\n", path.c_str());
+		free_mapped_bsp(map);
+		return NULL;
+	}
+
+	map->path = path;
+	map->name = stripExt(basename(path));
+	map->update_lump_pointers();
+	map->load_ents();
+
+	return map;
+}
+
+bool BspMerger::merge_files(std::vector<std::string> mapPaths, const vec3& gap, const std::string& output_name, bool noripent,
+	bool noscript, std::function<void(Bsp*)> preprocess) {
+	if (mapPaths.size() < 2) {
+		logf("\nMore than 1 map is required for merging. Aborting merge.\n");
+		return false;
+	}
+	std::string output_path = output_name;
+	if (output_path.size() < 4 || output_path.rfind(".bsp") != output_path.size() - 4) {
+		output_path = output_path + ".bsp";
+	}
+
+	// a new folder, so that cleaning up never deletes files that were already there
+	std::string tempName = stripExt(output_path) + "_merge_tmp";
+	for (int i = 2; dirExists(tempName) || fileExists(tempName); i++) {
+		tempName = stripExt(output_path) + "_merge_tmp" + std::to_string(i);
+	}
+	std::string tempDir = tempName + "/";
+	if (!createDir(tempDir)) {
+		logf("Failed to create temporary folder %s\n", tempDir.c_str());
+		return false;
+	}
+
+	std::vector<std::string> tempPaths;
+	std::vector<MappedFile*> files;
+	std::vector<Bsp*> maps;
+
+	auto cleanup = [&]() {
+		for (int i = 0; i < maps.size(); i++) {
+			if (maps[i])
+				free_mapped_bsp(maps[i]);
+			delete files[i];
+		}
+		for (int i = 0; i < tempPaths.size(); i++) {
+			removeFile(tempPaths[i]);
+		}
+		removeEmptyDir(tempDir);
+	};
+
+	// load one map at a time and save the preprocessed version to a temporary file for mapping
+	for (int i = 0; i < mapPaths.size(); i++) {
+		Bsp* map = new Bsp(mapPaths[i]);
+		if (!map->valid) {
+			delete map;
+			cleanup();
+			return false;
+		}
+
+		logf("Preprocessing %s:\n", map->name.c_str());
+		preprocess(map);
+
+		// maps from different folders can have the same name
+		std::string mapName = map->name;
+		std::string tempPath = tempDir + std::to_string(i) + "_" + mapName + ".bsp";
+		tempPaths.push_back(tempPath);
+		map->write(tempPath);
+		delete map;
+
+		files.push_back(new MappedFile());
+		maps.push_back(files[i]->open(tempPath) ? load_mapped_bsp(*files[i], tempPath) : NULL);
+		if (!maps[i]) {
+			cleanup();
+			return false;
+		}
+		maps[i]->name = mapName;
+		logf("\n");
+	}
+
+	std::vector<std::vector<std::vector<MAPBLOCK>>> blocks = separate(maps, gap);
+	std::vector<MAPBLOCK> flattenedBlocks;
+
+	logf("\nArranging maps so that they don't overlap:\n");
 
-	// merge the rows along the Y axis to form layers of maps
-	int colId = 0;
 	for (int z = 0; z < blocks.size(); z++) {
-		MAPBLOCK& colStart = blocks[z][0][0];
 		for (int y = 0; y < blocks[z].size(); y++) {
-			MAPBLOCK& block = blocks[z][y][0];
+			for (int x = 0; x < blocks[z][y].size(); x++) {
+				MAPBLOCK& block = blocks[z][y][x];
 
-			if (y != 0) {
-				//logf("Merge %d,%d,%d -> %d,%d,%d\n", 0, y, z, 0, 0, z);
-				std::string merge_name = ++mergeCount < maps.size() ? "layer_" + std::to_string(colId) : "result";
-				merge(colStart, block, merge_name);
+				if (block.offset.x != 0 || block.offset.y != 0 || block.offset.z != 0) {
+					logf("    Apply offset (%6.0f, %6.0f, %6.0f) to %s\n",
+						block.offset.x, block.offset.y, block.offset.z, block.map->name.c_str());
+
+					// moving edits every lump, so the map is loaded and saved again
+					int idx = (int)(std::find(maps.begin(), maps.end(), block.map) - maps.begin());
+					free_mapped_bsp(maps[idx]);
+					maps[idx] = NULL;
+					files[idx]->close();
+
+					Bsp* map = new Bsp(tempPaths[idx]);
+					map->move(block.offset);
+					removeFile(tempPaths[idx]);
+					map->write(tempPaths[idx]);
+					delete map;
+
+					maps[idx] = files[idx]->open(tempPaths[idx]) ? load_mapped_bsp(*files[idx], tempPaths[idx]) : NULL;
+					if (!maps[idx]) {
+						cleanup();
+						return false;
+					}
+					block.map = maps[idx];
+				}
+
+				if (!noripent) {
+					// tag ents with the map they belong to
+					for (int i = 0; i < block.map->ents.size(); i++) {
+						block.map->ents[i]->addKeyvalue("$s_bspguy_map_source", toLowerCase(block.map->name));
+					}
+				}
+
+				flattenedBlocks.push_back(block);
 			}
 		}
-		colId++;
 	}
 
-	// merge the layers to form a cube of maps
-	MAPBLOCK& layerStart = blocks[0][0][0];
-	for (int z = 0; z < blocks.size(); z++) {
-		MAPBLOCK& block = blocks[z][0][0];
+	logf("\nMerging %d maps:\n", maps.size());
 
-		if (z != 0) {
-			//logf("Merge %d,%d,%d -> %d,%d,%d\n", 0, 0, z, 0, 0, 0);
-			merge(layerStart, block, "result");
+	std::ofstream file(output_path, std::ios::trunc | std::ios::binary);
+	if (!file.is_open()) {
+		logf("Failed to open BSP file for writing:\n%s\n", output_path.c_str());
+		cleanup();
+		return false;
+	}
+
+	// lumps are written in the order they're built, then the header is written again with the offsets
+	BSPHEADER header;
+	memset(&header, 0, sizeof(BSPHEADER));
+	header.nVersion = maps[0]->header.nVersion;
+	file.write((char*)&header, sizeof(BSPHEADER));
+
+	// entity logic needs the merged model bounds
+	Bsp output;
+	output.name = maps[0]->name;
+
+	std::vector<MERGEREMAP> remaps;
+	bool ok = merge_all_lumps(maps, remaps, [&](int lumpIdx, unsigned char* data, int len) {
+		header.lump[lumpIdx].nOffset = (int)file.tellp();
+		header.lump[lumpIdx].nLength = len;
+		file.write((char*)data, len);
+
+		if (lumpIdx == LUMP_MODELS) {
+			output.replace_lump(LUMP_MODELS, data, len);
+		}
+		else {
+			delete[] data;
 		}
+	});
+	if (!ok) {
+		file.close();
+		removeFile(output_path);
+		cleanup();
+		return false;
 	}
 
-	Bsp* output = layerStart.map;
+	merge_all_ents(maps, remaps);
+	g_progress.clear();
+	if (sharedVisRows) {
+		logf("    Shared %d duplicate VIS rows (%d bytes saved)\n", sharedVisRows, sharedVisBytes);
+	}
 
-	if (!noripent) {
-		std::vector<MAPBLOCK> flattenedBlocks;
-		for (int z = 0; z < blocks.size(); z++)
-			for (int y = 0; y < blocks[z].size(); y++)
-				for (int x = 0; x < blocks[z][y].size(); x++)
-					flattenedBlocks.push_back(blocks[z][y][x]);
+	output.ents = std::move(maps[0]->ents);
+	maps[0]->ents.clear();
 
+	if (!noripent) {
 		logf("\nUpdating map series entity logic:\n");
-		update_map_series_entity_logic(output, flattenedBlocks, maps, output_name, maps[0]->name, noscript);
+		update_map_series_entity_logic(&output, flattenedBlocks, maps, output_name, maps[0]->name, noscript);
+	}
+	else {
+		output.update_ent_lump();
 	}
 
-	return output;
+	header.lump[LUMP_ENTITIES].nOffset = (int)file.tellp();
+	header.lump[LUMP_ENTITIES].nLength = output.header.lump[LUMP_ENTITIES].nLength;
+	file.write((char*)output.lumps[LUMP_ENTITIES], output.header.lump[LUMP_ENTITIES].nLength);
+
+	file.seekp(0);
+	file.write((char*)&header, sizeof(BSPHEADER));
+	file.close();
+
+	cleanup();
+
+	if (!file.good()) {
+		logf("Failed to write %s\n", output_path.c_str());
+		return false;
+	}
+
+	logf("\nWrote %s\n", output_path.c_str());
+	return true;
+}
+
+Bsp* BspMerger::merge_pairwise(std::vector<std::vector<std::vector<MAPBLOCK>>>& blocks, int mapCount) {
+	// Merge order matters. 
+	// The bounding box of a merged map is expanded to contain both maps, and bounding boxes cannot overlap.
+	// Adjacent maps in a row are merged first, then adjacent rows in a layer, then adjacent layers.
+	int mergesLeft = mapCount - 1;
+
+	// merge maps along X axis to form rows of maps
+	std::vector<std::vector<MAPBLOCK*>> rows;
+	std::vector<std::string> rowNames;
+	for (int z = 0; z < blocks.size(); z++) {
+		for (int y = 0; y < blocks[z].size(); y++) {
+			std::vector<MAPBLOCK*> row;
+			for (int x = 0; x < blocks[z][y].size(); x++) {
+				row.push_back(&blocks[z][y][x]);
+			}
+			rows.push_back(row);
+			rowNames.push_back("row_" + std::to_string(rowNames.size()));
+		}
+	}
+	merge_groups(rows, rowNames, mergesLeft);
+
+	// merge the rows along the Y axis to form layers of maps
+	std::vector<std::vector<MAPBLOCK*>> layers;
+	std::vector<std::string> layerNames;
+	for (int z = 0; z < blocks.size(); z++) {
+		std::vector<MAPBLOCK*> layer;
+		for (int y = 0; y < blocks[z].size(); y++) {
+			layer.push_back(&blocks[z][y][0]);
+		}
+		layers.push_back(layer);
+		layerNames.push_back("layer_" + std::to_string(layerNames.size()));
+	}
+	merge_groups(layers, layerNames, mergesLeft);
+
+	// merge the layers to form a cube of maps
+	std::vector<std::vector<MAPBLOCK*>> cube(1);
+	std::vector<std::string> cubeNames = { "result" };
+	for (int z = 0; z < blocks.size(); z++) {
+		cube[0].push_back(&blocks[z][0][0]);
+	}
+	merge_groups(cube, cubeNames, mergesLeft);
+
+	return blocks[0][0][0].map;
+}
+
+void BspMerger::merge_groups(std::vector<std::vector<MAPBLOCK*>>& groups, std::vector<std::string>& groupNames, int& mergesLeft) {
+	struct PairMerge {
+		MAPBLOCK* dst;
+		MAPBLOCK* src;
+		std::string resultName;
+	};
+
+	while (true) {
+		// pair up neighbors in every group. The merged pair replaces the first map of the pair.
+		std::vector<PairMerge> pairs;
+		for (int g = 0; g < groups.size(); g++) {
+			std::vector<MAPBLOCK*> merged;
+			for (int i = 0; i < groups[g].size(); i += 2) {
+				if (i + 1 < groups[g].size()) {
+					std::string resultName = --mergesLeft == 0 ? "result" : groupNames[g];
+					pairs.push_back({ groups[g][i], groups[g][i + 1], resultName });
+				}
+				merged.push_back(groups[g][i]);
+			}
+			groups[g] = merged;
+		}
+
+		if (pairs.empty()) {
+			break;
+		}
+
+		// No map is in more than one pair, so the pairs are merged in parallel. Each merge logs a line when
+		// it starts instead of updating the shared progress meter.
+		parallelFor((int)pairs.size(), [&](int start, int end) {
+			ProgressMeter::hideThisThread = true;
+			for (int i = start; i < end; i++) {
+				BspMerger pairMerger;
+				pairMerger.merge(*pairs[i].dst, *pairs[i].src, pairs[i].resultName);
+			}
+			ProgressMeter::hideThisThread = false;
+		}, 1);
+	}
 }
 
 void BspMerger::merge(MAPBLOCK& dst, MAPBLOCK& src, std::string resultType) {
@@ -398,7 +748,8 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, std::vector<MAPBL
 		if (noscript && (cname == "info_player_start" || cname == "info_player_coop" || cname == "info_player_dm2")) {
 			// info_player_start ents are ignored if there is any active info_player_deathmatch,
 			// so this may break spawns if there are a mix of spawn types
-			cname = ent->keyvalues["classname"] = "info_player_deathmatch";
+			cname = "info_player_deathmatch";
+			ent->setOrAddKeyvalue("classname", cname);
 		}
 
 		if (noscript && !isInFirstMap) {
@@ -421,7 +772,7 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, std::vector<MAPBL
 			}
 			if (cname == "trigger_auto") {
 				ent->addKeyvalue("targetname", "bspguy_autos_" + source_map);
-				ent->keyvalues["classname"] = "trigger_relay";
+				ent->setOrAddKeyvalue("classname", "trigger_relay");
 			}
 			if (cname.find("monster_") == 0 && cname.rfind("_dead") != cname.size() - 5) {
 				// replace with a squadmaker and spawn when this map section starts
@@ -766,54 +1117,48 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, std::vector<MAPBL
 }
 
 int BspMerger::force_unique_ent_names_per_map(Bsp* mergedMap) {
-	mapStringToSet mapEntNames;
+	// a name belongs to the first map that uses it. Other maps using the same name get renamed.
+	std::unordered_map<std::string, std::string> nameOwners; // targetname -> source map
 	mapStringToSet entsToRename;
 
 	for (int i = 0; i < mergedMap->ents.size(); i++) {
 		Entity* ent = mergedMap->ents[i];
 		std::string tname = ent->keyvalues["targetname"];
-		std::string source_map = ent->keyvalues["$s_bspguy_map_source"];
 
 		if (tname.empty())
 			continue;
 
-		bool isUnique = true;
-		for (auto it = mapEntNames.begin(); it != mapEntNames.end(); ++it) {
-			if (it->first != source_map && it->second.find(tname) != it->second.end()) {
-				entsToRename[source_map].insert(tname);
-				isUnique = false;
-				break;
-			}
-		}
-
-		if (isUnique)
-			mapEntNames[source_map].insert(tname);
+		std::string source_map = ent->keyvalues["$s_bspguy_map_source"];
+		auto owner = nameOwners.find(tname);
+		if (owner == nameOwners.end())
+			nameOwners[tname] = source_map;
+		else if (owner->second != source_map)
+			entsToRename[source_map].insert(tname);
 	}
 
 	int renameCount = 0;
-	for (auto it = entsToRename.begin(); it != entsToRename.end(); ++it)
-		renameCount += (int)it->second.size();
-
-	g_progress.update("Renaming entities", renameCount);
-
 	int renameSuffix = 2;
+	std::unordered_map<std::string, hashmap> mapRenames; // source map -> (old name -> new name)
 	for (auto it = entsToRename.begin(); it != entsToRename.end(); ++it) {
+		hashmap& renames = mapRenames[it->first];
 		for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-			std::string oldName = *it2;
-			std::string newName = oldName + "_" + std::to_string(renameSuffix++);
+			renames[*it2] = *it2 + "_" + std::to_string(renameSuffix++);
+		}
+		renameCount += (int)it->second.size();
+	}
 
-			//logf << "\nRenaming " << *it2 << " to " << newName << endl;
+	if (mapRenames.empty())
+		return 0;
 
-			for (int i = 0; i < mergedMap->ents.size(); i++) {
-				Entity* ent = mergedMap->ents[i];
-				if (ent->keyvalues["$s_bspguy_map_source"] != it->first)
-					continue;
+	g_progress.update("Renaming entities", (int)mergedMap->ents.size());
 
-				ent->renameTargetnameValues(oldName, newName);
-			}
+	for (int i = 0; i < mergedMap->ents.size(); i++) {
+		Entity* ent = mergedMap->ents[i];
+		auto renames = mapRenames.find(ent->keyvalues["$s_bspguy_map_source"]);
+		if (renames != mapRenames.end())
+			ent->renameTargetnameValues(renames->second);
 
-			g_progress.tick();
-		}
+		g_progress.tick();
 	}
 
 	return renameCount;
@@ -1068,20 +1413,21 @@ void BspMerger::merge_planes(Bsp& mapA, Bsp& mapB) {
 	std::vector<BSPPLANE> mergedPlanes;
 	mergedPlanes.reserve(mapA.planeCount + mapB.planeCount);
 
+	// first index of each unique plane in mapA (emplace keeps the first of any duplicates)
+	StructIndexMap<BSPPLANE> planeIndexes;
+	planeIndexes.reserve(mapA.planeCount);
+
 	for (unsigned int i = 0; i < mapA.planeCount; i++) {
 		mergedPlanes.push_back(mapA.planes[i]);
+		planeIndexes.emplace(mapA.planes[i], i);
 		g_progress.tick();
 	}
 	for (unsigned int i = 0; i < mapB.planeCount; i++) {
-		bool isUnique = true;
-		for (unsigned int k = 0; k < mapA.planeCount; k++) {
-			if (memcmp(&mapB.planes[i], &mapA.planes[k], sizeof(BSPPLANE)) == 0) {
-				isUnique = false;
-				planeRemap.push_back(k);
-				break;
-			}
+		auto existing = planeIndexes.find(mapB.planes[i]);
+		if (existing != planeIndexes.end()) {
+			planeRemap.push_back(existing->second);
 		}
-		if (isUnique) {
+		else {
 			planeRemap.push_back((int)mergedPlanes.size());
 			mergedPlanes.push_back(mapB.planes[i]);
 		}
@@ -1114,6 +1460,10 @@ void BspMerger::merge_textures(Bsp& mapA, Bsp& mapB) {
 
 	g_progress.update("Merging textures", mapA.textureCount + mapB.textureCount);
 
+	// mapA texture indexes grouped by a hash of the texture header + mip data, in index order
+	std::unordered_map<unsigned int, std::vector<int>> texIndexes;
+	texIndexes.reserve(mapA.textureCount);
+
 	unsigned int thisMergeSz = (mapA.textureCount + 1) * sizeof(int);
 	for (unsigned int i = 0; i < mapA.textureCount; i++) {
 		int offset = ((int*)mapA.textures)[i + 1];
@@ -1126,6 +1476,7 @@ void BspMerger::merge_textures(Bsp& mapA, Bsp& mapB) {
 			int sz = getBspTextureSize(tex);
 			//memset(tex->nOffsets, 0, sizeof(unsigned int) * 4);
 
+			texIndexes[hashBytes(tex, sz)].push_back(newTexCount);
 			mipTexOffsets[newTexCount] = (unsigned int)(mipTexWritePtr - newMipTexData);
 			memcpy(mipTexWritePtr, tex, sz);
 			mipTexWritePtr += sz;
@@ -1145,15 +1496,16 @@ void BspMerger::merge_textures(Bsp& mapA, Bsp& mapB) {
 			BSPMIPTEX* tex = (BSPMIPTEX*)(mapB.textures + offset);
 			int sz = getBspTextureSize(tex);
 
-			for (unsigned int k = 0; k < mapA.textureCount; k++) {
-				if (mipTexOffsets[k] == -1) {
-					continue;
-				}
-				BSPMIPTEX* thisTex = (BSPMIPTEX*)(newMipTexData + mipTexOffsets[k]);
-				if (memcmp(tex, thisTex, sz) == 0) {
-					isUnique = false;
-					texRemap.push_back(k);
-					break;
+			auto candidates = texIndexes.find(hashBytes(tex, sz));
+			if (candidates != texIndexes.end()) {
+				// the sizes match if the headers match, so this compares the same bytes as the hash
+				for (int k : candidates->second) {
+					BSPMIPTEX* thisTex = (BSPMIPTEX*)(newMipTexData + mipTexOffsets[k]);
+					if (memcmp(tex, thisTex, sizeof(BSPMIPTEX)) == 0 && memcmp(tex, thisTex, sz) == 0) {
+						isUnique = false;
+						texRemap.push_back(k);
+						break;
+					}
 				}
 			}
 
@@ -1216,8 +1568,12 @@ void BspMerger::merge_texinfo(Bsp& mapA, Bsp& mapB) {
 	std::vector<BSPTEXTUREINFO> mergedInfo;
 	mergedInfo.reserve(mapA.texinfoCount + mapB.texinfoCount);
 
+	StructIndexMap<BSPTEXTUREINFO> infoIndexes;
+	infoIndexes.reserve(mapA.texinfoCount);
+
 	for (unsigned int i = 0; i < mapA.texinfoCount; i++) {
 		mergedInfo.push_back(mapA.texinfos[i]);
+		infoIndexes.emplace(mapA.texinfos[i], i);
 		g_progress.tick();
 	}
 
@@ -1225,16 +1581,11 @@ void BspMerger::merge_texinfo(Bsp& mapA, Bsp& mapB) {
 		BSPTEXTUREINFO info = mapB.texinfos[i];
 		info.iMiptex = texRemap[info.iMiptex];
 
-		bool isUnique = true;
-		for (unsigned int k = 0; k < mapA.texinfoCount; k++) {
-			if (memcmp(&info, &mapA.texinfos[k], sizeof(BSPTEXTUREINFO)) == 0) {
-				texInfoRemap.push_back(k);
-				isUnique = false;
-				break;
-			}
+		auto existing = infoIndexes.find(info);
+		if (existing != infoIndexes.end()) {
+			texInfoRemap.push_back(existing->second);
 		}
-
-		if (isUnique) {
+		else {
 			texInfoRemap.push_back((int)mergedInfo.size());
 			mergedInfo.push_back(info);
 		}
@@ -1587,45 +1938,32 @@ void BspMerger::merge_vis(Bsp& mapA, Bsp& mapB) {
 	int mergedWorldLeafCount = thisWorldLeafCount + otherWorldLeafCount;
 
 	unsigned int newVisRowSize = ((totalVisLeaves + 63) & ~63) >> 3;
-	int decompressedVisSize = totalVisLeaves * newVisRowSize;
 
-	g_progress.update("Merging visibility", thisWorldLeafCount + otherWorldLeafCount * 2 + mergedWorldLeafCount);
+	g_progress.update("Merging visibility", mergedWorldLeafCount);
 	g_progress.tick();
 
-	unsigned char* decompressedVis = new unsigned char[decompressedVisSize];
-	memset(decompressedVis, 0, decompressedVisSize);
-
-	// decompress this map's world leaves
+	// Rows are decompressed, shifted, and recompressed without decompressing the whole vis lump.
 	// model leaves don't need to be decompressed because the game ignores VIS for them.
-	decompress_vis_lump(allLeaves, mapA.visdata, decompressedVis,
-		thisWorldLeafCount, thisVisLeaves, totalVisLeaves);
-
-	// decompress other map's world-leaf vis data (skip empty first leaf, which now only the first map should have)
-	unsigned char* decompressedOtherVis = decompressedVis + thisWorldLeafCount * newVisRowSize;
-	decompress_vis_lump(allLeaves + thisWorldLeafCount, mapB.visdata, decompressedOtherVis,
-		otherWorldLeafCount, otherLeafCount, totalVisLeaves);
-
-	// shift mapB's world leaves after mapA's world leaves
+	VisLumpWriter visWriter;
+	std::vector<int> visOffsets(mergedWorldLeafCount);
 
+	visWriter.addRows(mergedWorldLeafCount, newVisRowSize, [&](int i, unsigned char* row) {
+		if (i < thisWorldLeafCount) {
+			decompress_vis_row(allLeaves[i + 1], mapA.visdata, row, thisWorldLeafCount, thisVisLeaves, totalVisLeaves);
+		}
+		else {
+			// shift mapB's world leaves after mapA's world leaves
+			// (skip empty first leaf, which now only the first map should have)
+			decompress_vis_row(allLeaves[i + 1], mapB.visdata, row, otherWorldLeafCount, otherLeafCount, totalVisLeaves);
+			shiftVis(row, newVisRowSize, 0, thisWorldLeafCount);
+		}
+	}, mergedWorldLeafCount ? &visOffsets[0] : NULL);
 
-	for (int i = 0; i < otherWorldLeafCount; i++) {
-		shiftVis(decompressedOtherVis + i * newVisRowSize, newVisRowSize, 0, thisWorldLeafCount);
-		g_progress.tick();
+	for (int i = 0; i < mergedWorldLeafCount; i++) {
+		allLeaves[i + 1].nVisOffset = visOffsets[i];
 	}
 
-	// recompress the combined vis data
-	unsigned char* compressedVis = new unsigned char[decompressedVisSize];
-	memset(compressedVis, 0, decompressedVisSize);
-	int64_t newVisLen = CompressAll(allLeaves, decompressedVis, compressedVis, totalVisLeaves, mergedWorldLeafCount, decompressedVisSize);
-	unsigned int oldLen = mapA.header.lump[LUMP_VISIBILITY].nLength;
-
-	unsigned char* compressedVisResize = new unsigned char[newVisLen];
-	memcpy(compressedVisResize, compressedVis, newVisLen);
-
-	mapA.replace_lump(LUMP_VISIBILITY, compressedVisResize, newVisLen);
-
-	delete[] decompressedVis;
-	delete[] compressedVis;
+	mapA.replace_lump(LUMP_VISIBILITY, visWriter.copyData(), visWriter.size());
 }
 
 void BspMerger::merge_lighting(Bsp& mapA, Bsp& mapB) {
@@ -1781,3 +2119,812 @@ void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separation
 		mapA.replace_lump(LUMP_CLIPNODES, newThisNodes, (mapA.clipnodeCount + NEW_NODE_COUNT) * sizeof(BSPCLIPNODE));
 	}
 }
+
+static float axisValue(const vec3& v, int axis) {
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+template<typename T>
+static T* allocLump(size_t count) {
+	// lumps are freed as unsigned char arrays
+	return (T*)(new unsigned char[count * sizeof(T)]);
+}
+
+int BspMerger::build_merge_tree(std::vector<Bsp*>& maps, std::vector<int> mapIdxs, std::vector<MERGENODE>& tree) {
+	if (mapIdxs.size() == 1) {
+		return ~mapIdxs[0];
+	}
+
+	// use the split closest to the middle of the list so the tree stays shallow
+	int bestAxis = -1;
+	int bestSplit = 0;
+	int bestBalance = INT_MAX;
+	float bestDist = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		std::sort(mapIdxs.begin(), mapIdxs.end(), [&](int a, int b) {
+			return axisValue(maps[a]->models[0].nMins, axis) < axisValue(maps[b]->models[0].nMins, axis);
+		});
+
+		float backMax = -FLT_MAX;
+		for (int i = 0; i + 1 < (int)mapIdxs.size(); i++) {
+			backMax = std::max(backMax, axisValue(maps[mapIdxs[i]]->models[0].nMaxs, axis));
+			float frontMin = axisValue(maps[mapIdxs[i + 1]]->models[0].nMins, axis);
+			int balance = abs((i + 1) * 2 - (int)mapIdxs.size());
+
+			if (backMax <= frontMin && balance < bestBalance) {
+				bestAxis = axis;
+				bestSplit = i + 1;
+				bestBalance = balance;
+				bestDist = backMax + (frontMin - backMax) * 0.5f;
+			}
+		}
+	}
+
+	if (bestAxis == -1) {
+		logf("Bounding boxes for each map:\n");
+		for (int i = 0; i < mapIdxs.size(); i++) {
+			BSPMODEL& world = maps[mapIdxs[i]]->models[0];
+			logf("(%6.0f, %6.0f, %6.0f)", world.nMins.x, world.nMins.y, world.nMins.z);
+			logf(" - (%6.0f, %6.0f, %6.0f) %s\n", world.nMaxs.x, world.nMaxs.y, world.nMaxs.z, maps[mapIdxs[i]]->name.c_str());
+		}
+		return INT_MAX;
+	}
+
+	std::sort(mapIdxs.begin(), mapIdxs.end(), [&](int a, int b) {
+		return axisValue(maps[a]->models[0].nMins, bestAxis) < axisValue(maps[b]->models[0].nMins, bestAxis);
+	});
+
+	int nodeIdx = (int)tree.size();
+	tree.push_back(MERGENODE());
+
+	std::vector<int> backIdxs(mapIdxs.begin(), mapIdxs.begin() + bestSplit);
+	std::vector<int> frontIdxs(mapIdxs.begin() + bestSplit, mapIdxs.end());
+	int frontChild = build_merge_tree(maps, frontIdxs, tree);
+	int backChild = build_merge_tree(maps, backIdxs, tree);
+	if (frontChild == INT_MAX || backChild == INT_MAX) {
+		return INT_MAX;
+	}
+
+	// planes with negative normals mess up VIS and lighting stuff, so the front side is always the higher side
+	MERGENODE& node = tree[nodeIdx];
+	memset(&node.plane, 0, sizeof(BSPPLANE));
+	node.plane.nType = PLANE_X + bestAxis;
+	node.plane.vNormal = vec3(bestAxis == 0 ? 1.0f : 0.0f, bestAxis == 1 ? 1.0f : 0.0f, bestAxis == 2 ? 1.0f : 0.0f);
+	node.plane.fDist = bestDist;
+	node.children[0] = frontChild;
+	node.children[1] = backChild;
+
+	node.mins = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	node.maxs = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int i = 0; i < mapIdxs.size(); i++) {
+		BSPMODEL& world = maps[mapIdxs[i]]->models[0];
+		node.mins = vec3(std::min(node.mins.x, world.nMins.x), std::min(node.mins.y, world.nMins.y), std::min(node.mins.z, world.nMins.z));
+		node.maxs = vec3(std::max(node.maxs.x, world.nMaxs.x), std::max(node.maxs.y, world.nMaxs.y), std::max(node.maxs.z, world.nMaxs.z));
+	}
+
+	return nodeIdx;
+}
+
+bool BspMerger::merge_all(std::vector<Bsp*>& maps) {
+	if (maps.size() < 2) {
+		return true;
+	}
+
+	std::vector<MERGEREMAP> remaps;
+	unsigned char* newLumps[HEADER_LUMPS] = { NULL };
+	int newLumpLens[HEADER_LUMPS] = { 0 };
+
+	bool ok = merge_all_lumps(maps, remaps, [&](int lumpIdx, unsigned char* data, int len) {
+		newLumps[lumpIdx] = data;
+		newLumpLens[lumpIdx] = len;
+	});
+	if (!ok) {
+		return false;
+	}
+
+	// the lumps of the first map are read while building, so they're only replaced at the end
+	Bsp& output = *maps[0];
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		if (i != LUMP_ENTITIES) {
+			output.replace_lump(i, newLumps[i], newLumpLens[i]);
+		}
+	}
+
+	merge_all_ents(maps, remaps);
+	output.update_ent_lump();
+
+	g_progress.clear();
+	if (sharedVisRows) {
+		logf("    Shared %d duplicate VIS rows (%d bytes saved)\n", sharedVisRows, sharedVisBytes);
+	}
+
+	return true;
+}
+
+bool BspMerger::merge_all_lumps(std::vector<Bsp*>& maps, std::vector<MERGEREMAP>& remaps, MergeLumpWriter writeLump) {
+	MERGEPLAN plan;
+	if (!plan_merge_all(maps, plan)) {
+		return false;
+	}
+
+	// leaves need the compressed vis offsets
+	const int lumpOrder[] = {
+		LUMP_PLANES, LUMP_TEXTURES, LUMP_TEXINFO, LUMP_VERTICES, LUMP_EDGES, LUMP_SURFEDGES, LUMP_FACES,
+		LUMP_MARKSURFACES, LUMP_VISIBILITY, LUMP_LEAVES, LUMP_NODES, LUMP_CLIPNODES, LUMP_MODELS, LUMP_LIGHTING
+	};
+	const int lumpCount = sizeof(lumpOrder) / sizeof(int);
+
+	g_progress.update("Merging structures", lumpCount);
+
+	for (int i = 0; i < lumpCount; i++) {
+		int len = 0;
+		unsigned char* data = build_merged_lump(maps, plan, lumpOrder[i], len);
+		writeLump(lumpOrder[i], data, len);
+
+		if (lumpOrder[i] == LUMP_VISIBILITY) {
+			g_progress.update("Merging structures", lumpCount - (i + 1));
+		}
+		else {
+			g_progress.tick();
+		}
+	}
+
+	remaps = std::move(plan.remaps);
+	return true;
+}
+
+bool BspMerger::plan_merge_all(std::vector<Bsp*>& maps, MERGEPLAN& plan) {
+	const int HULL_COUNT = MAX_MAP_HULLS - 1;
+
+	std::vector<int> mapIdxs;
+	for (int i = 0; i < maps.size(); i++) {
+		if (maps[i]->modelCount == 0) {
+			logf("%s has no world model and can't be merged.\n", maps[i]->name.c_str());
+			return false;
+		}
+		mapIdxs.push_back(i);
+	}
+
+	// node 0 is the root of the separating planes between all maps
+	std::vector<MERGENODE>& tree = plan.tree;
+	if (build_merge_tree(maps, mapIdxs, tree) == INT_MAX) {
+		logf("No separating axis found. The maps overlap and can't be merged.\n");
+		return false;
+	}
+	int splitCount = (int)tree.size();
+
+	logf("    result   = %s", maps[0]->name.c_str());
+	for (int i = 1; i < maps.size(); i++) {
+		logf(" + %s", maps[i]->name.c_str());
+	}
+	logf("\n");
+
+	std::vector<MERGEREMAP>& remaps = plan.remaps;
+	remaps.resize(maps.size());
+
+	//
+	// Remap deduplicated structures and calculate where every map's structures go
+	//
+
+	int totalPlaneCount = 0;
+	int totalTexinfoCount = 0;
+	for (int i = 0; i < maps.size(); i++) {
+		totalPlaneCount += maps[i]->planeCount;
+		totalTexinfoCount += maps[i]->texinfoCount;
+	}
+
+	g_progress.update("Merging planes", totalPlaneCount);
+
+	StructIndexMap<BSPPLANE> planeIndexes;
+	std::vector<BSPPLANE>& mergedPlanes = plan.planes;
+	planeIndexes.reserve(totalPlaneCount + splitCount);
+	mergedPlanes.reserve(totalPlaneCount + splitCount);
+
+	for (int i = 0; i < maps.size(); i++) {
+		Bsp& map = *maps[i];
+		MERGEREMAP& remap = remaps[i];
+
+		remap.planes.resize(map.planeCount);
+		for (unsigned int k = 0; k < map.planeCount; k++) {
+			auto res = planeIndexes.emplace(map.planes[k], (int)mergedPlanes.size());
+			if (res.second) {
+				mergedPlanes.push_back(map.planes[k]);
+			}
+			remap.planes[k] = res.first->second;
+			g_progress.tick();
+		}
+	}
+
+	plan.splitPlanes.resize(splitCount);
+	for (int i = 0; i < splitCount; i++) {
+		auto res = planeIndexes.emplace(tree[i].plane, (int)mergedPlanes.size());
+		if (res.second) {
+			mergedPlanes.push_back(tree[i].plane);
+		}
+		plan.splitPlanes[i] = res.first->second;
+	}
+
+	plan_merge_textures(maps, plan);
+
+	g_progress.update("Merging texinfos", totalTexinfoCount);
+
+	StructIndexMap<BSPTEXTUREINFO> infoIndexes;
+	std::vector<BSPTEXTUREINFO>& mergedInfo = plan.texinfos;
+	infoIndexes.reserve(totalTexinfoCount);
+	mergedInfo.reserve(totalTexinfoCount);
+
+	for (int i = 0; i < maps.size(); i++) {
+		Bsp& map = *maps[i];
+		MERGEREMAP& remap = remaps[i];
+
+		remap.texinfos.resize(map.texinfoCount);
+		for (unsigned int k = 0; k < map.texinfoCount; k++) {
+			BSPTEXTUREINFO info = map.texinfos[k];
+			if (info.iMiptex < remap.textures.size()) {
+				info.iMiptex = remap.textures[info.iMiptex];
+			}
+
+			auto res = infoIndexes.emplace(info, (int)mergedInfo.size());
+			if (res.second) {
+				mergedInfo.push_back(info);
+			}
+			remap.texinfos[k] = res.first->second;
+			g_progress.tick();
+		}
+	}
+
+	plan.vertCount = 0;
+	plan.edgeCount = 0;
+	plan.surfedgeCount = 0;
+	plan.markSurfCount = 0;
+	plan.worldFaceCount = 0;
+	plan.faceCount = 0;
+	plan.worldLeafCount = 0;
+	plan.leafCount = 1; // shared solid leaf
+	plan.nodeCount = splitCount;
+	plan.clipnodeCount = splitCount * HULL_COUNT;
+	plan.modelCount = 1; // merged world model
+
+	for (int i = 0; i < maps.size(); i++) {
+		Bsp& map = *maps[i];
+		MERGEREMAP& remap = remaps[i];
+
+		remap.vertBase = plan.vertCount;
+		remap.edgeBase = plan.edgeCount;
+		remap.surfedgeBase = plan.surfedgeCount;
+		remap.markSurfBase = plan.markSurfCount;
+		remap.worldFaceBase = plan.worldFaceCount;
+		remap.worldFaceCount = map.models[0].nFaces;
+		remap.nodeBase = plan.nodeCount;
+		remap.clipnodeBase = plan.clipnodeCount;
+		remap.subModelBase = plan.modelCount;
+
+		plan.vertCount += map.vertCount;
+		plan.edgeCount += map.edgeCount;
+		plan.surfedgeCount += map.surfedgeCount;
+		plan.markSurfCount += map.marksurfCount;
+		plan.worldFaceCount += remap.worldFaceCount;
+		plan.faceCount += map.faceCount;
+		plan.worldLeafCount += map.models[0].nVisLeafs;
+		plan.leafCount += std::max(0, (int)map.leafCount - 1);
+		plan.nodeCount += map.nodeCount;
+		plan.clipnodeCount += map.clipnodeCount;
+		plan.modelCount += map.modelCount - 1;
+	}
+
+	// world faces and leaves of every map come before the submodel faces and leaves
+	int subFaceIdx = plan.worldFaceCount;
+	int worldLeafIdx = 1;
+	int subLeafIdx = 1 + plan.worldLeafCount;
+	for (int i = 0; i < maps.size(); i++) {
+		Bsp& map = *maps[i];
+		MERGEREMAP& remap = remaps[i];
+
+		remap.subFaceBase = subFaceIdx;
+		subFaceIdx += map.faceCount - remap.worldFaceCount;
+
+		int mapWorldLeaves = map.models[0].nVisLeafs;
+		remap.leaves.resize(map.leafCount);
+		for (int k = 0; k < (int)map.leafCount; k++) {
+			if (k == 0)
+				remap.leaves[k] = 0;
+			else if (k <= mapWorldLeaves)
+				remap.leaves[k] = worldLeafIdx + (k - 1);
+			else
+				remap.leaves[k] = subLeafIdx + (k - 1 - mapWorldLeaves);
+		}
+		worldLeafIdx += mapWorldLeaves;
+		subLeafIdx += std::max(0, (int)map.leafCount - 1 - mapWorldLeaves);
+	}
+
+	plan_merge_lighting(maps, plan);
+
+	return true;
+}
+
+void BspMerger::plan_merge_textures(std::vector<Bsp*>& maps, MERGEPLAN& plan) {
+	int totalTextureCount = 0;
+	for (int i = 0; i < maps.size(); i++) {
+		totalTextureCount += maps[i]->textureCount;
+	}
+
+	g_progress.update("Merging textures", totalTextureCount);
+
+	// merged texture indexes grouped by a hash of the texture header + mip data
+	std::unordered_map<unsigned int, std::vector<int>> texIndexes;
+	std::vector<BSPMIPTEX*>& mergedTextures = plan.textures;
+	std::vector<int>& mergedSizes = plan.textureSizes;
+	texIndexes.reserve(totalTextureCount);
+
+	for (int i = 0; i < maps.size(); i++) {
+		Bsp& map = *maps[i];
+		MERGEREMAP& remap = plan.remaps[i];
+
+		remap.textures.resize(map.textureCount);
+		for (unsigned int k = 0; k < map.textureCount; k++) {
+			int offset = ((int*)map.textures)[k + 1];
+			g_progress.tick();
+
+			if (offset == -1) {
+				remap.textures[k] = (int)mergedTextures.size();
+				mergedTextures.push_back(NULL);
+				mergedSizes.push_back(0);
+				continue;
+			}
+
+			BSPMIPTEX* tex = (BSPMIPTEX*)(map.textures + offset);
+			int sz = getBspTextureSize(tex);
+
+			std::vector<int>& candidates = texIndexes[hashBytes(tex, sz)];
+			int texIdx = -1;
+			for (int c : candidates) {
+				// the sizes match if the headers match
+				BSPMIPTEX* other = mergedTextures[c];
+				if (memcmp(tex, other, sizeof(BSPMIPTEX)) == 0 && memcmp(tex, other, sz) == 0) {
+					texIdx = c;
+					break;
+				}
+			}
+
+			if (texIdx == -1) {
+				texIdx = (int)mergedTextures.size();
+				candidates.push_back(texIdx);
+				mergedTextures.push_back(tex);
+				mergedSizes.push_back(sz);
+			}
+			remap.textures[k] = texIdx;
+		}
+	}
+}
+
+void BspMerger::plan_merge_lighting(std::vector<Bsp*>& maps, MERGEPLAN& plan) {
+	std::vector<MERGEREMAP>& remaps = plan.remaps;
+
+	bool anyLighting = false;
+	for (int i = 0; i < maps.size(); i++) {
+		if (maps[i]->header.lump[LUMP_LIGHTING].nLength) {
+			anyLighting = true;
+		}
+	}
+
+	// maps without lighting share a single full-bright lightmap, if any other map has lighting
+	int lightOffset = 0;
+	bool needFullBright = false;
+	for (int i = 0; i < maps.size(); i++) {
+		int len = maps[i]->header.lump[LUMP_LIGHTING].nLength;
+		remaps[i].fullBright = anyLighting && len == 0;
+		remaps[i].lightBase = lightOffset;
+		lightOffset += len;
+		needFullBright = needFullBright || remaps[i].fullBright;
+	}
+
+	plan.fullBrightOffset = -1;
+	if (needFullBright) {
+		plan.fullBrightOffset = lightOffset;
+		lightOffset += MAX_SURFACE_EXTENT * MAX_SURFACE_EXTENT * sizeof(COLOR3);
+
+		for (int i = 0; i < maps.size(); i++) {
+			if (remaps[i].fullBright) {
+				remaps[i].lightBase = plan.fullBrightOffset;
+			}
+		}
+	}
+
+	plan.lightingLen = lightOffset;
+}
+
+unsigned char* BspMerger::build_merged_lump(std::vector<Bsp*>& maps, MERGEPLAN& plan, int lumpIdx, int& len) {
+	const int HULL_COUNT = MAX_MAP_HULLS - 1;
+	std::vector<MERGEREMAP>& remaps = plan.remaps;
+	int splitCount = (int)plan.tree.size();
+
+	switch (lumpIdx) {
+	case LUMP_PLANES: {
+		BSPPLANE* newPlanes = allocLump<BSPPLANE>(plan.planes.size());
+		if (plan.planes.size())
+			memcpy(newPlanes, &plan.planes[0], plan.planes.size() * sizeof(BSPPLANE));
+		len = (int)(plan.planes.size() * sizeof(BSPPLANE));
+		return (unsigned char*)newPlanes;
+	}
+	case LUMP_TEXTURES: {
+		int mipTexDataSize = 0;
+		for (int i = 0; i < plan.textureSizes.size(); i++) {
+			mipTexDataSize += plan.textureSizes[i];
+		}
+
+		unsigned int texHeaderSize = (unsigned int)((plan.textures.size() + 1) * sizeof(int));
+		len = texHeaderSize + mipTexDataSize;
+		unsigned char* newTextures = new unsigned char[len];
+
+		// write texture lump header
+		int* texHeader = (int*)newTextures;
+		texHeader[0] = (int)plan.textures.size();
+
+		unsigned char* mipTexWritePtr = newTextures + texHeaderSize;
+		for (int i = 0; i < plan.textures.size(); i++) {
+			if (!plan.textures[i]) {
+				texHeader[i + 1] = -1;
+				continue;
+			}
+			texHeader[i + 1] = (int)(mipTexWritePtr - newTextures);
+			memcpy(mipTexWritePtr, plan.textures[i], plan.textureSizes[i]); // Note: won't work if pixel data isn't immediately after struct
+			mipTexWritePtr += plan.textureSizes[i];
+		}
+		return newTextures;
+	}
+	case LUMP_TEXINFO: {
+		BSPTEXTUREINFO* newTexinfos = allocLump<BSPTEXTUREINFO>(plan.texinfos.size());
+		if (plan.texinfos.size())
+			memcpy(newTexinfos, &plan.texinfos[0], plan.texinfos.size() * sizeof(BSPTEXTUREINFO));
+		len = (int)(plan.texinfos.size() * sizeof(BSPTEXTUREINFO));
+		return (unsigned char*)newTexinfos;
+	}
+	case LUMP_VERTICES: {
+		vec3* newVerts = allocLump<vec3>(plan.vertCount);
+		for (int i = 0; i < maps.size(); i++) {
+			memcpy(newVerts + remaps[i].vertBase, maps[i]->verts, maps[i]->vertCount * sizeof(vec3));
+		}
+		len = plan.vertCount * sizeof(vec3);
+		return (unsigned char*)newVerts;
+	}
+	case LUMP_EDGES: {
+		BSPEDGE* newEdges = allocLump<BSPEDGE>(plan.edgeCount);
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			for (unsigned int k = 0; k < map.edgeCount; k++) {
+				BSPEDGE edge = map.edges[k];
+				edge.iVertex[0] = edge.iVertex[0] + remaps[i].vertBase;
+				edge.iVertex[1] = edge.iVertex[1] + remaps[i].vertBase;
+				newEdges[remaps[i].edgeBase + k] = edge;
+			}
+		}
+		len = plan.edgeCount * sizeof(BSPEDGE);
+		return (unsigned char*)newEdges;
+	}
+	case LUMP_SURFEDGES: {
+		int* newSurfedges = allocLump<int>(plan.surfedgeCount);
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			int edgeBase = remaps[i].edgeBase;
+			for (unsigned int k = 0; k < map.surfedgeCount; k++) {
+				int surfEdge = map.surfedges[k];
+				newSurfedges[remaps[i].surfedgeBase + k] = surfEdge < 0 ? surfEdge - edgeBase : surfEdge + edgeBase;
+			}
+		}
+		len = plan.surfedgeCount * sizeof(int);
+		return (unsigned char*)newSurfedges;
+	}
+	case LUMP_FACES: {
+		BSPFACE* newFaces = allocLump<BSPFACE>(plan.faceCount);
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			MERGEREMAP& remap = remaps[i];
+			for (unsigned int k = 0; k < map.faceCount; k++) {
+				BSPFACE face = map.faces[k];
+				face.iPlane = remap.planes[face.iPlane];
+				face.iFirstEdge = face.iFirstEdge + remap.surfedgeBase;
+				face.iTextureInfo = remap.texinfos[face.iTextureInfo];
+				if (remap.fullBright) {
+					face.nLightmapOffset = remap.lightBase;
+				}
+				else if (face.nLightmapOffset != (unsigned int)-1) {
+					face.nLightmapOffset += remap.lightBase;
+				}
+				newFaces[remap.remapFace(k)] = face;
+			}
+		}
+		len = plan.faceCount * sizeof(BSPFACE);
+		return (unsigned char*)newFaces;
+	}
+	case LUMP_MARKSURFACES: {
+		unsigned short* newMarkSurfs = allocLump<unsigned short>(plan.markSurfCount);
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			for (unsigned int k = 0; k < map.marksurfCount; k++) {
+				newMarkSurfs[remaps[i].markSurfBase + k] = (unsigned short)remaps[i].remapFace(map.marksurfs[k]);
+			}
+		}
+		len = plan.markSurfCount * sizeof(unsigned short);
+		return (unsigned char*)newMarkSurfs;
+	}
+	case LUMP_VISIBILITY:
+		return build_merged_vis(maps, plan, len);
+	case LUMP_LEAVES: {
+		BSPLEAF* newLeaves = allocLump<BSPLEAF>(plan.leafCount);
+		newLeaves[0] = maps[0]->leaves[0];
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			MERGEREMAP& remap = remaps[i];
+			for (unsigned int k = 1; k < map.leafCount; k++) {
+				BSPLEAF leaf = map.leaves[k];
+				if (leaf.nMarkSurfaces) {
+					leaf.iFirstMarkSurface = leaf.iFirstMarkSurface + remap.markSurfBase;
+				}
+				newLeaves[remap.leaves[k]] = leaf;
+			}
+		}
+
+		// submodel leaves keep their old offsets. The game ignores VIS for them.
+		for (int i = 0; i < plan.visOffsets.size(); i++) {
+			newLeaves[i + 1].nVisOffset = plan.visOffsets[i];
+		}
+		len = plan.leafCount * sizeof(BSPLEAF);
+		return (unsigned char*)newLeaves;
+	}
+	case LUMP_NODES: {
+		BSPNODE* newNodes = allocLump<BSPNODE>(plan.nodeCount);
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			MERGEREMAP& remap = remaps[i];
+			for (unsigned int k = 0; k < map.nodeCount; k++) {
+				BSPNODE node = map.nodes[k];
+				for (int c = 0; c < 2; c++) {
+					if (node.iChildren[c] >= 0) {
+						node.iChildren[c] += remap.nodeBase;
+					}
+					else {
+						node.iChildren[c] = ~((short)remap.leaves[~node.iChildren[c]]);
+					}
+				}
+				node.iPlane = remap.planes[node.iPlane];
+				if (node.nFaces) {
+					node.firstFace = (unsigned short)remap.remapFace(node.firstFace);
+				}
+				newNodes[remap.nodeBase + k] = node;
+			}
+		}
+
+		// separating nodes. Their children are other separating nodes or the world head nodes of each map
+		for (int i = 0; i < splitCount; i++) {
+			MERGENODE& split = plan.tree[i];
+
+			BSPNODE& node = newNodes[i];
+			node.iPlane = plan.splitPlanes[i];
+			node.nMins[0] = (short)split.mins.x;
+			node.nMins[1] = (short)split.mins.y;
+			node.nMins[2] = (short)split.mins.z;
+			node.nMaxs[0] = (short)split.maxs.x;
+			node.nMaxs[1] = (short)split.maxs.y;
+			node.nMaxs[2] = (short)split.maxs.z;
+			node.firstFace = 0;
+			node.nFaces = 0; // none since this plane is in the void
+
+			for (int c = 0; c < 2; c++) {
+				int child = split.children[c];
+				if (child >= 0) {
+					node.iChildren[c] = (short)child;
+					continue;
+				}
+				MERGEREMAP& remap = remaps[~child];
+				int headnode = maps[~child]->models[0].iHeadnodes[0];
+				node.iChildren[c] = headnode >= 0 ? (short)(remap.nodeBase + headnode) : ~((short)remap.leaves[~headnode]);
+			}
+		}
+		len = plan.nodeCount * sizeof(BSPNODE);
+		return (unsigned char*)newNodes;
+	}
+	case LUMP_CLIPNODES: {
+		BSPCLIPNODE* newClipnodes = allocLump<BSPCLIPNODE>(plan.clipnodeCount);
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			MERGEREMAP& remap = remaps[i];
+			for (unsigned int k = 0; k < map.clipnodeCount; k++) {
+				BSPCLIPNODE node = map.clipnodes[k];
+				node.iPlane = remap.planes[node.iPlane];
+				for (int c = 0; c < 2; c++) {
+					if (node.iChildren[c] >= 0) {
+						node.iChildren[c] += remap.clipnodeBase;
+					}
+				}
+				newClipnodes[remap.clipnodeBase + k] = node;
+			}
+		}
+
+		// one block of separating clipnodes per hull
+		for (int i = 0; i < splitCount; i++) {
+			MERGENODE& split = plan.tree[i];
+
+			for (int h = 0; h < HULL_COUNT; h++) {
+				BSPCLIPNODE& clipnode = newClipnodes[h * splitCount + i];
+				clipnode.iPlane = plan.splitPlanes[i];
+
+				for (int c = 0; c < 2; c++) {
+					int child = split.children[c];
+					if (child >= 0) {
+						clipnode.iChildren[c] = (short)(h * splitCount + child);
+						continue;
+					}
+					MERGEREMAP& remap = remaps[~child];
+					int headnode = maps[~child]->models[0].iHeadnodes[h + 1];
+					clipnode.iChildren[c] = headnode >= 0 ? (short)(remap.clipnodeBase + headnode) : (short)headnode;
+				}
+			}
+		}
+		len = plan.clipnodeCount * sizeof(BSPCLIPNODE);
+		return (unsigned char*)newClipnodes;
+	}
+	case LUMP_MODELS: {
+		BSPMODEL* newModels = allocLump<BSPMODEL>(plan.modelCount);
+		for (int i = 0; i < maps.size(); i++) {
+			Bsp& map = *maps[i];
+			MERGEREMAP& remap = remaps[i];
+			for (unsigned int k = 1; k < map.modelCount; k++) {
+				BSPMODEL model = map.models[k];
+				if (model.iHeadnodes[0] >= 0)
+					model.iHeadnodes[0] += remap.nodeBase;
+				for (int h = 1; h < MAX_MAP_HULLS; h++) {
+					if (model.iHeadnodes[h] >= 0)
+						model.iHeadnodes[h] += remap.clipnodeBase;
+				}
+				if (model.nFaces) {
+					model.iFirstFace = remap.remapFace(model.iFirstFace);
+				}
+				newModels[remap.subModelBase + (k - 1)] = model;
+			}
+		}
+
+		BSPMODEL& world = newModels[0];
+		world = maps[0]->models[0];
+		world.iHeadnodes[0] = 0;
+		for (int h = 0; h < HULL_COUNT; h++) {
+			world.iHeadnodes[h + 1] = h * splitCount;
+		}
+		world.nVisLeafs = plan.worldLeafCount;
+		world.iFirstFace = 0;
+		world.nFaces = plan.worldFaceCount;
+		world.nMins = plan.tree[0].mins;
+		world.nMaxs = plan.tree[0].maxs;
+
+		len = plan.modelCount * sizeof(BSPMODEL);
+		return (unsigned char*)newModels;
+	}
+	case LUMP_LIGHTING: {
+		unsigned char* newLighting = new unsigned char[plan.lightingLen];
+		for (int i = 0; i < maps.size(); i++) {
+			if (!remaps[i].fullBright) {
+				memcpy(newLighting + remaps[i].lightBase, maps[i]->lightdata, maps[i]->header.lump[LUMP_LIGHTING].nLength);
+			}
+		}
+		if (plan.fullBrightOffset >= 0) {
+			memset(newLighting + plan.fullBrightOffset, 255, plan.lightingLen - plan.fullBrightOffset);
+		}
+		len = plan.lightingLen;
+		return newLighting;
+	}
+	}
+
+	len = 0;
+	return NULL;
+}
+
+unsigned char* BspMerger::build_merged_vis(std::vector<Bsp*>& maps, MERGEPLAN& plan, int& len, bool sizeOnly) {
+	int totalVisLeaves = plan.leafCount - 1; // VIS ignores the shared solid leaf 0
+	int newVisRowSize = ((totalVisLeaves + 63) & ~63) >> 3;
+
+	g_progress.update("Merging visibility", plan.worldLeafCount);
+
+	plan.visOffsets.resize(plan.worldLeafCount);
+
+	// Compressed rows, in world leaf order. Identical rows are only written once, like in CompressAll.
+	VisLumpWriter visWriter;
+
+	// model leaves don't need to be decompressed because the game ignores VIS for them.
+	for (int i = 0; i < maps.size(); i++) {
+		Bsp& map = *maps[i];
+		int worldLeaves = map.models[0].nVisLeafs;
+		if (worldLeaves <= 0) {
+			continue;
+		}
+
+		// the map's world leaves are consecutive in the merged map, so its rows are too
+		int shift = plan.remaps[i].leaves[1] - 1;
+
+		visWriter.addRows(worldLeaves, newVisRowSize, [&](int k, unsigned char* row) {
+			decompress_vis_row(map.leaves[k + 1], map.visdata, row, worldLeaves, map.leafCount - 1, totalVisLeaves);
+
+			// move the visibility bits to the map's leaf indexes in the merged map
+			shiftVis(row, newVisRowSize, 0, shift);
+		}, &plan.visOffsets[shift]);
+	}
+
+	len = visWriter.size();
+	if (sizeOnly) {
+		return NULL;
+	}
+
+	sharedVisRows = visWriter.getSharedRows();
+	sharedVisBytes = visWriter.getSharedBytes();
+
+	return visWriter.copyData();
+}
+
+void BspMerger::merge_all_ents(std::vector<Bsp*>& maps, std::vector<MERGEREMAP>& remaps) {
+	Bsp& output = *maps[0];
+
+	int totalEntCount = 0;
+	for (int i = 0; i < maps.size(); i++) {
+		totalEntCount += (int)maps[i]->ents.size();
+	}
+
+	g_progress.update("Merging entities", totalEntCount);
+
+	Entity* worldspawn = NULL;
+	for (int i = 0; i < output.ents.size(); i++) {
+		if (output.ents[i]->keyvalues["classname"] == "worldspawn") {
+			worldspawn = output.ents[i];
+			break;
+		}
+	}
+
+	// merged wad list, without paths
+	std::vector<std::string> wads;
+	if (worldspawn) {
+		wads = splitString(worldspawn->keyvalues["wad"], ";");
+		for (int j = 0; j < wads.size(); j++) {
+			wads[j] = basename(wads[j]);
+		}
+	}
+
+	// the first map's submodels are first in the merged model list, so its entities are unchanged
+	for (int i = 1; i < maps.size(); i++) {
+		Bsp& map = *maps[i];
+
+		for (int k = 0; k < map.ents.size(); k++) {
+			Entity* ent = map.ents[k];
+			g_progress.tick();
+
+			if (ent->keyvalues["classname"] == "worldspawn") {
+				std::vector<std::string> otherWads = splitString(ent->keyvalues["wad"], ";");
+				for (int j = 0; j < otherWads.size(); j++) {
+					std::string wad = basename(otherWads[j]);
+					if (std::find(wads.begin(), wads.end(), wad) == wads.end()) {
+						wads.push_back(wad);
+					}
+				}
+				continue;
+			}
+
+			Entity* copy = new Entity();
+			copy->keyvalues = ent->keyvalues;
+			copy->keyOrder = ent->keyOrder;
+
+			if (copy->hasKey("model") && copy->keyvalues["model"][0] == '*') {
+				std::string modelIdxStr = copy->keyvalues["model"].substr(1);
+				int modelIdx = isNumeric(modelIdxStr) ? atoi(modelIdxStr.c_str()) : 0;
+				if (modelIdx > 0) {
+					copy->setOrAddKeyvalue("model", "*" + std::to_string(remaps[i].subModelBase + modelIdx - 1));
+				}
+			}
+
+			output.ents.push_back(copy);
+		}
+	}
+
+	if (worldspawn) {
+		std::string wadList;
+		for (int j = 0; j < wads.size(); j++) {
+			wadList += wads[j] + ";";
+		}
+		worldspawn->setOrAddKeyvalue("wad", wadList);
+	}
+}
@@ -1,5 +1,6 @@
 #include "util.h"
 #include "Bsp.h"
+#include <functional>
 
 // bounding box for a map, used for arranging maps for merging
 struct MAPBLOCK
@@ -15,6 +16,70 @@ struct MAPBLOCK
 	}
 };
 
+// node of the separating-plane tree that joins the world models of N maps
+struct MERGENODE
+{
+	BSPPLANE plane; // always has a positive normal
+	int children[2]; // front (higher coordinates), back. >= 0 = MERGENODE index, < 0 = ~map index
+	vec3 mins, maxs;
+};
+
+// where each input map's structures are written in an N-way merge output
+struct MERGEREMAP
+{
+	std::vector<int> planes;
+	std::vector<int> textures;
+	std::vector<int> texinfos;
+	std::vector<int> leaves;
+
+	int vertBase;
+	int edgeBase;
+	int surfedgeBase;
+	int markSurfBase;
+	int worldFaceBase; // world faces of every map come first, followed by submodel faces
+	int subFaceBase;
+	int worldFaceCount;
+	int nodeBase;
+	int clipnodeBase;
+	int subModelBase; // merged index of the map's first submodel
+	int lightBase; // added to face lightmap offsets
+	bool fullBright; // map has no lighting. Its faces use the full-bright lightmap at lightBase
+
+	int remapFace(int faceIdx) const {
+		return faceIdx < worldFaceCount ? worldFaceBase + faceIdx : subFaceBase + (faceIdx - worldFaceCount);
+	}
+};
+
+// remap tables and deduplicated structures for an N-way merge, calculated before any output lump is built
+struct MERGEPLAN
+{
+	std::vector<MERGENODE> tree; // separating nodes. Node 0 is the root.
+	std::vector<int> splitPlanes; // merged plane index of each separating node
+	std::vector<MERGEREMAP> remaps;
+	std::vector<BSPPLANE> planes;
+	std::vector<BSPTEXTUREINFO> texinfos;
+	std::vector<BSPMIPTEX*> textures; // points to input map data. NULL for missing textures
+	std::vector<int> textureSizes;
+	std::vector<int> visOffsets; // compressed row offset of each world leaf (excluding leaf 0), set when building vis
+
+	int vertCount;
+	int edgeCount;
+	int surfedgeCount;
+	int markSurfCount;
+	int worldFaceCount;
+	int faceCount;
+	int worldLeafCount;
+	int leafCount;
+	int nodeCount;
+	int clipnodeCount;
+	int modelCount;
+	int lightingLen;
+	int fullBrightOffset; // -1 if every map has lighting (or none do)
+};
+
+// receives each merged lump as it's built and takes ownership of the data
+typedef std::function<void(int lumpIdx, unsigned char* data, int len)> MergeLumpWriter;
+
 class BspMerger {
 public:
 	BspMerger() = default;
@@ -22,17 +87,67 @@ public:
 	// merges all maps into one
 	// noripent - don't change any entity logic
 	// noscript - don't add support for the bspguy map script (worse performance + buggy, but simpler)
-	Bsp* merge(std::vector<Bsp*> maps, const vec3& gap, const std::string& output_name, bool noripent, bool noscript);
+	// pairwise - merge maps one pair at a time instead of writing all maps into the output in one pass
+	Bsp* merge(std::vector<Bsp*> maps, const vec3& gap, const std::string& output_name, bool noripent, bool noscript,
+		bool pairwise=false);
+
+	// Calculates the structure counts and lump sizes of merging the maps, without building the merged lumps.
+	// The maps are moved apart like in a real merge. entCount excludes entities added for map series logic.
+	// Returns false if the maps can't be merged.
+	bool project_merge(std::vector<Bsp*> maps, const vec3& gap, STRUCTCOUNT& counts, int& entCount);
+
+	// Merges BSP files into output_name without keeping every map loaded. Each input is loaded and
+	// preprocessed one at a time, then saved to a temporary folder next to the output. The temporary
+	// files are memory-mapped while merging and each output lump is written to the file as soon as
+	// it's built, so only one output lump is held in memory at a time.
+	bool merge_files(std::vector<std::string> mapPaths, const vec3& gap, const std::string& output_name, bool noripent,
+		bool noscript, std::function<void(Bsp*)> preprocess);
 
 private:
 	int merge_ops = 0;
 
+	// duplicate VIS rows that were written once and shared in the last merge
+	int sharedVisRows = 0;
+	int sharedVisBytes = 0;
+
+	// merges the map grid one pair at a time: rows, then layers, then the final cube
+	Bsp* merge_pairwise(std::vector<std::vector<std::vector<MAPBLOCK>>>& blocks, int mapCount);
+
+	// merges neighboring maps in each group in rounds, until each group is merged into its first map.
+	// All merges in a round run in parallel.
+	void merge_groups(std::vector<std::vector<MAPBLOCK*>>& groups, std::vector<std::string>& groupNames, int& mergesLeft);
+
 	// wrapper around BSP data merging for nicer console output
 	void merge(MAPBLOCK& dst, MAPBLOCK& src, std::string resultName);
 
 	// merge BSP data
 	bool merge(Bsp& mapA, Bsp& mapB);
 
+	// merges BSP data of all maps into maps[0]. Every remap table and lump size is calculated up front,
+	// then each map's structures are written directly to their final positions in the output lumps.
+	bool merge_all(std::vector<Bsp*>& maps);
+
+	// recursively splits the maps with axis-aligned planes. Returns the index of the new node, or ~mapIdx
+	// if only one map is left. Returns INT_MAX if the maps overlap.
+	int build_merge_tree(std::vector<Bsp*>& maps, std::vector<int> mapIdxs, std::vector<MERGENODE>& tree);
+
+	// builds each merged lump in dependency order and passes it to writeLump. The input maps must not
+	// change until every lump is written.
+	bool merge_all_lumps(std::vector<Bsp*>& maps, std::vector<MERGEREMAP>& remaps, MergeLumpWriter writeLump);
+
+	bool plan_merge_all(std::vector<Bsp*>& maps, MERGEPLAN& plan);
+	void plan_merge_textures(std::vector<Bsp*>& maps, MERGEPLAN& plan);
+	void plan_merge_lighting(std::vector<Bsp*>& maps, MERGEPLAN& plan);
+
+	unsigned char* build_merged_lump(std::vector<Bsp*>& maps, MERGEPLAN& plan, int lumpIdx, int& len);
+
+	// vis rows are decompressed, shifted, and compressed one at a time.
+	// sizeOnly = only calculate the lump size. The size is exact, but no lump is returned.
+	unsigned char* build_merged_vis(std::vector<Bsp*>& maps, MERGEPLAN& plan, int& len, bool sizeOnly=false);
+
+	// appends the entities of every other map to maps[0]. The entity lump is not updated.
+	void merge_all_ents(std::vector<Bsp*>& maps, std::vector<MERGEREMAP>& remaps);
+
 	std::vector<std::vector<std::vector<MAPBLOCK>>> separate(std::vector<Bsp*>& maps, const vec3& gap);
 
 	// for maps in a series:
@@ -0,0 +1,541 @@
+#include "EntLump.h"
+#include "util.h"
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+
+void parseEntities(const char* data, size_t len, const std::string& name, std::vector<Entity*>& ents)
+{
+	membuf sbuf((char*)data, (int)len);
+	std::istream in(&sbuf);
+
+	int lineNum = 0;
+	int lastBracket = -1;
+	Entity* ent = NULL;
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		lineNum++;
+
+		while (line[0] == ' ' || line[0] == '\t' || line[0] == '\r')
+		{
+			line.erase(line.begin());
+		}
+
+		if (line.length() < 1 || line[0] == '\n')
+			continue;
+
+		if (line[0] == '{')
+		{
+			if (lastBracket == 0)
+			{
+				logf("%s.bsp ent data (line %d): Unexpected '{'\n", name.c_str(), lineNum);
+				continue;
+			}
+			lastBracket = 0;
+			if (ent)
+				delete ent;
+			ent = new Entity();
+
+			if (line.find('}') == std::string::npos &&
+				line.find('\"') == std::string::npos)
+			{
+				continue;
+			}
+		}
+		if (line[0] == '}')
+		{
+			if (lastBracket == 1)
+				logf("%s.bsp ent data (line %d): Unexpected '}'\n", name.c_str(), lineNum);
+			lastBracket = 1;
+			if (!ent)
+				continue;
+
+			if (ent->keyvalues.count("classname"))
+				ents.push_back(ent);
+			else
+				logf("Found unknown classname entity. Skip it.\n");
+
+			ent = NULL;
+
+			// you can end/start an ent on the same line, you know
+			if (line.find('{') != std::string::npos)
+			{
+				ent = new Entity();
+				lastBracket = 0;
+
+				if (line.find('\"') == std::string::npos)
+				{
+					continue;
+				}
+				line.erase(line.begin());
+			}
+		}
+		if (lastBracket == 0 && ent) // currently defining an entity
+		{
+			Keyvalues k(line);
+			for (int i = 0; i < k.keys.size(); i++)
+			{
+				ent->addKeyvalue(k.keys[i],k.values[i]);
+			}
+
+			if (line.find('}') != std::string::npos)
+			{
+				lastBracket = 1;
+
+				if (ent->keyvalues.count("classname"))
+					ents.push_back(ent);
+				else
+					logf("Found unknown classname entity. Skip it.\n");
+				ent = NULL;
+			}
+			if (line.find('{') != std::string::npos)
+			{
+				ent = new Entity();
+				lastBracket = 0;
+			}
+		}
+	}
+
+	if (ents.size() > 1)
+	{
+		if (ents[0]->keyvalues["classname"] != "worldspawn")
+		{
+			logf("First entity has classname different from 'woldspawn', we do fixup it\n");
+			for (int i = 1; i < ents.size(); i++)
+			{
+				if (ents[i]->keyvalues["classname"] == "worldspawn")
+				{
+					std::swap(ents[0], ents[i]);
+					break;
+				}
+			}
+		}
+	}
+
+	if (ent)
+		delete ent;
+}
+
+std::string serializeEntities(const std::vector<Entity*>& ents, bool stripNodes) {
+	std::stringstream ent_data;
+
+	for (int i = 0; i < ents.size(); i++) {
+		if (stripNodes) {
+			std::string cname = ents[i]->keyvalues["classname"];
+			if (cname == "info_node" || cname == "info_node_air") {
+				continue;
+			}
+		}
+
+		ent_data << "{\n";
+
+		for (int k = 0; k < ents[i]->keyOrder.size(); k++) {
+			std::string key = ents[i]->keyOrder[k];
+			ent_data << "\"" << key << "\" \"" << ents[i]->keyvalues[key] << "\"\n";
+		}
+
+		ent_data << "}";
+		if (i < ents.size() - 1) {
+			ent_data << "\n"; // trailing newline crashes sven, and only sven, and only sometimes
+		}
+	}
+
+	return ent_data.str();
+}
+
+static void writeJsonString(std::string& out, const std::string& s) {
+	out += '"';
+	for (size_t i = 0; i < s.size(); i++) {
+		unsigned char c = (unsigned char)s[i];
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20 || c >= 0x80) {
+				// entity data is 8-bit text, not UTF-8, so high bytes are escaped as single code points
+				char esc[8];
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				out += esc;
+			}
+			else {
+				out += (char)c;
+			}
+		}
+	}
+	out += '"';
+}
+
+std::string entitiesToJson(const std::vector<Entity*>& ents) {
+	std::string out = "[\n";
+
+	for (size_t i = 0; i < ents.size(); i++) {
+		Entity* ent = ents[i];
+		out += "\t{";
+		for (size_t k = 0; k < ent->keyOrder.size(); k++) {
+			out += k == 0 ? "\n\t\t" : ",\n\t\t";
+			writeJsonString(out, ent->keyOrder[k]);
+			out += ": ";
+			writeJsonString(out, ent->keyvalues[ent->keyOrder[k]]);
+		}
+		out += i < ents.size() - 1 ? "\n\t},\n" : "\n\t}\n";
+	}
+
+	out += "]\n";
+	return out;
+}
+
+// Minimal parser for the format written by entitiesToJson. Numbers, true/false, and null
+// values are stored as their text so that hand-written files still load.
+class EntJsonParser
+{
+public:
+	EntJsonParser(const std::string& json, const std::string& name) : json(json), name(name) {}
+
+	bool parse(std::vector<Entity*>& ents) {
+		skipSpace();
+		if (!expect('['))
+			return false;
+
+		skipSpace();
+		if (peek() == ']') {
+			pos++;
+			return true;
+		}
+
+		while (true) {
+			Entity* ent = new Entity();
+			if (!parseEntity(ent)) {
+				delete ent;
+				return false;
+			}
+
+			if (ent->keyvalues.count("classname"))
+				ents.push_back(ent);
+			else {
+				logf("Found unknown classname entity. Skip it.\n");
+				delete ent;
+			}
+
+			skipSpace();
+			if (peek() == ',') {
+				pos++;
+				skipSpace();
+				continue;
+			}
+			return expect(']');
+		}
+	}
+
+private:
+	const std::string& json;
+	const std::string& name;
+	size_t pos = 0;
+
+	char peek() {
+		return pos < json.size() ? json[pos] : '\0';
+	}
+
+	void skipSpace() {
+		while (pos < json.size() && (json[pos] == ' ' || json[pos] == '\t' || json[pos] == '\n' || json[pos] == '\r'))
+			pos++;
+	}
+
+	bool error(const char* msg) {
+		int line = 1 + (int)std::count(json.begin(), json.begin() + std::min(pos, json.size()), '\n');
+		logf("%s (line %d): %s\n", name.c_str(), line, msg);
+		return false;
+	}
+
+	bool expect(char c) {
+		skipSpace();
+		if (peek() != c) {
+			char msg[32];
+			snprintf(msg, sizeof(msg), "Expected '%c'", c);
+			return error(msg);
+		}
+		pos++;
+		return true;
+	}
+
+	bool parseEntity(Entity* ent) {
+		if (!expect('{'))
+			return false;
+
+		skipSpace();
+		if (peek() == '}') {
+			pos++;
+			return true;
+		}
+
+		while (true) {
+			std::string key, value;
+			skipSpace();
+			if (!parseString(key) || !expect(':'))
+				return false;
+			skipSpace();
+			if (!parseValue(value))
+				return false;
+
+			ent->addKeyvalue(key, value);
+
+			skipSpace();
+			if (peek() == ',') {
+				pos++;
+				continue;
+			}
+			return expect('}');
+		}
+	}
+
+	bool parseValue(std::string& value) {
+		if (peek() == '"')
+			return parseString(value);
+
+		size_t start = pos;
+		while (pos < json.size() && strchr(",}] \t\r\n", json[pos]) == NULL)
+			pos++;
+		if (pos == start)
+			return error("Expected a value");
+
+		value = json.substr(start, pos - start);
+		if (value == "null")
+			value.clear();
+		return true;
+	}
+
+	bool parseString(std::string& out) {
+		if (peek() != '"')
+			return error("Expected a string");
+		pos++;
+
+		while (pos < json.size() && json[pos] != '"') {
+			char c = json[pos++];
+			if (c != '\\') {
+				out += c;
+				continue;
+			}
+			if (pos >= json.size())
+				break;
+
+			char e = json[pos++];
+			switch (e) {
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'u': {
+				if (pos + 4 > json.size())
+					return error("Bad unicode escape");
+				unsigned int code = (unsigned int)strtoul(json.substr(pos, 4).c_str(), NULL, 16);
+				pos += 4;
+				// entity data is 8-bit text, so only code points above 0xFF are encoded as UTF-8
+				if (code < 0x100) {
+					out += (char)code;
+				}
+				else if (code < 0x800) {
+					out += (char)(0xC0 | (code >> 6));
+					out += (char)(0x80 | (code & 0x3F));
+				}
+				else {
+					out += (char)(0xE0 | (code >> 12));
+					out += (char)(0x80 | ((code >> 6) & 0x3F));
+					out += (char)(0x80 | (code & 0x3F));
+				}
+				break;
+			}
+			default: out += e; break;
+			}
+		}
+
+		if (peek() != '"')
+			return error("Unterminated string");
+		pos++;
+		return true;
+	}
+};
+
+bool parseEntitiesJson(const std::string& json, const std::string& name, std::vector<Entity*>& ents) {
+	EntJsonParser parser(json, name);
+	if (!parser.parse(ents)) {
+		for (size_t i = 0; i < ents.size(); i++)
+			delete ents[i];
+		ents.clear();
+		return false;
+	}
+	return true;
+}
+
+static bool readBspHeader(std::ifstream& fin, const std::string& bspPath, BSPHEADER& header) {
+	fin.read((char*)&header, sizeof(BSPHEADER));
+	if (!fin.good()) {
+		logf("%s is not a valid BSP file\n", bspPath.c_str());
+		return false;
+	}
+	if (header.nVersion != 30) {
+		logf("%s has an unsupported BSP version (%d)\n", bspPath.c_str(), header.nVersion);
+		return false;
+	}
+
+	fin.seekg(0, std::ios::end);
+	long long fileLen = fin.tellg();
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		if (header.lump[i].nOffset < 0 ||
+			(long long)header.lump[i].nOffset + header.lump[i].nLength > fileLen) {
+			logf("%s has an invalid %s lump\n", bspPath.c_str(), g_lump_names[i]);
+			return false;
+		}
+	}
+	fin.seekg(0, std::ios::beg);
+	return true;
+}
+
+bool readEntityLump(const std::string& bspPath, std::string& entData) {
+	std::ifstream fin(bspPath, std::ios::binary);
+	if (!fin.is_open()) {
+		logf("Failed to open %s\n", bspPath.c_str());
+		return false;
+	}
+
+	BSPHEADER header;
+	if (!readBspHeader(fin, bspPath, header)) {
+		return false;
+	}
+
+	BSPLUMP& lump = header.lump[LUMP_ENTITIES];
+	entData.resize(lump.nLength);
+	fin.seekg(lump.nOffset);
+	fin.read(&entData[0], lump.nLength);
+	if (!fin.good()) {
+		logf("Failed to read the entity lump of %s\n", bspPath.c_str());
+		return false;
+	}
+
+	while (!entData.empty() && entData.back() == '\0') {
+		entData.pop_back();
+	}
+	return true;
+}
+
+static bool copyFileRange(std::ifstream& fin, std::ofstream& fout, int offset, int len) {
+	char buffer[65536];
+	fin.seekg(offset);
+	while (len > 0) {
+		int chunk = std::min(len, (int)sizeof(buffer));
+		fin.read(buffer, chunk);
+		if (!fin.good())
+			return false;
+		fout.write(buffer, chunk);
+		len -= chunk;
+	}
+	return true;
+}
+
+bool writeEntityLump(const std::string& bspPath, const std::string& outPath, const std::string& entData) {
+	BSPHEADER header;
+	{
+		std::ifstream fin(bspPath, std::ios::binary);
+		if (!fin.is_open()) {
+			logf("Failed to open %s\n", bspPath.c_str());
+			return false;
+		}
+		if (!readBspHeader(fin, bspPath, header)) {
+			return false;
+		}
+	}
+
+	int newLen = (int)entData.size() + 1; // null terminator
+	BSPLUMP& entLump = header.lump[LUMP_ENTITIES];
+
+	bool sameFile = outPath == bspPath;
+#ifdef USE_FILESYSTEM
+	std::error_code err;
+	sameFile = sameFile || (fileExists(outPath) && fs::equivalent(bspPath, outPath, err));
+#endif
+
+	if (sameFile && newLen <= entLump.nLength) {
+		// fits in the old lump. Zero out the unused bytes so the file stays the same size.
+		std::fstream file(bspPath, std::ios::binary | std::ios::in | std::ios::out);
+		if (!file.is_open()) {
+			logf("Failed to open %s for writing\n", bspPath.c_str());
+			return false;
+		}
+		std::vector<char> lumpData(entLump.nLength, 0);
+		memcpy(&lumpData[0], entData.c_str(), entData.size());
+		entLump.nLength = newLen;
+
+		file.seekp(entLump.nOffset);
+		file.write(&lumpData[0], lumpData.size());
+		file.seekp(0);
+		file.write((char*)&header, sizeof(BSPHEADER));
+		return file.good();
+	}
+
+	// keep the lumps in their original file order
+	int order[HEADER_LUMPS];
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order, order + HEADER_LUMPS, [&header](int a, int b) {
+		return header.lump[a].nOffset < header.lump[b].nOffset;
+	});
+
+	BSPHEADER newHeader = header;
+	newHeader.lump[LUMP_ENTITIES].nLength = newLen;
+	int offset = sizeof(BSPHEADER);
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		int idx = order[i];
+		if (header.lump[idx].nOffset % 4 == 0) {
+			offset = (offset + 3) & ~3; // compilers align lumps to 4 bytes
+		}
+		newHeader.lump[idx].nOffset = offset;
+		offset += newHeader.lump[idx].nLength;
+	}
+
+	std::string tmpPath = outPath + ".tmp";
+	{
+		std::ifstream fin(bspPath, std::ios::binary);
+		std::ofstream fout(tmpPath, std::ios::trunc | std::ios::binary);
+		if (!fin.is_open() || !fout.is_open()) {
+			logf("Failed to open %s for writing\n", tmpPath.c_str());
+			return false;
+		}
+
+		fout.write((char*)&newHeader, sizeof(BSPHEADER));
+		for (int i = 0; i < HEADER_LUMPS; i++) {
+			int idx = order[i];
+			while ((int)fout.tellp() < newHeader.lump[idx].nOffset) {
+				fout.put(0);
+			}
+
+			if (idx == LUMP_ENTITIES) {
+				fout.write(entData.c_str(), newLen);
+			}
+			else if (!copyFileRange(fin, fout, header.lump[idx].nOffset, header.lump[idx].nLength)) {
+				logf("Failed to read the %s lump of %s\n", g_lump_names[idx], bspPath.c_str());
+				fout.close();
+				removeFile(tmpPath);
+				return false;
+			}
+		}
+
+		if (!fout.good()) {
+			logf("Failed to write %s\n", tmpPath.c_str());
+			fout.close();
+			removeFile(tmpPath);
+			return false;
+		}
+	}
+
+	removeFile(outPath);
+	if (rename(tmpPath.c_str(), outPath.c_str()) != 0) {
+		logf("Failed to rename %s to %s\n", tmpPath.c_str(), outPath.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "Entity.h"
+#include "bsptypes.h"
+
+struct membuf : std::streambuf
+{
+	membuf(char* begin, int len) {
+		this->setg(begin, begin, begin + len);
+	}
+};
+
+// Entity lump text <-> Entity objects. name is used in warnings.
+void parseEntities(const char* data, size_t len, const std::string& name, std::vector<Entity*>& ents);
+std::string serializeEntities(const std::vector<Entity*>& ents, bool stripNodes = false);
+
+// JSON array of objects, one per entity. Keys are written in entity key order.
+std::string entitiesToJson(const std::vector<Entity*>& ents);
+bool parseEntitiesJson(const std::string& json, const std::string& name, std::vector<Entity*>& ents);
+
+// Reads only the header and entity lump of a BSP file (trailing null bytes are removed)
+bool readEntityLump(const std::string& bspPath, std::string& entData);
+
+// Replaces the entity lump of a BSP file without loading the other lumps.
+// If outPath is the same file and the new data fits in the old lump, only the header and entity
+// lump bytes are rewritten. Otherwise the file is copied in chunks with the other lumps kept in
+// their original order, and only the offsets after the entity lump shift.
+bool writeEntityLump(const std::string& bspPath, const std::string& outPath, const std::string& entData);
@@ -3,6 +3,11 @@
 #include "Entity.h"
 #include "util.h"
 #include <algorithm>
+#include <atomic>
+#include <set>
+
+// shared by all entities so that a (pointer, revision) pair never repeats
+static std::atomic<unsigned int> g_entity_revision(0);
 
 Entity::Entity(const std::string& classname)
 {
@@ -33,11 +38,15 @@ void Entity::addKeyvalue(const std::string& key, const std::string& value)
 	}
 
 	cachedModelIdx = -2;
+	cachedClassnameRules = -1;
+	revision = ++g_entity_revision;
 	targetsCached = false;
 }
 
 void Entity::setOrAddKeyvalue(const std::string& key, const std::string& value) {
 	cachedModelIdx = -2;
+	cachedClassnameRules = -1;
+	revision = ++g_entity_revision;
 	targetsCached = false;
 
 	if (hasKey(key)) {
@@ -53,6 +62,8 @@ void Entity::removeKeyvalue(const std::string& key) {
 	keyOrder.erase(find(keyOrder.begin(), keyOrder.end(), key));
 	keyvalues.erase(key);
 	cachedModelIdx = -2;
+	cachedClassnameRules = -1;
+	revision = ++g_entity_revision;
 	targetsCached = false;
 }
 
@@ -70,6 +81,8 @@ bool Entity::renameKey(int idx, const std::string& newName) {
 	keyvalues.erase(keyOrder[idx]);
 	keyOrder[idx] = newName;
 	cachedModelIdx = -2;
+	cachedClassnameRules = -1;
+	revision = ++g_entity_revision;
 	targetsCached = false;
 	return true;
 }
@@ -78,18 +91,54 @@ void Entity::clearAllKeyvalues() {
 	keyOrder.clear();
 	keyvalues.clear();
 	cachedModelIdx = -2;
+	cachedClassnameRules = -1;
+	revision = ++g_entity_revision;
 }
 
-void Entity::clearEmptyKeyvalues() {
+int Entity::clearEmptyKeyvalues(const hashmap* defaults) {
+	// keys the engine treats specially, even if empty
+	static const std::set<std::string> protectedKeys{
+		"classname",
+		"origin",
+		"model",
+		"targetname"
+	};
+
 	std::vector<std::string> newKeyOrder;
 	for (int i = 0; i < keyOrder.size(); i++) {
-		if (!keyvalues[keyOrder[i]].empty()) {
-			newKeyOrder.push_back(keyOrder[i]);
+		const std::string& key = keyOrder[i];
+		const std::string& value = keyvalues[key];
+		bool strip = value.empty();
+
+		if (defaults) {
+			if (protectedKeys.find(key) != protectedKeys.end()) {
+				strip = false;
+			}
+			else if ((key == "spawnflags" || key.find("spawnflags#") == 0) && isZeroValue(value)) {
+				strip = true;
+			}
+			else if (!strip) {
+				auto def = defaults->find(key);
+				strip = def != defaults->end() && (def->second == value || (isZeroValue(value) && isZeroValue(def->second)));
+			}
+		}
+
+		if (strip) {
+			keyvalues.erase(key);
+		}
+		else {
+			newKeyOrder.push_back(key);
 		}
 	}
+
+	int removed = (int)(keyOrder.size() - newKeyOrder.size());
 	keyOrder = std::move(newKeyOrder);
 	cachedModelIdx = -2;
+	cachedClassnameRules = -1;
+	revision = ++g_entity_revision;
 	targetsCached = false;
+
+	return removed;
 }
 
 bool Entity::hasKey(const std::string& key)
@@ -143,6 +192,13 @@ bool Entity::isBspModel() {
 	return getBspModelIdx() >= 0;
 }
 
+int Entity::getClassnameRules() {
+	if (cachedClassnameRules == -1) {
+		cachedClassnameRules = ::getClassnameRules(keyvalues["classname"]);
+	}
+	return cachedClassnameRules;
+}
+
 vec3 Entity::getOrigin() {
 	return hasKey("origin") ? parseVector(keyvalues["origin"]) : vec3(0, 0, 0);
 }
@@ -401,14 +457,29 @@ bool Entity::hasTarget(const std::string& checkTarget) {
 }
 
 void Entity::renameTargetnameValues(const std::string& oldTargetname, const std::string& newTargetname) {
+	hashmap renames;
+	renames[oldTargetname] = newTargetname;
+	renameTargetnameValues(renames);
+}
+
+void Entity::renameTargetnameValues(const hashmap& renames) {
+	if (renames.empty())
+		return;
+
 	for (int i = 0; i < TOTAL_TARGETNAME_KEYS; i++) {
-		const char* key = potential_tergetname_keys[i];
-		if (keyvalues.find(key) != keyvalues.end() && keyvalues[key] == oldTargetname) {
-			keyvalues[key] = newTargetname;
+		auto kv = keyvalues.find(potential_tergetname_keys[i]);
+		if (kv == keyvalues.end())
+			continue;
+
+		auto newName = renames.find(kv->second);
+		if (newName != renames.end()) {
+			kv->second = newName->second;
+			revision = ++g_entity_revision;
 		}
 	}
 
-	if (keyvalues["classname"] == "multi_manager") {
+	auto cname = keyvalues.find("classname");
+	if (cname != keyvalues.end() && cname->second == "multi_manager") {
 		// multi_manager is a special case where the targets are in the key names
 		for (int i = 0; i < keyOrder.size(); i++) {
 			std::string tname = keyOrder[i];
@@ -421,10 +492,12 @@ void Entity::renameTargetnameValues(const std::string& oldTargetname, const std:
 				suffix = keyOrder[i].substr(hashPos);
 			}
 
-			if (tname == oldTargetname) {
-				std::string newKey = newTargetname + suffix;
+			auto newName = renames.find(tname);
+			if (newName != renames.end()) {
+				std::string newKey = newName->second + suffix;
 				keyvalues[newKey] = keyvalues[keyOrder[i]];
 				keyOrder[i] = newKey;
+				revision = ++g_entity_revision;
 			}
 		}
 	}
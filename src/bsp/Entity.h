@@ -1,5 +1,6 @@
 #pragma once
 #include "Keyvalue.h"
+#include "entrules.h"
 #include <map>
 
 typedef std::map< std::string, std::string > hashmap;
@@ -11,8 +12,10 @@ public:
 	std::vector<std::string> keyOrder;
 
 	int cachedModelIdx = -2; // -2 = not cached
+	int cachedClassnameRules = -1; // -1 = not cached
 	std::vector<std::string> cachedTargets;
 	bool targetsCached = false;
+	unsigned int revision = 0; // unique id of the current keyvalues, changes on every edit
 
 	Entity(void) = default;
 	Entity(const std::string& classname);
@@ -22,7 +25,11 @@ public:
 	void removeKeyvalue(const std::string& key);
 	bool renameKey(int idx, const std::string& newName);
 	void clearAllKeyvalues();
-	void clearEmptyKeyvalues();
+
+	// deletes keys with empty values. If defaults is set, zero spawnflags and values equal to their
+	// default (key -> value) are deleted too, but classname, origin, model, and targetname are kept.
+	// Returns the number of keys deleted
+	int clearEmptyKeyvalues(const hashmap* defaults = NULL);
 
 	void setOrAddKeyvalue(const std::string& key, const std::string& value);
 
@@ -32,6 +39,9 @@ public:
 
 	bool isBspModel();
 
+	// CNAME_* flags from entrules.h
+	int getClassnameRules();
+
 	vec3 getOrigin();
 
 	bool hasKey(const std::string& key);
@@ -42,6 +52,10 @@ public:
 
 	void renameTargetnameValues(const std::string& oldTargetname, const std::string& newTargetname);
 
+	// applies every old -> new name in renames in one pass over the entity keys.
+	// A renamed value is not looked up again, so renames do not chain.
+	void renameTargetnameValues(const hashmap& renames);
+
 	size_t getMemoryUsage(); // aproximate
 };
 
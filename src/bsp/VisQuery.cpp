@@ -0,0 +1,194 @@
+#include "VisQuery.h"
+#include "Bsp.h"
+#include "vis.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static int popcount64(uint64_t v) {
+#if defined(_MSC_VER)
+	return (int)__popcnt64(v);
+#else
+	return __builtin_popcountll(v);
+#endif
+}
+
+VisBitset::VisBitset(int bitCount) {
+	words.resize((bitCount + 63) / 64);
+}
+
+int VisBitset::count() const {
+	int total = 0;
+	for (uint64_t w : words) {
+		total += popcount64(w);
+	}
+	return total;
+}
+
+void VisBitset::orWith(const VisBitset& other) {
+	size_t n = std::min(words.size(), other.words.size());
+	for (size_t i = 0; i < n; i++) {
+		words[i] |= other.words[i];
+	}
+}
+
+void VisBitset::andWith(const VisBitset& other) {
+	size_t n = std::min(words.size(), other.words.size());
+	for (size_t i = 0; i < n; i++) {
+		words[i] &= other.words[i];
+	}
+	for (size_t i = n; i < words.size(); i++) {
+		words[i] = 0;
+	}
+}
+
+int VisBitset::countAnd(const VisBitset& other) const {
+	size_t n = std::min(words.size(), other.words.size());
+	int total = 0;
+	for (size_t i = 0; i < n; i++) {
+		total += popcount64(words[i] & other.words[i]);
+	}
+	return total;
+}
+
+VisQuery::VisQuery(Bsp* map, int maxCachedRows) {
+	this->map = map;
+	this->maxCachedRows = std::max(1, maxCachedRows);
+	worldLeaves = map->modelCount > 0 ? map->models[0].nVisLeafs : 0;
+	worldLeaves = std::max(0, std::min(worldLeaves, (int)map->leafCount - 1));
+	rowBytes = ((std::max(0, (int)map->leafCount - 1) + 63) & ~63) >> 3;
+	emptyRow = VisBitset(rowBytes * 8);
+}
+
+int VisQuery::findLeaf(const vec3& p) const {
+	if (map->modelCount == 0) {
+		return 0;
+	}
+
+	int iNode = map->models[0].iHeadnodes[0];
+	while (iNode >= 0) {
+		if (iNode >= (int)map->nodeCount) {
+			return 0;
+		}
+		BSPNODE& node = map->nodes[iNode];
+		BSPPLANE& plane = map->planes[node.iPlane];
+
+		float d = dotProduct(plane.vNormal, p) - plane.fDist;
+		iNode = d < 0 ? node.iChildren[1] : node.iChildren[0];
+	}
+
+	int leafIdx = ~iNode;
+	return leafIdx < (int)map->leafCount ? leafIdx : 0;
+}
+
+void VisQuery::decompressRow(int leafIdx, VisBitset& row) const {
+	row.words.assign(rowBytes / 8, 0);
+
+	if (leafIdx <= 0 || leafIdx > worldLeaves) {
+		return; // solid leaf and submodel leaves have no vis
+	}
+
+	BSPLEAF& leaf = map->leaves[leafIdx];
+
+	if (map->visDataLength == 0 || leaf.nVisOffset < 0 || leaf.nVisOffset >= (int)map->visDataLength) {
+		// no vis data = everything is visible
+		for (int i = 0; i < worldLeaves; i++) {
+			row.set(i);
+		}
+		return;
+	}
+
+	decompress_vis_row(leaf, map->visdata, (unsigned char*)row.words.data(), worldLeaves, map->leafCount - 1, map->leafCount - 1);
+}
+
+const VisBitset& VisQuery::getVisibleLeaves(int leafIdx) {
+	if (leafIdx <= 0 || leafIdx > worldLeaves) {
+		return emptyRow;
+	}
+
+	auto it = cache.find(leafIdx);
+	if (it != cache.end()) {
+		cacheHits++;
+		lruOrder.splice(lruOrder.begin(), lruOrder, it->second.second);
+		return it->second.first;
+	}
+
+	cacheMisses++;
+	VisBitset row;
+	if ((int)cache.size() >= maxCachedRows) {
+		// reuse the least recently used row's memory
+		int oldest = lruOrder.back();
+		lruOrder.pop_back();
+		auto oldIt = cache.find(oldest);
+		row.words.swap(oldIt->second.first.words);
+		cache.erase(oldIt);
+	}
+	decompressRow(leafIdx, row);
+
+	lruOrder.push_front(leafIdx);
+	auto& entry = cache[leafIdx];
+	entry.first.words.swap(row.words);
+	entry.second = lruOrder.begin();
+	return entry.first;
+}
+
+bool VisQuery::canSee(int leafA, int leafB) {
+	if (leafB <= 0 || leafB > worldLeaves) {
+		return false;
+	}
+	return getVisibleLeaves(leafA).test(leafB - 1);
+}
+
+bool VisQuery::canSee(const vec3& a, const vec3& b) {
+	return canSee(findLeaf(a), findLeaf(b));
+}
+
+int VisQuery::countVisibleLeaves(int leafIdx) {
+	return getVisibleLeaves(leafIdx).count();
+}
+
+VisBitset VisQuery::getVisibleLeaves(const std::vector<int>& leafIdxs) {
+	VisBitset result(rowBytes * 8);
+	for (int leafIdx : leafIdxs) {
+		result.orWith(getVisibleLeaves(leafIdx));
+	}
+	return result;
+}
+
+std::vector<int> VisQuery::countAllVisibleLeaves() const {
+	std::vector<int> counts(worldLeaves + 1);
+
+	parallelFor(worldLeaves, [&](int start, int end) {
+		VisBitset row;
+		for (int i = start; i < end; i++) {
+			decompressRow(i + 1, row);
+			counts[i + 1] = row.count();
+		}
+	}, 64);
+
+	return counts;
+}
+
+std::vector<bool> VisQuery::canSee(const std::vector<std::pair<vec3, vec3>>& pairs) const {
+	std::vector<char> results(pairs.size());
+
+	parallelFor((int)pairs.size(), [&](int start, int end) {
+		VisBitset row;
+		int rowLeaf = -1;
+		for (int i = start; i < end; i++) {
+			int leafA = findLeaf(pairs[i].first);
+			int leafB = findLeaf(pairs[i].second);
+			if (leafB <= 0 || leafB > worldLeaves) {
+				results[i] = false;
+				continue;
+			}
+			if (leafA != rowLeaf) {
+				decompressRow(leafA, row);
+				rowLeaf = leafA;
+			}
+			results[i] = row.test(leafB - 1);
+		}
+	}, 256);
+
+	return std::vector<bool>(results.begin(), results.end());
+}
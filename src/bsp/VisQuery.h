@@ -0,0 +1,76 @@
+#pragma once
+#include "util.h"
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <functional>
+
+class Bsp;
+
+// A row of the PVS: bit i is set if world leaf i+1 is visible (leaf 0 is the shared solid leaf)
+class VisBitset
+{
+public:
+	std::vector<uint64_t> words;
+
+	VisBitset() = default;
+	VisBitset(int bitCount);
+
+	bool test(int bit) const { return (words[bit >> 6] >> (bit & 63)) & 1; }
+	void set(int bit) { words[bit >> 6] |= 1ULL << (bit & 63); }
+
+	int count() const;
+	void orWith(const VisBitset& other);
+	void andWith(const VisBitset& other);
+	int countAnd(const VisBitset& other) const; // bits set in both, without creating a new bitset
+};
+
+// Answers visibility queries using the VIS lump. Rows are decompressed when first needed and kept in
+// a least-recently-used cache. The cached functions are not thread-safe. The batch functions
+// decompress rows on all cores without touching the cache.
+class VisQuery
+{
+public:
+	VisQuery(Bsp* map, int maxCachedRows = 4096);
+
+	int worldLeafCount() const { return worldLeaves; }
+
+	// returns the world leaf that contains the point (0 = solid)
+	int findLeaf(const vec3& p) const;
+
+	// leaves visible from a leaf. Solid and model leaves see nothing.
+	const VisBitset& getVisibleLeaves(int leafIdx);
+
+	// true if leafB is in the PVS of leafA
+	bool canSee(int leafA, int leafB);
+	bool canSee(const vec3& a, const vec3& b);
+
+	// number of leaves visible from a leaf
+	int countVisibleLeaves(int leafIdx);
+
+	// leaves visible from any of the given leaves
+	VisBitset getVisibleLeaves(const std::vector<int>& leafIdxs);
+
+	// visible leaf count for every world leaf (index = leaf index, out[0] = 0)
+	std::vector<int> countAllVisibleLeaves() const;
+
+	// results[i] = canSee(pairs[i].first, pairs[i].second)
+	std::vector<bool> canSee(const std::vector<std::pair<vec3, vec3>>& pairs) const;
+
+	int getCacheHits() const { return cacheHits; }
+	int getCacheMisses() const { return cacheMisses; }
+
+private:
+	Bsp* map;
+	int worldLeaves;
+	int rowBytes;
+	int maxCachedRows;
+	int cacheHits = 0;
+	int cacheMisses = 0;
+
+	VisBitset emptyRow;
+	std::list<int> lruOrder; // most recently used first
+	std::unordered_map<int, std::pair<VisBitset, std::list<int>::iterator>> cache;
+
+	void decompressRow(int leafIdx, VisBitset& row) const;
+};
@@ -239,6 +239,15 @@ struct Solid {
 	std::vector<HullEdge> hullEdges; // for vertex manipulation (holds indexes into hullVerts)
 };
 
+// lightmap usage of a single light style
+struct LightStyleUsage {
+	int layers = 0; // number of faces with a lightmap layer for this style
+	int blackLayers = 0; // layers that are completely black
+	unsigned int bytes = 0;
+	unsigned int prunableBytes = 0;
+	bool neverOn = false; // all lights using this style start off and are never triggered
+};
+
 // used to construct bounding volumes for solid leaves
 struct NodeVolumeCuts {
 	int nodeIdx;
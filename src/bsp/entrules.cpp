@@ -0,0 +1,262 @@
+#include "entrules.h"
+#include "util.h"
+#include <string.h>
+#include <unordered_map>
+
+struct ClassnameRule
+{
+	const char* classname;
+	int flags;
+};
+
+static constexpr ClassnameRule g_builtin_rules[] = {
+	// ents that never need any hulls
+	{"env_bubbles", CNAME_NEVER_NEEDS_HULLS},
+	{"func_tankcontrols", CNAME_NEVER_NEEDS_HULLS},
+	{"func_traincontrols", CNAME_NEVER_NEEDS_HULLS},
+	{"func_vehiclecontrols", CNAME_NEVER_NEEDS_HULLS},
+	{"trigger_autosave", CNAME_NEVER_NEEDS_HULLS | CNAME_NO_ANGLES}, // obsolete in sven
+	{"trigger_endsection", CNAME_NEVER_NEEDS_HULLS | CNAME_NO_ANGLES}, // obsolete in sven
+
+	// ents that never need collision
+	{"func_illusionary", CNAME_NEVER_NEEDS_COLLISION | CNAME_NO_ANGLES},
+	{"func_mortar_field", CNAME_NEVER_NEEDS_COLLISION},
+
+	// solid unless "Passable" or "Not solid" is checked
+	{"func_door", CNAME_PASSABLE | CNAME_NO_ANGLES},
+	{"func_door_rotating", CNAME_PASSABLE},
+	{"func_pendulum", CNAME_PASSABLE},
+	{"func_tracktrain", CNAME_PASSABLE},
+	{"func_train", CNAME_PASSABLE},
+	{"func_water", CNAME_PASSABLE | CNAME_NO_ANGLES},
+	{"momentary_door", CNAME_PASSABLE | CNAME_NO_ANGLES},
+
+	// triggers that can be touched by point ents
+	{"trigger_once", CNAME_CONDITIONAL_TRIGGER},
+	{"trigger_multiple", CNAME_CONDITIONAL_TRIGGER | CNAME_NO_ANGLES},
+	{"trigger_counter", CNAME_CONDITIONAL_TRIGGER},
+	{"trigger_gravity", CNAME_CONDITIONAL_TRIGGER | CNAME_NO_ANGLES},
+	{"trigger_teleport", CNAME_CONDITIONAL_TRIGGER | CNAME_NO_ANGLES},
+
+	// player-only triggers
+	{"func_ladder", CNAME_PLAYER_ONLY_TRIGGER},
+	{"game_zone_player", CNAME_PLAYER_ONLY_TRIGGER},
+	{"player_respawn_zone", CNAME_PLAYER_ONLY_TRIGGER},
+	{"trigger_cdaudio", CNAME_PLAYER_ONLY_TRIGGER},
+	{"trigger_changelevel", CNAME_PLAYER_ONLY_TRIGGER},
+	{"trigger_transition", CNAME_PLAYER_ONLY_TRIGGER},
+
+	// monster-only triggers
+	{"func_monsterclip", CNAME_MONSTER_ONLY_TRIGGER},
+	{"trigger_monsterjump", CNAME_MONSTER_ONLY_TRIGGER | CNAME_NO_ANGLES},
+
+	// monsters that use hull 2 by default
+	// osprey, nihilanth, and tentacle are huge but are basically nonsolid (no brush collision or triggers)
+	{"monster_alien_grunt", CNAME_LARGE_MONSTER},
+	{"monster_alien_tor", CNAME_LARGE_MONSTER},
+	{"monster_alien_voltigore", CNAME_LARGE_MONSTER},
+	{"monster_babygarg", CNAME_LARGE_MONSTER},
+	{"monster_bigmomma", CNAME_LARGE_MONSTER},
+	{"monster_bullchicken", CNAME_LARGE_MONSTER},
+	{"monster_gargantua", CNAME_LARGE_MONSTER},
+	{"monster_ichthyosaur", CNAME_LARGE_MONSTER},
+	{"monster_kingpin", CNAME_LARGE_MONSTER},
+	{"monster_apache", CNAME_LARGE_MONSTER},
+	{"monster_blkop_apache", CNAME_LARGE_MONSTER},
+
+	// ents that can change how other ents are rendered
+	{"env_render", CNAME_RENDER_CHANGER},
+	{"env_render_individual", CNAME_RENDER_CHANGER},
+	{"trigger_changevalue", CNAME_RENDER_CHANGER},
+	{"trigger_copyvalue", CNAME_RENDER_CHANGER},
+	{"trigger_createentity", CNAME_RENDER_CHANGER},
+	{"trigger_changemodel", CNAME_RENDER_CHANGER},
+
+	// angles are not used for rotation
+	{"func_wall", CNAME_NO_ANGLES},
+	{"spark_shower", CNAME_NO_ANGLES},
+	{"func_plat", CNAME_NO_ANGLES},
+	{"func_conveyor", CNAME_NO_ANGLES},
+	{"func_rot_button", CNAME_NO_ANGLES},
+	{"func_button", CNAME_NO_ANGLES},
+	{"env_blood", CNAME_NO_ANGLES},
+	{"gibshooter", CNAME_NO_ANGLES},
+	{"trigger", CNAME_NO_ANGLES},
+	{"trigger_hurt", CNAME_NO_ANGLES},
+	{"trigger_push", CNAME_NO_ANGLES},
+	{"func_bomb_target", CNAME_NO_ANGLES},
+	{"func_hostage_rescue", CNAME_NO_ANGLES},
+	{"func_vip_safetyzone", CNAME_NO_ANGLES},
+	{"func_escapezone", CNAME_NO_ANGLES},
+	{"env_snow", CNAME_NO_ANGLES},
+	{"func_snow", CNAME_NO_ANGLES},
+	{"env_rain", CNAME_NO_ANGLES},
+	{"func_rain", CNAME_NO_ANGLES}
+};
+
+#define RULE_COUNT ((int)(sizeof(g_builtin_rules) / sizeof(ClassnameRule)))
+#define RULE_TABLE_BITS 9
+#define RULE_TABLE_SIZE (1 << RULE_TABLE_BITS)
+#define RULE_SEED_INVALID 0xffffffff
+
+constexpr unsigned int ruleSlot(unsigned int hash, unsigned int seed)
+{
+	return ((hash ^ seed) * 0x9E3779B1u) >> (32 - RULE_TABLE_BITS);
+}
+
+// find a seed that maps every built-in classname to a different slot
+constexpr unsigned int findPerfectSeed()
+{
+	for (unsigned int seed = 0; seed < 65536; seed++)
+	{
+		bool used[RULE_TABLE_SIZE] = {};
+		bool collision = false;
+		for (int i = 0; i < RULE_COUNT && !collision; i++)
+		{
+			unsigned int slot = ruleSlot(hashClassname(g_builtin_rules[i].classname), seed);
+			collision = used[slot];
+			used[slot] = true;
+		}
+		if (!collision)
+			return seed;
+	}
+	return RULE_SEED_INVALID;
+}
+
+static constexpr unsigned int g_rule_seed = findPerfectSeed();
+static_assert(g_rule_seed != RULE_SEED_INVALID, "No perfect hash seed found for the classname rules");
+
+struct ClassnameRuleTable
+{
+	short ruleIdx[RULE_TABLE_SIZE]; // -1 = empty slot
+	unsigned int hashes[RULE_TABLE_SIZE];
+};
+
+constexpr ClassnameRuleTable buildRuleTable()
+{
+	ClassnameRuleTable table = {};
+	for (int i = 0; i < RULE_TABLE_SIZE; i++)
+	{
+		table.ruleIdx[i] = -1;
+	}
+	for (int i = 0; i < RULE_COUNT; i++)
+	{
+		unsigned int hash = hashClassname(g_builtin_rules[i].classname);
+		unsigned int slot = ruleSlot(hash, g_rule_seed);
+		table.ruleIdx[slot] = (short)i;
+		table.hashes[slot] = hash;
+	}
+	return table;
+}
+
+static constexpr ClassnameRuleTable g_rule_table = buildRuleTable();
+
+struct ExtraClassnameRule
+{
+	std::string classname;
+	int flags;
+};
+
+// rules loaded from data files, keyed by classname hash
+static std::unordered_multimap<unsigned int, ExtraClassnameRule> g_extra_rules;
+
+int getClassnameRules(unsigned int hash, const char* classname)
+{
+	int flags = 0;
+
+	unsigned int slot = ruleSlot(hash, g_rule_seed);
+	int ruleIdx = g_rule_table.ruleIdx[slot];
+	if (ruleIdx >= 0 && g_rule_table.hashes[slot] == hash && strcmp(g_builtin_rules[ruleIdx].classname, classname) == 0)
+	{
+		flags = g_builtin_rules[ruleIdx].flags;
+	}
+
+	if (!g_extra_rules.empty())
+	{
+		auto range = g_extra_rules.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second.classname == classname)
+				flags |= it->second.flags;
+		}
+	}
+
+	return flags;
+}
+
+int getClassnameRules(const std::string& classname)
+{
+	return getClassnameRules(hashClassname(classname.c_str()), classname.c_str());
+}
+
+bool loadClassnameRules(const std::string& path)
+{
+	static const struct
+	{
+		const char* name;
+		int flag;
+	} ruleNames[] = {
+		{"never_needs_hulls", CNAME_NEVER_NEEDS_HULLS},
+		{"never_needs_collision", CNAME_NEVER_NEEDS_COLLISION},
+		{"passable", CNAME_PASSABLE},
+		{"conditional_trigger", CNAME_CONDITIONAL_TRIGGER},
+		{"player_only_trigger", CNAME_PLAYER_ONLY_TRIGGER},
+		{"monster_only_trigger", CNAME_MONSTER_ONLY_TRIGGER},
+		{"large_monster", CNAME_LARGE_MONSTER},
+		{"no_angles", CNAME_NO_ANGLES},
+		{"render_changer", CNAME_RENDER_CHANGER}
+	};
+
+	std::ifstream in(path);
+	if (!in.is_open())
+	{
+		logf("Failed to open classname rules file: %s\n", path.c_str());
+		return false;
+	}
+
+	int lineNum = 0;
+	int ruleCount = 0;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		lineNum++;
+		replaceAll(line, "\t", " ");
+		line = trimSpaces(line);
+		if (line.empty() || line.find("//") == 0)
+			continue;
+
+		std::vector<std::string> parts = splitString(line, " ");
+		ExtraClassnameRule rule;
+		rule.classname = parts[0];
+		rule.flags = 0;
+
+		for (int i = 1; i < parts.size(); i++)
+		{
+			std::string ruleName = trimSpaces(parts[i]);
+			if (ruleName.empty())
+				continue;
+
+			bool found = false;
+			for (int k = 0; k < sizeof(ruleNames) / sizeof(ruleNames[0]); k++)
+			{
+				if (ruleName == ruleNames[k].name)
+				{
+					rule.flags |= ruleNames[k].flag;
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+				logf("Unknown classname rule '%s' (%s line %d)\n", ruleName.c_str(), path.c_str(), lineNum);
+		}
+
+		if (rule.flags)
+		{
+			g_extra_rules.emplace(hashClassname(rule.classname.c_str()), rule);
+			ruleCount++;
+		}
+	}
+
+	debugf("Loaded %d classname rules from %s\n", ruleCount, path.c_str());
+	return true;
+}
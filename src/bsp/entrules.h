@@ -0,0 +1,42 @@
+#pragma once
+#include <string>
+
+// Classname rules used by the hull deletion and visibility heuristics.
+// The built-in rules are a perfect-hash table generated at compile time (see entrules.cpp).
+enum classname_rules
+{
+	CNAME_NEVER_NEEDS_HULLS = 1,		// no collision or faces needed at all
+	CNAME_NEVER_NEEDS_COLLISION = 2,	// only the visible hull is needed
+	CNAME_PASSABLE = 4,					// solid unless spawnflag 8 ("Passable"/"Not solid") is checked
+	CNAME_CONDITIONAL_TRIGGER = 8,		// trigger that can be configured to touch point ents
+	CNAME_PLAYER_ONLY_TRIGGER = 16,		// only touched by players
+	CNAME_MONSTER_ONLY_TRIGGER = 32,	// only touched by monsters
+	CNAME_LARGE_MONSTER = 64,			// monster that uses hull 2 by default
+	CNAME_NO_ANGLES = 128,				// "angles" don't rotate the entity
+	CNAME_RENDER_CHANGER = 256			// can change the rendering or model of other entities at runtime
+};
+
+// FNV-1a hash of a classname
+constexpr unsigned int hashClassname(const char* classname)
+{
+	unsigned int hash = 2166136261u;
+	while (*classname)
+	{
+		hash ^= (unsigned char)*classname++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// returns CNAME_* flags for the classname. hash must be hashClassname(classname)
+int getClassnameRules(unsigned int hash, const char* classname);
+
+int getClassnameRules(const std::string& classname);
+
+// Adds rules for other games from a text file. Each line is a classname followed by
+// rule names, which are OR'd with the built-in rules. Lines starting with // are ignored.
+// Example: "func_breakable_glass never_needs_collision no_angles"
+// Rule names: never_needs_hulls, never_needs_collision, passable, conditional_trigger,
+// player_only_trigger, monster_only_trigger, large_monster, no_angles, render_changer
+// A loaded render_changer keeps every invisible brush entity's faces, since its keys are unknown.
+bool loadClassnameRules(const std::string& path);
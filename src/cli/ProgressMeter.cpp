@@ -3,12 +3,17 @@
 #include <stdio.h> 
 #include "util.h"
 
+thread_local bool ProgressMeter::hideThisThread = false;
+
 ProgressMeter::ProgressMeter() {
 	progress_total = progress = 0;
 	last_progress_title = progress_title = "";
 }
 
 void ProgressMeter::update(const char* newTitle, int totalProgressTicks) {
+	if (hideThisThread) {
+		return;
+	}
 	progress_title = newTitle;
 	progress = 0;
 	progress_total = totalProgressTicks;
@@ -18,7 +23,7 @@ void ProgressMeter::update(const char* newTitle, int totalProgressTicks) {
 }
 
 void ProgressMeter::tick() {
-	if (progress_title[0] == '\0' || simpleMode || hide) {
+	if (progress_title[0] == '\0' || simpleMode || hide || hideThisThread) {
 		return;
 	}
 	if (progress++ > 0) {
@@ -37,7 +42,7 @@ void ProgressMeter::tick() {
 }
 
 void ProgressMeter::clear() {
-	if (simpleMode || hide) {
+	if (simpleMode || hide || hideThisThread) {
 		return;
 	}
 	// 50 chars
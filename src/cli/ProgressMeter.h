@@ -7,6 +7,10 @@ public:
 	bool simpleMode = false;
 	bool hide = false;
 
+	// hides progress from the calling thread only, for worker threads that run code which reports
+	// progress while another thread reports progress for the whole job
+	static thread_local bool hideThisThread;
+
 	ProgressMeter();
 
 	// set a new title for the progress meter and set the number of ticks needed to reach 100%
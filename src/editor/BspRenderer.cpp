@@ -265,11 +265,7 @@ void BspRenderer::updateModelShaders() {
 }
 
 void BspRenderer::loadLightmaps() {
-	std::vector<LightmapNode*> atlases;
-	std::vector<Texture*> atlasTextures;
-	atlases.push_back(new LightmapNode(0, 0, LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-	atlasTextures.push_back(new Texture(LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-	memset(atlasTextures[0]->data, 0, LIGHTMAP_ATLAS_SIZE * LIGHTMAP_ATLAS_SIZE * sizeof(COLOR3));
+	lightmapAtlasSize = std::max(LIGHTMAP_ATLAS_MIN_SIZE, std::min(g_settings.lightmapAtlasSize, LIGHTMAP_ATLAS_MAX_SIZE));
 
 	numRenderLightmapInfos = map->faceCount;
 	lightmaps = new LightmapInfo[map->faceCount];
@@ -277,83 +273,136 @@ void BspRenderer::loadLightmaps() {
 
 	debugf("Calculating lightmaps\n");
 
-	int lightmapCount = 0;
-	int atlasId = 0;
-	for (unsigned int i = 0; i < map->faceCount; i++) {
-		BSPFACE& face = map->faces[i];
-		BSPTEXTUREINFO& texinfo = map->texinfos[face.iTextureInfo];
+	// lightmap sizes don't depend on each other, so they're calculated on all cores
+	std::vector<char> hasLightmap(map->faceCount, 0);
 
-		if (face.nLightmapOffset < 0 || (texinfo.nFlags & TEX_SPECIAL) || face.nLightmapOffset >= map->header.lump[LUMP_LIGHTING].nLength)
-			continue;
+	parallelFor(map->faceCount, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			BSPFACE& face = map->faces[i];
+			BSPTEXTUREINFO& texinfo = map->texinfos[face.iTextureInfo];
 
-		int size[2];
-		int imins[2];
-		int imaxs[2];
-		GetFaceLightmapSize(map, i, size);
-		GetFaceExtents(map, i, imins, imaxs);
+			if (face.nLightmapOffset < 0 || (texinfo.nFlags & TEX_SPECIAL) || face.nLightmapOffset >= map->header.lump[LUMP_LIGHTING].nLength)
+				continue;
 
-		LightmapInfo& info = lightmaps[i];
-		info.w = size[0];
-		info.h = size[1];
-		info.midTexU = (float)(size[0]) / 2.0f;
-		info.midTexV = (float)(size[1]) / 2.0f;
+			int size[2];
+			int imins[2];
+			int imaxs[2];
+			GetFaceLightmapSize(map, i, size);
+			GetFaceExtents(map, i, imins, imaxs);
 
-		// TODO: float mins/maxs not needed?
-		info.midPolyU = (imins[0] + imaxs[0]) * 16 / 2.0f;
-		info.midPolyV = (imins[1] + imaxs[1]) * 16 / 2.0f;
+			LightmapInfo& info = lightmaps[i];
+			info.w = size[0];
+			info.h = size[1];
+			info.midTexU = (float)(size[0]) / 2.0f;
+			info.midTexV = (float)(size[1]) / 2.0f;
+
+			// TODO: float mins/maxs not needed?
+			info.midPolyU = (imins[0] + imaxs[0]) * 16 / 2.0f;
+			info.midPolyV = (imins[1] + imaxs[1]) * 16 / 2.0f;
+
+			hasLightmap[i] = 1;
+		}
+	}, 256);
+
+	// lightmaps are packed all at once, so that they can be sorted by size
+	std::vector<LightmapRect> rects;
+	std::vector<int> rectFaces;
+	std::vector<int> rectStyles;
+
+	for (unsigned int i = 0; i < map->faceCount; i++) {
+		if (!hasLightmap[i])
+			continue;
+
+		BSPFACE& face = map->faces[i];
+		LightmapInfo& info = lightmaps[i];
 
 		for (int s = 0; s < MAXLIGHTMAPS; s++) {
 			if (face.nStyles[s] == 255)
 				continue;
 
-			// TODO: Try fitting in earlier atlases before using the latest one
-			if (!atlases[atlasId]->insert(info.w, info.h, info.x[s], info.y[s])) {
-				atlases.push_back(new LightmapNode(0, 0, LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-				atlasTextures.push_back(new Texture(LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-				atlasId++;
-				memset(atlasTextures[atlasId]->data, 0, LIGHTMAP_ATLAS_SIZE * LIGHTMAP_ATLAS_SIZE * sizeof(COLOR3));
+			LightmapRect rect;
+			rect.w = info.w;
+			rect.h = info.h;
+			rects.push_back(rect);
+			rectFaces.push_back(i);
+			rectStyles.push_back(s);
+		}
+	}
 
-				if (!atlases[atlasId]->insert(info.w, info.h, info.x[s], info.y[s])) {
-					logf("Lightmap too big for atlas size!\n");
-					continue;
-				}
-			}
+	float fillRatio = 0;
+	int atlasCount = std::max(1, packLightmaps(rects, lightmapAtlasSize, &fillRatio));
 
-			lightmapCount++;
+	std::vector<Texture*> atlasTextures;
+	for (int i = 0; i < atlasCount; i++) {
+		atlasTextures.push_back(new Texture(lightmapAtlasSize, lightmapAtlasSize));
+		memset(atlasTextures[i]->data, 0, lightmapAtlasSize * lightmapAtlasSize * sizeof(COLOR3));
+	}
 
-			info.atlasId[s] = atlasId;
+	int lightmapCount = 0;
+	for (int i = 0; i < (int)rects.size(); i++) {
+		LightmapRect& rect = rects[i];
+		if (rect.atlasId == -1) {
+			logf("Lightmap too big for atlas size!\n");
+			continue;
+		}
+
+		lightmapCount++;
+
+		LightmapInfo& info = lightmaps[rectFaces[i]];
+		int s = rectStyles[i];
+		info.atlasId[s] = rect.atlasId;
+		info.x[s] = rect.x;
+		info.y[s] = rect.y;
+	}
 
-			// copy lightmap data into atlas
-			int lightmapSz = info.w * info.h * sizeof(COLOR3);
-			int offset = face.nLightmapOffset + s * lightmapSz;
+	// copy lightmap data into the atlases. Packed lightmaps never overlap, so threads can't write
+	// to the same pixels.
+	parallelFor((int)rects.size(), [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			LightmapRect& rect = rects[i];
+			if (rect.atlasId == -1)
+				continue;
+
+			BSPFACE& face = map->faces[rectFaces[i]];
+			int s = rectStyles[i];
+
+			int rowSz = rect.w * sizeof(COLOR3);
+			int offset = face.nLightmapOffset + s * rowSz * rect.h;
 			COLOR3* lightSrc = (COLOR3*)(map->lightdata + offset);
-			COLOR3* lightDst = (COLOR3*)(atlasTextures[atlasId]->data);
-			for (int y = 0; y < info.h; y++) {
-				for (int x = 0; x < info.w; x++) {
-					int src = y * info.w + x;
-					int dst = (info.y[s] + y) * LIGHTMAP_ATLAS_SIZE + info.x[s] + x;
+			COLOR3* lightDst = (COLOR3*)(atlasTextures[rect.atlasId]->data);
+
+			for (int y = 0; y < rect.h; y++) {
+				COLOR3* dstRow = lightDst + (rect.y + y) * lightmapAtlasSize + rect.x;
+
+				if (offset + (y + 1) * rowSz <= (int)map->lightDataLength) {
+					memcpy(dstRow, lightSrc + y * rect.w, rowSz);
+					continue;
+				}
+
+				// lightmap runs past the end of the lighting lump
+				for (int x = 0; x < rect.w; x++) {
+					int src = y * rect.w + x;
 					if (offset + src * sizeof(COLOR3) < map->lightDataLength) {
-						lightDst[dst] = lightSrc[src];
+						dstRow[x] = lightSrc[src];
 					}
 					else {
 						bool checkers = x % 2 == 0 != y % 2 == 0;
-						lightDst[dst] = { (unsigned char)(checkers ? 255 : 0), 0, (unsigned char)(checkers ? 255 : 0) };
+						dstRow[x] = { (unsigned char)(checkers ? 255 : 0), 0, (unsigned char)(checkers ? 255 : 0) };
 					}
 				}
 			}
 		}
-	}
+	}, 256);
 
 	glLightmapTextures = new Texture * [atlasTextures.size()];
 	for (int i = 0; i < atlasTextures.size(); i++) {
-		delete atlases[i];
 		glLightmapTextures[i] = atlasTextures[i];
 	}
 
 	numLightmapAtlases = atlasTextures.size();
 
-	//lodepng_encode24_file("atlas.png", atlasTextures[0]->data, LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE);
-	debugf("Fit %d lightmaps into %d atlases\n", lightmapCount, atlasId + 1);
+	//lodepng_encode24_file("atlas.png", atlasTextures[0]->data, lightmapAtlasSize, lightmapAtlasSize);
+	debugf("Fit %d lightmaps into %d atlases (%.1f%% full)\n", lightmapCount, atlasCount, fillRatio * 100.0f);
 }
 
 void BspRenderer::updateLightmapInfos() {
@@ -543,8 +592,8 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 		float lw = 0;
 		float lh = 0;
 		if (lightmapsGenerated) {
-			lw = (float)lmap->w / (float)LIGHTMAP_ATLAS_SIZE;
-			lh = (float)lmap->h / (float)LIGHTMAP_ATLAS_SIZE;
+			lw = (float)lmap->w / (float)lightmapAtlasSize;
+			lh = (float)lmap->h / (float)lightmapAtlasSize;
 		}
 
 		bool isSpecial = texinfo.nFlags & TEX_SPECIAL;
@@ -590,7 +639,7 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 				float uu = (fLightMapU / (float)lmap->w) * lw;
 				float vv = (fLightMapV / (float)lmap->h) * lh;
 
-				float pixelStep = 1.0f / (float)LIGHTMAP_ATLAS_SIZE;
+				float pixelStep = 1.0f / (float)lightmapAtlasSize;
 
 				for (int s = 0; s < MAXLIGHTMAPS; s++) {
 					verts[e].luv[s][0] = uu + lmap->x[s] * pixelStep;
@@ -729,6 +778,13 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 	if (refreshClipnodes && modelIdx >= 0)
 		generateClipnodeBuffer(modelIdx);
 
+	// the model bounds may have changed
+	for (unsigned int i = 1; i < numRenderEnts; i++) {
+		if (renderEnts[i].modelIdx == modelIdx) {
+			updateEntBounds(i);
+		}
+	}
+
 	return renderModel->groupCount;
 }
 
@@ -948,6 +1004,8 @@ void BspRenderer::preRenderEnts() {
 		delete pointEnts;
 	}
 	renderEnts = new RenderEnt[map->ents.size()];
+	numRenderEnts = (unsigned int)map->ents.size();
+	entTree.clear();
 
 	numPointEnts = 0;
 	for (int i = 1; i < map->ents.size(); i++) {
@@ -958,6 +1016,7 @@ void BspRenderer::preRenderEnts() {
 	int pointEntIdx = 0;
 
 	for (int i = 0; i < map->ents.size(); i++) {
+		renderEnts[i].treeProxy = -1;
 		refreshEnt(i);
 
 		if (i != 0 && !map->ents[i]->isBspModel()) {
@@ -1045,7 +1104,7 @@ void BspRenderer::refreshEnt(int entIdx) {
 				renderEnts[entIdx].modelMat.rotateY(0);
 				renderEnts[entIdx].modelMat.rotateX((angles.z * (PI / 180.0f)));
 			}
-			else if (IsEntNotSupportAngles(ent->keyvalues["classname"]))
+			else if (ent->getClassnameRules() & CNAME_NO_ANGLES)
 			{
 				// based at cs 1.6 gamedll
 			}
@@ -1081,6 +1140,47 @@ void BspRenderer::refreshEnt(int entIdx) {
 		renderEnts[entIdx].angles = angles;
 	}
 
+	updateEntBounds(entIdx);
+}
+
+void BspRenderer::updateEntBounds(int entIdx) {
+	if (entIdx <= 0 || (unsigned int)entIdx >= numRenderEnts)
+		return; // worldspawn is always tested when picking
+
+	RenderEnt& rent = renderEnts[entIdx];
+	vec3 mins, maxs;
+
+	if (rent.modelIdx >= 0 && (unsigned int)rent.modelIdx < map->modelCount) {
+		// model bounds only cover the visible hull. Pad for the largest clipnode hull.
+		BSPMODEL& model = map->models[rent.modelIdx];
+		vec3 hullPadding = vec3(32, 32, 36);
+		mins = rent.offset + model.nMins - hullPadding;
+		maxs = rent.offset + model.nMaxs + hullPadding;
+	}
+	else {
+		mins = rent.offset + rent.pointEntCube->mins;
+		maxs = rent.offset + rent.pointEntCube->maxs;
+	}
+
+	if (rent.treeProxy == -1) {
+		rent.treeProxy = entTree.insert(mins, maxs, entIdx);
+	}
+	else {
+		entTree.update(rent.treeProxy, mins, maxs);
+	}
+}
+
+void BspRenderer::getEntsInBox(const vec3& mins, const vec3& maxs, std::vector<int>& entIdxs) {
+	entTree.boxQuery(mins - mapOffset, maxs - mapOffset, [&](int entIdx) {
+		entIdxs.push_back(entIdx);
+		return true;
+	});
+}
+
+int BspRenderer::getNearestEnt(const vec3& pos, float maxDist) {
+	return entTree.nearestQuery(pos - mapOffset, maxDist, [](int entIdx) {
+		return true;
+	});
 }
 
 void BspRenderer::calcFaceMaths() {
@@ -1640,7 +1740,12 @@ bool BspRenderer::pickPoly(vec3 start, const vec3 & dir, int hullIdx, PickInfo&
 		foundBetterPick = true;
 	}
 
-	for (size_t i = 0, sz = map->ents.size(); i < sz; i++) {
+	// only visit entities whose bounds are closer than the best hit so far
+	entTree.rayQuery(start, dir, pickInfo.bestDist, [&](int i) {
+		if (i >= map->ents.size()) {
+			return;
+		}
+
 		if (renderEnts[i].modelIdx >= 0 && (unsigned int)renderEnts[i].modelIdx < map->modelCount) {
 
 			bool isSpecial = false;
@@ -1652,25 +1757,25 @@ bool BspRenderer::pickPoly(vec3 start, const vec3 & dir, int hullIdx, PickInfo&
 			}
 
 			if (isSpecial && !(g_render_flags & RENDER_SPECIAL_ENTS)) {
-				continue;
+				return;
 			}
 			else if (!isSpecial && !(g_render_flags & RENDER_ENTS)) {
-				continue;
+				return;
 			}
 
 			if (pickModelPoly(start, dir, renderEnts[i].offset, renderEnts[i].modelIdx, hullIdx, pickInfo)) {
-				pickInfo.entIdx = (int)i;
+				pickInfo.entIdx = i;
 				pickInfo.modelIdx = renderEnts[i].modelIdx;
 				pickInfo.map = map;
 				pickInfo.ent = map->ents[i];
 				foundBetterPick = true;
 			}
 		}
-		else if (i > 0 && g_render_flags & RENDER_POINT_ENTS) {
+		else if (g_render_flags & RENDER_POINT_ENTS) {
 			vec3 mins = renderEnts[i].offset + renderEnts[i].pointEntCube->mins;
 			vec3 maxs = renderEnts[i].offset + renderEnts[i].pointEntCube->maxs;
 			if (pickAABB(start, dir, mins, maxs, pickInfo.bestDist)) {
-				pickInfo.entIdx = (int)i;
+				pickInfo.entIdx = i;
 				pickInfo.modelIdx = -1;
 				pickInfo.faceIdx = -1;
 				pickInfo.map = map;
@@ -1678,7 +1783,7 @@ bool BspRenderer::pickPoly(vec3 start, const vec3 & dir, int hullIdx, PickInfo&
 				foundBetterPick = true;
 			};
 		}
-	}
+	});
 
 	return foundBetterPick;
 }
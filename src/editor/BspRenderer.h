@@ -2,14 +2,17 @@
 #include "Bsp.h"
 #include "Texture.h"
 #include "ShaderProgram.h"
-#include "LightmapNode.h"
+#include "LightmapAtlas.h"
 #include "VertexBuffer.h"
 #include "primitives.h"
 #include "PointEntRenderer.h"
+#include "AabbTree.h"
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
-#define LIGHTMAP_ATLAS_SIZE 512
+#define LIGHTMAP_ATLAS_SIZE 512 // default width and height of lightmap atlases
+#define LIGHTMAP_ATLAS_MIN_SIZE 256
+#define LIGHTMAP_ATLAS_MAX_SIZE 4096
 
 enum RenderFlags {
 	RENDER_TEXTURES = 1,
@@ -51,6 +54,7 @@ struct RenderEnt {
 	vec3 angles; // support angles
 	int modelIdx; // -1 = point entity
 	EntCube* pointEntCube;
+	int treeProxy; // leaf in the entity AABB tree, -1 = not in the tree
 };
 
 struct RenderGroup {
@@ -123,6 +127,10 @@ public:
 	bool pickModelPoly(vec3 start, const vec3& dir, vec3 offset, int modelIdx, int hullIdx, PickInfo& pickInfo);
 	bool pickFaceMath(const vec3& start, const vec3& dir, FaceMath& faceMath, float& bestDist);
 
+	// spatial queries on entity bounds (excluding worldspawn), using world coordinates
+	void getEntsInBox(const vec3& mins, const vec3& maxs, std::vector<int>& entIdxs);
+	int getNearestEnt(const vec3& pos, float maxDist = FLT_MAX_COORD);
+
 	void refreshEnt(int entIdx);
 	int refreshModel(int modelIdx, bool refreshClipnodes = true);
 	bool refreshModelClipnodes(int modelIdx);
@@ -162,6 +170,8 @@ private:
 
 	LightmapInfo* lightmaps = NULL;
 	RenderEnt* renderEnts = NULL;
+	unsigned int numRenderEnts = 0;
+	AabbTree entTree; // point ent cubes and brush model bounds, for picking
 	RenderModel* renderModels = NULL;
 	RenderClipnodes* renderClipnodes = NULL;
 	FaceMath* faceMaths = NULL;
@@ -171,6 +181,7 @@ private:
 	Texture** glTexturesSwap;
 
 	size_t numLightmapAtlases;
+	int lightmapAtlasSize = LIGHTMAP_ATLAS_SIZE;
 
 	unsigned int numRenderModels;
 	unsigned int numRenderClipnodes;
@@ -213,4 +224,5 @@ private:
 	void deleteFaceMaths();
 	void delayLoadData();
 	int getBestClipnodeHull(int modelIdx);
+	void updateEntBounds(int entIdx);
 };
\ No newline at end of file
@@ -552,6 +552,29 @@ void OptimizeMapCommand::execute() {
 	bool oldVerbose = g_verbose;
 	g_verbose = true;
 	map->delete_unused_hulls(true).print_delete_stats(1);
+
+	STRUCTCOUNT welded = map->weld_vertices(0.01f);
+	if (!welded.allZero()) {
+		logf("    Welded duplicate vertices and edges:\n");
+		welded.print_delete_stats(2);
+	}
+
+	unsigned int visSaved = map->deduplicate_visdata();
+	if (visSaved) {
+		logf("    Shared duplicate VIS rows (%u bytes saved)\n", visSaved);
+	}
+
+	unsigned int styleSaved = 0;
+	int prunedLayers = map->prune_light_styles(&styleSaved);
+	if (prunedLayers) {
+		logf("    Deleted %d unused light style layers (%u bytes saved)\n", prunedLayers, styleSaved);
+	}
+
+	int sharedLightmaps = 0;
+	unsigned int lightSaved = map->deduplicate_lightmaps(&sharedLightmaps);
+	if (lightSaved) {
+		logf("    Shared %d duplicate lightmaps (%u bytes saved)\n", sharedLightmaps, lightSaved);
+	}
 	g_verbose = oldVerbose;
 
 	refresh();
@@ -583,4 +606,70 @@ size_t OptimizeMapCommand::memoryUsage() {
 	}
 
 	return size;
-}
\ No newline at end of file
+}
+
+
+
+//
+// Strip default keyvalues
+//
+StripDefaultKeyvaluesCommand::StripDefaultKeyvaluesCommand(std::string desc, int mapIdx) : Command(desc, mapIdx) {
+	Bsp* map = getBsp();
+
+	for (int i = 0; i < map->ents.size(); i++) {
+		Entity* copy = new Entity();
+		*copy = *map->ents[i];
+		oldEnts.push_back(copy);
+	}
+
+	this->allowedDuringLoad = false;
+}
+
+StripDefaultKeyvaluesCommand::~StripDefaultKeyvaluesCommand() {
+	for (int i = 0; i < oldEnts.size(); i++) {
+		delete oldEnts[i];
+	}
+}
+
+void StripDefaultKeyvaluesCommand::execute() {
+	Bsp* map = getBsp();
+
+	logf("Stripping default keyvalues from %s\n", map->name.c_str());
+	unsigned int saved = map->strip_default_keyvalues(g_app->fgd);
+	logf("    Entity data reduced by %u bytes\n", saved);
+
+	refresh();
+}
+
+void StripDefaultKeyvaluesCommand::undo() {
+	Bsp* map = getBsp();
+
+	// the strip pass never adds or removes entities
+	for (int i = 0; i < oldEnts.size() && i < map->ents.size(); i++) {
+		*map->ents[i] = *oldEnts[i];
+	}
+	map->update_ent_lump();
+
+	refresh();
+}
+
+void StripDefaultKeyvaluesCommand::refresh() {
+	BspRenderer* renderer = getBspRenderer();
+
+	renderer->preRenderEnts();
+	if (g_app->pickInfo.ent) {
+		g_app->updateEntityState(g_app->pickInfo.ent);
+	}
+	g_app->pickCount++; // force GUI update
+	g_app->gui->refresh();
+}
+
+size_t StripDefaultKeyvaluesCommand::memoryUsage() {
+	size_t size = sizeof(StripDefaultKeyvaluesCommand);
+
+	for (int i = 0; i < oldEnts.size(); i++) {
+		size += oldEnts[i]->getMemoryUsage();
+	}
+
+	return size;
+}
@@ -152,3 +152,17 @@ public:
 	void refresh();
 	size_t memoryUsage() override;
 };
+
+
+class StripDefaultKeyvaluesCommand : public Command {
+public:
+	std::vector<Entity*> oldEnts;
+
+	StripDefaultKeyvaluesCommand(std::string desc, int mapIdx);
+	~StripDefaultKeyvaluesCommand();
+
+	void execute() override;
+	void undo() override;
+	void refresh();
+	size_t memoryUsage() override;
+};
\ No newline at end of file
@@ -0,0 +1,297 @@
+#include "EntSearchIndex.h"
+#include "Bsp.h"
+#include "util.h"
+#include <algorithm>
+
+static inline unsigned int makeTrigram(const char* s) {
+	return ((unsigned char)s[0] << 16) | ((unsigned char)s[1] << 8) | (unsigned char)s[2];
+}
+
+static void getTrigrams(const std::string& str, std::vector<unsigned int>& trigrams) {
+	for (size_t i = 0; i + 3 <= str.size(); i++) {
+		trigrams.push_back(makeTrigram(str.c_str() + i));
+	}
+}
+
+static void addPosting(std::vector<int>& list, int entIdx) {
+	// ents are indexed in order during a rebuild, so this is usually an append
+	if (list.empty() || list.back() < entIdx) {
+		list.push_back(entIdx);
+		return;
+	}
+	auto it = std::lower_bound(list.begin(), list.end(), entIdx);
+	if (it == list.end() || *it != entIdx) {
+		list.insert(it, entIdx);
+	}
+}
+
+static void removePosting(std::vector<int>& list, int entIdx) {
+	auto it = std::lower_bound(list.begin(), list.end(), entIdx);
+	if (it != list.end() && *it == entIdx) {
+		list.erase(it);
+	}
+}
+
+static void loadIndexedEnt(IndexedEnt& ient, Entity* ent) {
+	ient.ent = ent;
+	ient.revision = ent->revision;
+	ient.keys.clear();
+	ient.values.clear();
+	ient.classname = ent->hasKey("classname") ? ent->keyvalues["classname"] : "";
+	for (size_t i = 0; i < ent->keyOrder.size(); i++) {
+		ient.keys.push_back(ent->keyOrder[i]);
+		ient.values.push_back(ent->keyvalues[ent->keyOrder[i]]);
+	}
+}
+
+static void lowercaseIndexedEnt(IndexedEnt& ient) {
+	ient.classname = toLowerCase(ient.classname);
+	for (size_t i = 0; i < ient.keys.size(); i++) {
+		ient.keys[i] = toLowerCase(ient.keys[i]);
+		ient.values[i] = toLowerCase(ient.values[i]);
+	}
+}
+
+// adds or removes the postings for one entity
+static void updatePostings(EntSearchData& data, int entIdx, bool add) {
+	const IndexedEnt& ient = data.ents[entIdx];
+	auto apply = [&](std::vector<int>& list) {
+		if (add)
+			addPosting(list, entIdx);
+		else
+			removePosting(list, entIdx);
+	};
+
+	apply(data.classnames[ient.classname]);
+
+	std::vector<unsigned int> keyTrigrams;
+	std::vector<unsigned int> valueTrigrams;
+	for (size_t i = 0; i < ient.keys.size(); i++) {
+		apply(data.exactKeys[ient.keys[i]]);
+		getTrigrams(ient.keys[i], keyTrigrams);
+		if (!ient.values[i].empty()) {
+			apply(data.exactValues[ient.values[i]]);
+			getTrigrams(ient.values[i], valueTrigrams);
+		}
+	}
+
+	std::sort(keyTrigrams.begin(), keyTrigrams.end());
+	keyTrigrams.erase(std::unique(keyTrigrams.begin(), keyTrigrams.end()), keyTrigrams.end());
+	std::sort(valueTrigrams.begin(), valueTrigrams.end());
+	valueTrigrams.erase(std::unique(valueTrigrams.begin(), valueTrigrams.end()), valueTrigrams.end());
+
+	for (size_t i = 0; i < keyTrigrams.size(); i++) {
+		apply(data.keyTrigrams[keyTrigrams[i]]);
+	}
+	for (size_t i = 0; i < valueTrigrams.size(); i++) {
+		apply(data.valueTrigrams[valueTrigrams[i]]);
+	}
+}
+
+static EntSearchData* buildSearchData(std::vector<IndexedEnt>* snapshot) {
+	EntSearchData* data = new EntSearchData();
+	data->ents = std::move(*snapshot);
+	delete snapshot;
+
+	for (size_t i = 0; i < data->ents.size(); i++) {
+		lowercaseIndexedEnt(data->ents[i]);
+		updatePostings(*data, (int)i, true);
+	}
+
+	return data;
+}
+
+void EntSearchIndex::startRebuild() {
+	// copy the keyvalues now so the build thread doesn't touch entities that are being edited
+	std::vector<IndexedEnt>* snapshot = new std::vector<IndexedEnt>(map->ents.size());
+	for (size_t i = 0; i < map->ents.size(); i++) {
+		loadIndexedEnt((*snapshot)[i], map->ents[i]);
+	}
+
+	buildFuture = std::async(std::launch::async, buildSearchData, snapshot);
+	building = true;
+}
+
+void EntSearchIndex::reindexEnt(int entIdx, Entity* ent) {
+	updatePostings(data, entIdx, false);
+	loadIndexedEnt(data.ents[entIdx], ent);
+	lowercaseIndexedEnt(data.ents[entIdx]);
+	updatePostings(data, entIdx, true);
+}
+
+bool EntSearchIndex::isReady() {
+	return !building;
+}
+
+bool EntSearchIndex::sync(Bsp* newMap) {
+	if (newMap != map) {
+		map = newMap;
+		if (building) {
+			delete buildFuture.get();
+			building = false;
+		}
+		data = EntSearchData();
+		if (!map) {
+			return true;
+		}
+		startRebuild();
+		return false;
+	}
+
+	if (!map) {
+		return false;
+	}
+
+	bool changed = false;
+
+	if (building) {
+		if (buildFuture.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) {
+			return false;
+		}
+		EntSearchData* newData = buildFuture.get();
+		data = std::move(*newData);
+		delete newData;
+		building = false;
+		changed = true;
+	}
+
+	if (data.ents.size() != map->ents.size()) {
+		// ents were added or removed. Indexes shifted so start over.
+		startRebuild();
+		return changed;
+	}
+
+	for (size_t i = 0; i < map->ents.size(); i++) {
+		Entity* ent = map->ents[i];
+		if (data.ents[i].ent != ent || data.ents[i].revision != ent->revision) {
+			reindexEnt((int)i, ent);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+// narrows candidates to the entities in the posting list. NULL list = no matches.
+static void intersectPostings(std::vector<int>& candidates, bool& unfiltered, const std::vector<int>* list) {
+	if (!list) {
+		candidates.clear();
+		unfiltered = false;
+		return;
+	}
+	if (unfiltered) {
+		candidates = *list;
+		unfiltered = false;
+		return;
+	}
+	std::vector<int> result;
+	std::set_intersection(candidates.begin(), candidates.end(), list->begin(), list->end(), std::back_inserter(result));
+	candidates = std::move(result);
+}
+
+static const std::vector<int>* findTerm(const TermIndex& index, const std::string& term) {
+	auto it = index.find(term);
+	return it != index.end() ? &it->second : NULL;
+}
+
+static void intersectTrigrams(std::vector<int>& candidates, bool& unfiltered, const TrigramIndex& index, const std::string& term) {
+	std::vector<unsigned int> trigrams;
+	getTrigrams(term, trigrams);
+
+	// start with the rarest trigram so the intersections stay small
+	std::vector<const std::vector<int>*> lists;
+	for (size_t i = 0; i < trigrams.size(); i++) {
+		auto it = index.find(trigrams[i]);
+		if (it == index.end()) {
+			intersectPostings(candidates, unfiltered, NULL);
+			return;
+		}
+		lists.push_back(&it->second);
+	}
+	std::sort(lists.begin(), lists.end(), [](const std::vector<int>* a, const std::vector<int>* b) {
+		return a->size() < b->size();
+	});
+	for (size_t i = 0; i < lists.size() && (unfiltered || !candidates.empty()); i++) {
+		intersectPostings(candidates, unfiltered, lists[i]);
+	}
+}
+
+static inline bool termMatches(const std::string& str, const std::string& term, bool partial) {
+	return partial ? str.find(term) != std::string::npos : str == term;
+}
+
+void EntSearchIndex::search(const std::string& classname, const std::string& key, const std::string& value,
+	bool partial, std::vector<int>& entIdxs) {
+	entIdxs.clear();
+	if (building) {
+		return;
+	}
+
+	std::string searchClass = toLowerCase(classname);
+	std::string searchKey = trimSpaces(toLowerCase(key));
+	std::string searchValue = trimSpaces(toLowerCase(value));
+
+	std::vector<int> candidates;
+	bool unfiltered = true;
+
+	if (!searchClass.empty()) {
+		intersectPostings(candidates, unfiltered, findTerm(data.classnames, searchClass));
+	}
+	if (!searchKey.empty()) {
+		if (partial)
+			intersectTrigrams(candidates, unfiltered, data.keyTrigrams, searchKey);
+		else
+			intersectPostings(candidates, unfiltered, findTerm(data.exactKeys, searchKey));
+	}
+	if (!searchValue.empty()) {
+		if (partial)
+			intersectTrigrams(candidates, unfiltered, data.valueTrigrams, searchValue);
+		else
+			intersectPostings(candidates, unfiltered, findTerm(data.exactValues, searchValue));
+	}
+
+	if (unfiltered) {
+		// no filters, or only terms shorter than a trigram
+		for (int i = 0; i < (int)data.ents.size(); i++) {
+			candidates.push_back(i);
+		}
+	}
+
+	// the posting lists are per entity, so check that the terms match the same keyvalue
+	for (size_t c = 0; c < candidates.size(); c++) {
+		int entIdx = candidates[c];
+		if (entIdx == 0) {
+			continue; // skip worldspawn
+		}
+		const IndexedEnt& ient = data.ents[entIdx];
+
+		if (!searchClass.empty() && ient.classname != searchClass) {
+			continue;
+		}
+
+		bool visible = true;
+		if (!searchKey.empty()) {
+			// the value must match the first key that matches
+			visible = false;
+			for (size_t i = 0; i < ient.keys.size(); i++) {
+				if (termMatches(ient.keys[i], searchKey, partial)) {
+					visible = searchValue.empty() || termMatches(ient.values[i], searchValue, partial);
+					break;
+				}
+			}
+		}
+		else if (!searchValue.empty()) {
+			visible = false;
+			for (size_t i = 0; i < ient.values.size(); i++) {
+				if (termMatches(ient.values[i], searchValue, partial)) {
+					visible = true;
+					break;
+				}
+			}
+		}
+
+		if (visible) {
+			entIdxs.push_back(entIdx);
+		}
+	}
+}
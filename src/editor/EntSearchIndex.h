@@ -0,0 +1,54 @@
+#pragma once
+#include "Entity.h"
+#include <future>
+#include <unordered_map>
+
+class Bsp;
+
+struct IndexedEnt {
+	Entity* ent; // only compared, never dereferenced after indexing
+	unsigned int revision;
+	std::string classname; // lowercase
+	std::vector<std::string> keys; // lowercase, in key order
+	std::vector<std::string> values; // lowercase, same order as keys
+};
+
+typedef std::unordered_map<std::string, std::vector<int>> TermIndex;
+typedef std::unordered_map<unsigned int, std::vector<int>> TrigramIndex;
+
+struct EntSearchData {
+	std::vector<IndexedEnt> ents; // same order as map->ents
+	TermIndex classnames;
+	TermIndex exactKeys;
+	TermIndex exactValues;
+	TrigramIndex keyTrigrams;
+	TrigramIndex valueTrigrams;
+};
+
+// Lowercase inverted index over entity classnames, keys, and values, for the entity report.
+// Posting lists are sorted entity indexes. Substring searches intersect the trigram lists of
+// the search term, then verify the few remaining candidates.
+class EntSearchIndex
+{
+public:
+	// Detects entity edits and updates the index. A full rebuild is started in a background thread
+	// when entities are added or removed. Returns true if the indexed data changed.
+	bool sync(Bsp* map);
+
+	// false while the index is being rebuilt
+	bool isReady();
+
+	// fills entIdxs with entities (excluding worldspawn) that match all non-empty filters.
+	// filters are case-insensitive. partial = substring matching, otherwise exact matching.
+	void search(const std::string& classname, const std::string& key, const std::string& value,
+		bool partial, std::vector<int>& entIdxs);
+
+private:
+	Bsp* map = NULL;
+	EntSearchData data;
+	std::future<EntSearchData*> buildFuture;
+	bool building = false;
+
+	void startRebuild();
+	void reindexEnt(int entIdx, Entity* ent);
+};
@@ -26,10 +26,11 @@ Fgd::~Fgd() {
 }
 
 FgdClass* Fgd::getFgdClass(const std::string& cname) {
-	if (classMap.find(cname) == classMap.end()) {
+	auto it = classMap.find(cname);
+	if (it == classMap.end()) {
 		return NULL;
 	}
-	return classMap[cname];
+	return it->second;
 }
 
 void Fgd::merge(Fgd* other) {
@@ -1078,6 +1078,17 @@ void Gui::drawMenuBar() {
 			app->pushUndoCommand(command);
 		}
 
+		if (ImGui::MenuItem("Strip Default Keyvalues", 0, false, !app->isLoading && map && app->fgd)) {
+			StripDefaultKeyvaluesCommand* command = new StripDefaultKeyvaluesCommand("Strip default keyvalues " + map->name, app->getSelectedMapId());
+			command->execute();
+			app->pushUndoCommand(command);
+		}
+		if (ImGui::IsItemHovered() && g.HoveredIdTimer > g_tooltip_delay) {
+			ImGui::BeginTooltip();
+			ImGui::TextUnformatted("Delete keyvalues that are empty or equal to a zero/empty FGD default.\n\nclassname, origin, model, and targetname are never deleted.");
+			ImGui::EndTooltip();
+		}
+
 		ImGui::Separator();
 
 		bool hasAnyCollision = anyHullValid[1] || anyHullValid[2] || anyHullValid[3];
@@ -2124,7 +2135,7 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 			if (strcmp(keyNames[i], "angles") == 0)
 			{
 				ImGui::SetNextItemWidth(inputWidth);
-				if (IsEntNotSupportAngles(ent->keyvalues["classname"]))
+				if (ent->getClassnameRules() & CNAME_NO_ANGLES)
 				{
 					ImGui::TextUnformatted("ANGLES NOT SUPPORTED");
 				}
@@ -2763,6 +2774,20 @@ void Gui::drawSettings() {
 				shouldReloadFonts = true;
 			}
 			ImGui::DragInt("Undo Levels", &app->undoLevels, 0.05f, 0, 64);
+			static const char* atlasSizeNames[] = { "256", "512", "1024", "2048", "4096" };
+			int atlasSizeIdx = 0;
+			while (atlasSizeIdx < IM_ARRAYSIZE(atlasSizeNames) - 1 && (LIGHTMAP_ATLAS_MIN_SIZE << atlasSizeIdx) < g_settings.lightmapAtlasSize) {
+				atlasSizeIdx++;
+			}
+			if (ImGui::Combo("Lightmap Atlas Size", &atlasSizeIdx, atlasSizeNames, IM_ARRAYSIZE(atlasSizeNames))) {
+				g_settings.lightmapAtlasSize = LIGHTMAP_ATLAS_MIN_SIZE << atlasSizeIdx;
+			}
+			if (ImGui::IsItemHovered() && g.HoveredIdTimer > g_tooltip_delay) {
+				ImGui::BeginTooltip();
+				ImGui::TextUnformatted("Width and height of the textures that lightmaps are packed into.\n"
+					"Bigger atlases mean fewer texture switches while rendering.\nApplies to maps loaded after changing this.");
+				ImGui::EndTooltip();
+			}
 			ImGui::Checkbox("Verbose Logging", &g_verbose);
 			ImGui::Checkbox("Make map backup", &g_settings.backUpMap);
 			if (ImGui::IsItemHovered() && g.HoveredIdTimer > g_tooltip_delay) {
@@ -3460,7 +3485,7 @@ void Gui::drawEntityReport() {
 		else {
 			ImGui::BeginGroup();
 			static int lastmapidx = -1;
-			const int MAX_FILTERS = 1;
+			const int MAX_FILTERS = 1; // the search index supports one keyvalue filter
 			static char keyFilter[MAX_FILTERS][MAX_KEY_LEN];
 			static char valueFilter[MAX_FILTERS][MAX_VAL_LEN];
 			static int lastSelect = -1;
@@ -3474,78 +3499,32 @@ void Gui::drawEntityReport() {
 			float footerHeight = ImGui::GetFrameHeightWithSpacing() * 5.f + 16.f;
 			ImGui::BeginChild("entlist", ImVec2(0.f, -footerHeight));
 
-			filterNeeded = app->getSelectedMapId() != lastmapidx;
+			if (app->getSelectedMapId() != lastmapidx) {
+				filterNeeded = true;
+			}
 			lastmapidx = app->getSelectedMapId();
 
-			if (filterNeeded) {
-				visibleEnts.clear();
-				for (int i = 1; i < map->ents.size(); i++) {
-					Entity* ent = map->ents[i];
-					std::string cname = ent->keyvalues["classname"];
-
-					bool visible = true;
-
-					if (!classFilter.empty() && classFilter != "(none)") {
-						if (toLowerCase(cname) != toLowerCase(classFilter)) {
-							visible = false;
-						}
-					}
-
-					for (int k = 0; k < MAX_FILTERS; k++) {
-						if (keyFilter[k][0] != '\0') {
-							std::string searchKey = trimSpaces(toLowerCase(keyFilter[k]));
-
-							bool foundKey = false;
-							std::string actualKey;
-							for (int c = 0; c < ent->keyOrder.size(); c++) {
-								std::string key = toLowerCase(ent->keyOrder[c]);
-								if (key == searchKey || (partialMatches && key.find(searchKey) != std::string::npos)) {
-									foundKey = true;
-									actualKey = std::move(key);
-									break;
-								}
-							}
-							if (!foundKey) {
-								visible = false;
-								break;
-							}
+			if (entSearchIndex.sync(map)) {
+				filterNeeded = true;
+			}
 
-							std::string searchValue = trimSpaces(toLowerCase(valueFilter[k]));
-							if (!searchValue.empty()) {
-								if ((partialMatches && ent->keyvalues[actualKey].find(searchValue) == std::string::npos) ||
-									(!partialMatches && ent->keyvalues[actualKey] != searchValue)) {
-									visible = false;
-									break;
-								}
-							}
-						}
-						else if (valueFilter[k][0] != '\0') {
-							std::string searchValue = trimSpaces(toLowerCase(valueFilter[k]));
-							bool foundMatch = false;
-							for (int c = 0; c < ent->keyOrder.size(); c++) {
-								std::string val = toLowerCase(ent->keyvalues[ent->keyOrder[c]]);
-								if (val == searchValue || (partialMatches && val.find(searchValue) != std::string::npos)) {
-									foundMatch = true;
-									break;
-								}
-							}
-							if (!foundMatch) {
-								visible = false;
-								break;
-							}
-						}
-					}
-					if (visible) {
-						visibleEnts.push_back(i);
-					}
+			if (filterNeeded && entSearchIndex.isReady()) {
+				// keep the selection if the same ents are still visible
+				std::set<int> selectedEnts;
+				for (int k = 0; k < selectedItems.size() && k < visibleEnts.size(); k++) {
+					if (selectedItems[k])
+						selectedEnts.insert(visibleEnts[k]);
 				}
 
+				std::string searchClass = classFilter != "(none)" ? classFilter : "";
+				entSearchIndex.search(searchClass, keyFilter[0], valueFilter[0], partialMatches, visibleEnts);
+
 				selectedItems.clear();
 				selectedItems.resize(visibleEnts.size());
 				for (int k = 0; k < selectedItems.size(); k++)
-					selectedItems[k] = false;
+					selectedItems[k] = selectedEnts.count(visibleEnts[k]) != 0;
+				filterNeeded = false;
 			}
-			filterNeeded = false;
 
 			ImGuiListClipper clipper;
 			clipper.Begin((int)visibleEnts.size());
@@ -3619,6 +3598,8 @@ void Gui::drawEntityReport() {
 					app->deselectObject();
 					map->getBspRender()->preRenderEnts();
 					reloadLimits();
+					visibleEnts.clear();
+					selectedItems.clear();
 					filterNeeded = true;
 				}
 
@@ -4003,6 +3984,7 @@ void ImportOneBigLightmapFile(Bsp* map)
 				int x_width = size[0], y_height = size[1];
 				if (map->faces[faceIdx].nLightmapOffset < 0 || map->faces[faceIdx].nStyles[lightId] == 255)
 					continue;
+				map->unshare_lightmap(faceIdx);
 				int lightmapSz = size[0] * size[1] * sizeof(COLOR3);
 				int offset = map->faces[faceIdx].nLightmapOffset + lightId * lightmapSz;
 				if (y_height > max_y_found)
@@ -4145,6 +4127,9 @@ void ExportLightmaps(BSPFACE face, int faceIdx, Bsp* map)
 void ImportLightmaps(BSPFACE face, int faceIdx, Bsp* map)
 {
 	char fileNam[256];
+	if (map->unshare_lightmap(faceIdx)) {
+		face = map->faces[faceIdx];
+	}
 	int size[2];
 	GetFaceLightmapSize(map, faceIdx, size);
 	for (int i = 0; i < MAXLIGHTMAPS; i++) {
@@ -4337,6 +4322,7 @@ void Gui::drawLightMapTool() {
 			ImGui::Separator();
 			if (ImGui::Button("Save", ImVec2(120, 0)))
 			{
+				map->unshare_lightmap(faceIdx);
 				for (int i = 0; i < MAXLIGHTMAPS; i++) {
 					if (face.nStyles[i] == 255 || !currentlightMap[i])
 						continue;
@@ -8,6 +8,7 @@
 #include "bsptypes.h"
 #include "Texture.h"
 #include "qtools/rad.h"
+#include "EntSearchIndex.h"
 #include <GLFW/glfw3.h>
 
 struct ModelInfo {
@@ -76,6 +77,8 @@ private:
 	int settingsTab = 0;
 	bool openSavedTabs = false;
 
+	EntSearchIndex entSearchIndex; // for the entity report filters
+
 	ImFont* smallFont;
 	ImFont* largeFont;
 	ImFont* consoleFont;
@@ -0,0 +1,161 @@
+#include "LightmapAtlas.h"
+#include <cstdint>
+#include <algorithm>
+#include <climits>
+
+LightmapAtlas::LightmapAtlas(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	usedArea = 0;
+	minY = 0;
+
+	SkylineSegment start = { 0, 0, width };
+	skyline.push_back(start);
+}
+
+int LightmapAtlas::fitAt(int idx, int w, int h) const
+{
+	int x = skyline[idx].x;
+	if (x + w > width) {
+		return -1;
+	}
+
+	int y = skyline[idx].y;
+	int widthLeft = w;
+	for (int i = idx; widthLeft > 0; i++) {
+		y = std::max(y, skyline[i].y);
+		if (y + h > height) {
+			return -1;
+		}
+		widthLeft -= skyline[i].w;
+	}
+
+	return y;
+}
+
+void LightmapAtlas::addSegment(int idx, int x, int y, int w, int h)
+{
+	SkylineSegment seg = { x, y + h, w };
+	skyline.insert(skyline.begin() + idx, seg);
+
+	// remove the parts of the following segments that are now covered
+	for (int i = idx + 1; i < (int)skyline.size(); i++) {
+		SkylineSegment& prev = skyline[i - 1];
+		int shrink = prev.x + prev.w - skyline[i].x;
+		if (shrink <= 0) {
+			break;
+		}
+
+		skyline[i].x += shrink;
+		skyline[i].w -= shrink;
+		if (skyline[i].w > 0) {
+			break;
+		}
+		skyline.erase(skyline.begin() + i);
+		i--;
+	}
+
+	// merge segments at the same height
+	for (int i = 0; i + 1 < (int)skyline.size(); i++) {
+		if (skyline[i].y == skyline[i + 1].y) {
+			skyline[i].w += skyline[i + 1].w;
+			skyline.erase(skyline.begin() + i + 1);
+			i--;
+		}
+	}
+
+	minY = height;
+	for (int i = 0; i < (int)skyline.size(); i++) {
+		minY = std::min(minY, skyline[i].y);
+	}
+}
+
+bool LightmapAtlas::insert(int w, int h, int& outX, int& outY)
+{
+	if (h > getMaxFreeHeight()) {
+		return false;
+	}
+
+	int bestIdx = -1;
+	int bestTop = INT_MAX;
+	int bestWidth = INT_MAX;
+	int bestY = 0;
+
+	for (int i = 0; i < (int)skyline.size(); i++) {
+		int y = fitAt(i, w, h);
+		if (y < 0) {
+			continue;
+		}
+
+		// lowest top edge wins. Ties go to the narrowest segment, to leave wide gaps open.
+		if (y + h < bestTop || (y + h == bestTop && skyline[i].w < bestWidth)) {
+			bestIdx = i;
+			bestTop = y + h;
+			bestWidth = skyline[i].w;
+			bestY = y;
+		}
+	}
+
+	if (bestIdx == -1) {
+		return false;
+	}
+
+	outX = skyline[bestIdx].x;
+	outY = bestY;
+	addSegment(bestIdx, outX, bestY, w, h);
+	usedArea += w * h;
+
+	return true;
+}
+
+int packLightmaps(std::vector<LightmapRect>& rects, int atlasSize, float* fillRatio)
+{
+	std::vector<int> order(rects.size());
+	for (int i = 0; i < (int)rects.size(); i++) {
+		order[i] = i;
+	}
+
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		if (rects[a].h != rects[b].h) {
+			return rects[a].h > rects[b].h;
+		}
+		if (rects[a].w != rects[b].w) {
+			return rects[a].w > rects[b].w;
+		}
+		return a < b;
+	});
+
+	std::vector<LightmapAtlas> atlases;
+	int64_t packedArea = 0;
+
+	for (int i = 0; i < (int)order.size(); i++) {
+		LightmapRect& rect = rects[order[i]];
+		rect.atlasId = -1;
+
+		if (rect.w > atlasSize || rect.h > atlasSize) {
+			continue;
+		}
+
+		for (int k = 0; k < (int)atlases.size(); k++) {
+			if (atlases[k].insert(rect.w, rect.h, rect.x, rect.y)) {
+				rect.atlasId = k;
+				break;
+			}
+		}
+
+		if (rect.atlasId == -1) {
+			atlases.push_back(LightmapAtlas(atlasSize, atlasSize));
+			atlases.back().insert(rect.w, rect.h, rect.x, rect.y);
+			rect.atlasId = (int)atlases.size() - 1;
+		}
+
+		packedArea += rect.w * rect.h;
+	}
+
+	if (fillRatio) {
+		*fillRatio = atlases.size() ? (float)((double)packedArea / ((double)atlasSize * atlasSize * atlases.size())) : 0;
+	}
+
+	return (int)atlases.size();
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// Packs lightmaps into a single atlas with the skyline bottom-left method. The top edge of the
+// packed area is stored as a list of horizontal segments, and each lightmap is placed where its
+// top edge would be lowest.
+class LightmapAtlas
+{
+public:
+	LightmapAtlas(int width, int height);
+
+	// finds a place for a lightmap and returns its position, or false if it doesn't fit
+	bool insert(int w, int h, int& outX, int& outY);
+
+	int getUsedArea() const { return usedArea; }
+
+	// lightmaps taller than this can't fit anywhere
+	int getMaxFreeHeight() const { return height - minY; }
+
+private:
+	struct SkylineSegment {
+		int x, y, w;
+	};
+
+	std::vector<SkylineSegment> skyline;
+	int width;
+	int height;
+	int usedArea;
+	int minY;
+
+	// returns the lowest y that a lightmap starting at segment idx can be placed at, or -1
+	int fitAt(int idx, int w, int h) const;
+	void addSegment(int idx, int x, int y, int w, int h);
+};
+
+struct LightmapRect {
+	int w, h;
+
+	// set by packLightmaps
+	int atlasId; // -1 if the lightmap is too big for an atlas
+	int x, y;
+};
+
+// Packs lightmaps into as few atlasSize x atlasSize atlases as possible. Lightmaps are inserted
+// tallest first, and each goes into the first atlas it fits in. Returns the number of atlases.
+// fillRatio is the lightmap area divided by the total atlas area.
+int packLightmaps(std::vector<LightmapRect>& rects, int atlasSize, float* fillRatio = NULL);
@@ -85,6 +85,7 @@ void AppSettings::loadDefault()
 
 	lastdir = "";
 	undoLevels = 64;
+	lightmapAtlasSize = LIGHTMAP_ATLAS_SIZE;
 	verboseLogs = false;
 	debug_open = false;
 	keyvalue_open = false;
@@ -153,6 +154,9 @@ void AppSettings::load() {
 			else if (key == "render_flags") { g_settings.render_flags = atoi(val.c_str()); }
 			else if (key == "font_size") { g_settings.fontSize = (float)atof(val.c_str()); }
 			else if (key == "undo_levels") { g_settings.undoLevels = atoi(val.c_str()); }
+			else if (key == "lightmap_atlas_size") {
+				g_settings.lightmapAtlasSize = std::max(LIGHTMAP_ATLAS_MIN_SIZE, std::min(atoi(val.c_str()), LIGHTMAP_ATLAS_MAX_SIZE));
+			}
 			else if (key == "gamedir") { g_settings.gamedir = val; }
 			else if (key == "workingdir") { g_settings.workingdir = val; }
 			else if (key == "lastdir") { g_settings.lastdir = val; }
@@ -246,6 +250,7 @@ void AppSettings::save(std::string path)
 	file << "render_flags=" << g_settings.render_flags << std::endl;
 	file << "font_size=" << g_settings.fontSize << std::endl;
 	file << "undo_levels=" << g_settings.undoLevels << std::endl;
+	file << "lightmap_atlas_size=" << g_settings.lightmapAtlasSize << std::endl;
 	file << "savebackup=" << g_settings.backUpMap << std::endl;
 	file << "save_crc=" << g_settings.preserveCrc32 << std::endl;
 }
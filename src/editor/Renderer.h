@@ -59,6 +59,7 @@ struct AppSettings {
 	std::string lastdir;
 	bool settingLoaded; // Settings loaded
 	int undoLevels;
+	int lightmapAtlasSize;
 	bool verboseLogs;
 
 	bool debug_open;
@@ -107,6 +108,7 @@ class Renderer {
 	friend class EditBspModelCommand;
 	friend class CleanMapCommand;
 	friend class OptimizeMapCommand;
+	friend class StripDefaultKeyvaluesCommand;
 
 public:
 	std::vector<BspRenderer*> mapRenderers;
@@ -2,11 +2,17 @@
 #include "BspMerger.h"
 #include <string>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include "CommandLine.h"
 #include "remap.h"
 #include "Renderer.h"
 #include "winding.h"
+#include "VisQuery.h"
+#include "portalvis.h"
+#include "directlight.h"
+#include "LightmapAtlas.h"
+#include "rad.h"
 
 // super todo:
 // gui scale not accurate and mostly broken
@@ -175,6 +181,95 @@ int test() {
 	return 0;
 }
 
+void preprocess_merge_map(CommandLine& cli, Bsp* map) {
+	logf("    Deleting unused data...\n");
+	STRUCTCOUNT removed = map->remove_unused_model_structures();
+	g_progress.clear();
+	removed.print_delete_stats(2);
+
+	if (cli.hasOption("-nohull2") || (cli.hasOption("-optimize") && !map->has_hull2_ents())) {
+		logf("    Deleting hull 2...\n");
+		map->delete_hull(2, 1);
+		map->remove_unused_model_structures().print_delete_stats(2);
+	}
+
+	if (cli.hasOption("-optimize")) {
+		logf("    Optmizing...\n");
+		map->delete_unused_hulls().print_delete_stats(2);
+	}
+}
+
+int project_merge_limits(std::vector<Bsp*>& maps, const vec3& gap) {
+	auto start = std::chrono::steady_clock::now();
+
+	BspMerger merger;
+	STRUCTCOUNT counts;
+	int entCount = 0;
+	bool ok = merger.project_merge(maps, gap, counts, entCount);
+
+	for (int i = 0; i < maps.size(); i++) {
+		delete maps[i];
+	}
+	if (!ok) {
+		return 1;
+	}
+
+	struct ProjectedStat {
+		const char* name;
+		unsigned int val;
+		unsigned int max;
+		bool isMem;
+	};
+	ProjectedStat stats[] = {
+		{"models", counts.models, MAX_MAP_MODELS, false},
+		{"planes", counts.planes, MAX_MAP_PLANES, false},
+		{"vertexes", counts.verts, MAX_MAP_VERTS, false},
+		{"nodes", counts.nodes, MAX_MAP_NODES, false},
+		{"texinfos", counts.texInfos, MAX_MAP_TEXINFOS, false},
+		{"faces", counts.faces, MAX_MAP_FACES, false},
+		{"clipnodes", counts.clipnodes, MAX_MAP_CLIPNODES, false},
+		{"leaves", counts.leaves, MAX_MAP_LEAVES, false},
+		{"marksurfaces", counts.markSurfs, MAX_MAP_MARKSURFS, false},
+		{"surfedges", counts.surfEdges, MAX_MAP_SURFEDGES, false},
+		{"edges", counts.edges, MAX_MAP_EDGES, false},
+		{"textures", counts.textures, MAX_MAP_TEXTURES, false},
+		{"lightdata", counts.lightdata, MAX_MAP_LIGHTDATA, true},
+		{"visdata", counts.visdata, MAX_MAP_VISDATA, true},
+		{"entities", (unsigned int)entCount, MAX_MAP_ENTS, false},
+	};
+	const int statCount = sizeof(stats) / sizeof(ProjectedStat);
+
+	logf("\nProjected merge result:\n");
+	logf(" Data Type    Projected / Max      Fullness\n");
+	logf("------------  -------------------  --------\n");
+	for (int i = 0; i < statCount; i++) {
+		Bsp::print_stat(stats[i].name, stats[i].val, stats[i].max, stats[i].isMem);
+	}
+	logf("\nEntity count excludes entities added for map series logic (see -noripent).\n");
+
+	int overflows = 0;
+	for (int i = 0; i < statCount; i++) {
+		if (stats[i].val > stats[i].max) {
+			if (overflows++ == 0) {
+				logf("\nOverflowed limits:\n");
+			}
+			if (stats[i].isMem)
+				logf("    %-12s  %.2f MB over the limit\n", stats[i].name, (stats[i].val - stats[i].max) / (1024.0f * 1024.0f));
+			else
+				logf("    %-12s  %u over the limit\n", stats[i].name, stats[i].val - stats[i].max);
+		}
+	}
+
+	float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+	if (overflows) {
+		logf("\n%d limit(s) would overflow. Projected in %.2f seconds.\n", overflows, seconds);
+		return 1;
+	}
+
+	logf("\nNo limits would overflow. Projected in %.2f seconds.\n", seconds);
+	return 0;
+}
+
 int merge_maps(CommandLine& cli) {
 	std::vector<std::string> input_maps = cli.getOptionList("-maps");
 
@@ -183,6 +278,17 @@ int merge_maps(CommandLine& cli) {
 		return 1;
 	}
 
+	vec3 gap = cli.hasOption("-gap") ? cli.getOptionVector("-gap") : vec3(0, 0, 0);
+
+	std::string output_name = cli.hasOption("-o") ? cli.getOption("-o") : cli.bspfile;
+
+	if (cli.hasOption("-stream") && !cli.hasOption("-dryrun") && !cli.hasOption("--dry-run")) {
+		BspMerger merger;
+		bool ok = merger.merge_files(input_maps, gap, output_name, cli.hasOption("-noripent"), cli.hasOption("-noscript"),
+			[&](Bsp* map) { preprocess_merge_map(cli, map); });
+		return ok ? 0 : 1;
+	}
+
 	std::vector<Bsp*> maps;
 
 	for (int i = 0; i < input_maps.size(); i++) {
@@ -197,32 +303,24 @@ int merge_maps(CommandLine& cli) {
 
 	for (int i = 0; i < maps.size(); i++) {
 		logf("Preprocessing %s:\n", maps[i]->name.c_str());
-
-		logf("    Deleting unused data...\n");
-		STRUCTCOUNT removed = maps[i]->remove_unused_model_structures();
-		g_progress.clear();
-		removed.print_delete_stats(2);
-
-		if (cli.hasOption("-nohull2") || (cli.hasOption("-optimize") && !maps[i]->has_hull2_ents())) {
-			logf("    Deleting hull 2...\n");
-			maps[i]->delete_hull(2, 1);
-			maps[i]->remove_unused_model_structures().print_delete_stats(2);
-		}
-
-		if (cli.hasOption("-optimize")) {
-			logf("    Optmizing...\n");
-			maps[i]->delete_unused_hulls().print_delete_stats(2);
-		}
-
+		preprocess_merge_map(cli, maps[i]);
 		logf("\n");
 	}
 
-	vec3 gap = cli.hasOption("-gap") ? cli.getOptionVector("-gap") : vec3(0, 0, 0);
-
-	std::string output_name = cli.hasOption("-o") ? cli.getOption("-o") : cli.bspfile;
+	if (cli.hasOption("-dryrun") || cli.hasOption("--dry-run")) {
+		return project_merge_limits(maps, gap);
+	}
 
 	BspMerger merger;
-	Bsp* result = merger.merge(maps, gap, output_name, cli.hasOption("-noripent"), cli.hasOption("-noscript"));
+	Bsp* result = merger.merge(maps, gap, output_name, cli.hasOption("-noripent"), cli.hasOption("-noscript"),
+		cli.hasOption("-pairwise"));
+
+	if (!result) {
+		for (int i = 0; i < maps.size(); i++) {
+			delete maps[i];
+		}
+		return 1;
+	}
 
 	logf("\n");
 	if (result->isValid()) result->write(output_name);
@@ -534,6 +632,573 @@ int unembed(CommandLine& cli) {
 	return 0;
 }
 
+int weld(CommandLine& cli) {
+	Bsp map(cli.bspfile);
+	if (!map.valid)
+	{
+		return 1;
+	}
+
+	float epsilon = 0.01f;
+	if (cli.hasOption("-epsilon")) {
+		epsilon = (float)atof(cli.getOption("-epsilon").c_str());
+
+		if (epsilon < 0) {
+			logf("ERROR: epsilon can't be negative\n");
+			return 1;
+		}
+	}
+
+	STRUCTCOUNT removed = map.weld_vertices(epsilon);
+
+	if (removed.allZero()) {
+		logf("No vertices or edges to weld\n");
+	}
+	else {
+		removed.print_delete_stats(0);
+	}
+
+	if (map.isValid()) map.write(cli.hasOption("-o") ? cli.getOption("-o") : map.path);
+	logf("\n");
+
+	return 0;
+}
+
+int vis(CommandLine& cli) {
+	Bsp map(cli.bspfile);
+	if (!map.valid)
+	{
+		return 1;
+	}
+
+	VisQuery query(&map);
+	int worldLeaves = query.worldLeafCount();
+
+	if (cli.hasOption("-from") || cli.hasOption("-to")) {
+		if (!cli.hasOption("-from") || !cli.hasOption("-to")) {
+			logf("ERROR: -from and -to must be used together\n");
+			return 1;
+		}
+		vec3 from = cli.getOptionVector("-from");
+		vec3 to = cli.getOptionVector("-to");
+		int leafA = query.findLeaf(from);
+		int leafB = query.findLeaf(to);
+		bool visible = query.canSee(leafA, leafB);
+		logf("Leaf %d -> leaf %d: %s\n", leafA, leafB, visible ? "VISIBLE" : "NOT VISIBLE");
+		return 0;
+	}
+
+	int leafIdx = -1;
+	if (cli.hasOption("-point")) {
+		leafIdx = query.findLeaf(cli.getOptionVector("-point"));
+		logf("Point is in leaf %d\n", leafIdx);
+	}
+	else if (cli.hasOption("-leaf")) {
+		leafIdx = cli.getOptionInt("-leaf");
+	}
+
+	if (leafIdx != -1) {
+		if (leafIdx <= 0 || leafIdx > worldLeaves) {
+			logf("Leaf %d is not a world leaf (valid range is 1-%d)\n", leafIdx, worldLeaves);
+			return 1;
+		}
+
+		BSPLEAF& leaf = map.leaves[leafIdx];
+		const VisBitset& row = query.getVisibleLeaves(leafIdx);
+		logf("Leaf %d (%s) bounds (%d %d %d) - (%d %d %d)\n", leafIdx, map.getLeafContentsName(leaf.nContents),
+			leaf.nMins[0], leaf.nMins[1], leaf.nMins[2], leaf.nMaxs[0], leaf.nMaxs[1], leaf.nMaxs[2]);
+		logf("Sees %d / %d leaves\n", row.count(), worldLeaves);
+
+		if (cli.hasOption("-list")) {
+			for (int i = 0; i < worldLeaves; i++) {
+				if (row.test(i)) {
+					logf("  %d\n", i + 1);
+				}
+			}
+		}
+		return 0;
+	}
+
+	if (worldLeaves == 0) {
+		logf("The map has no world leaves\n");
+		return 0;
+	}
+
+	int topCount = cli.hasOption("-top") ? cli.getOptionInt("-top") : 10;
+	std::vector<int> counts = query.countAllVisibleLeaves();
+
+	int64_t total = 0;
+	int minVisible = INT_MAX;
+	int maxVisible = 0;
+	for (int i = 1; i <= worldLeaves; i++) {
+		total += counts[i];
+		minVisible = std::min(minVisible, counts[i]);
+		maxVisible = std::max(maxVisible, counts[i]);
+	}
+
+	logf("World leaves:   %d\n", worldLeaves);
+	logf("VIS data size:  %d bytes%s\n", map.visDataLength, map.visDataLength ? "" : " (everything is visible)");
+	logf("Visible leaves: %.1f average, %d min, %d max (%.1f%% of the map on average)\n",
+		(double)total / worldLeaves, minVisible, maxVisible, (total * 100.0) / ((double)worldLeaves * worldLeaves));
+
+	if (topCount > 0) {
+		std::vector<int> sorted;
+		for (int i = 1; i <= worldLeaves; i++) {
+			sorted.push_back(i);
+		}
+		topCount = std::min(topCount, worldLeaves);
+		std::partial_sort(sorted.begin(), sorted.begin() + topCount, sorted.end(), [&](int a, int b) {
+			return counts[a] != counts[b] ? counts[a] > counts[b] : a < b;
+		});
+
+		logf("\nLeaves that see the most:\n");
+		logf("   Leaf  Visible  Bounds\n");
+		for (int i = 0; i < topCount; i++) {
+			BSPLEAF& leaf = map.leaves[sorted[i]];
+			logf("  %5d  %7d  (%d %d %d) - (%d %d %d)\n", sorted[i], counts[sorted[i]],
+				leaf.nMins[0], leaf.nMins[1], leaf.nMins[2], leaf.nMaxs[0], leaf.nMaxs[1], leaf.nMaxs[2]);
+		}
+	}
+
+	return 0;
+}
+
+float average_visible_leaves(Bsp& map) {
+	VisQuery query(&map);
+	std::vector<int> counts = query.countAllVisibleLeaves();
+	int64_t total = 0;
+	for (int count : counts) {
+		total += count;
+	}
+	return query.worldLeafCount() ? (float)((double)total / query.worldLeafCount()) : 0;
+}
+
+int buildvis(CommandLine& cli) {
+	Bsp map(cli.bspfile);
+	if (!map.valid)
+	{
+		return 1;
+	}
+
+	int worldLeaves = map.modelCount > 0 ? map.models[0].nVisLeafs : 0;
+	std::vector<bool> updateLeaves(map.leafCount, false);
+	bool limited = false;
+
+	if (cli.hasOption("-changed")) {
+		limited = true;
+		for (int i = 1; i <= worldLeaves && i < (int)map.leafCount; i++) {
+			if (map.leaves[i].nVisOffset < 0) {
+				updateLeaves[i] = true;
+			}
+		}
+	}
+
+	if (cli.hasOption("-mins") || cli.hasOption("-maxs")) {
+		if (!cli.hasOption("-mins") || !cli.hasOption("-maxs")) {
+			logf("ERROR: -mins and -maxs must be used together\n");
+			return 1;
+		}
+		limited = true;
+		vec3 mins = cli.getOptionVector("-mins");
+		vec3 maxs = cli.getOptionVector("-maxs");
+		for (int i = 1; i <= worldLeaves && i < (int)map.leafCount; i++) {
+			BSPLEAF& leaf = map.leaves[i];
+			if (leaf.nMaxs[0] >= mins.x && leaf.nMins[0] <= maxs.x &&
+				leaf.nMaxs[1] >= mins.y && leaf.nMins[1] <= maxs.y &&
+				leaf.nMaxs[2] >= mins.z && leaf.nMins[2] <= maxs.z) {
+				updateLeaves[i] = true;
+			}
+		}
+	}
+
+	if (limited && std::find(updateLeaves.begin(), updateLeaves.end(), true) == updateLeaves.end()) {
+		logf("No leaves to update\n");
+		return 0;
+	}
+
+	int oldVisLength = map.visDataLength;
+	float oldAverage = average_visible_leaves(map);
+
+	if (!build_approximate_vis(&map, limited ? &updateLeaves : NULL)) {
+		return 1;
+	}
+
+	logf("Average visible leaves: %.1f -> %.1f (%d world leaves)\n", oldAverage, average_visible_leaves(map), worldLeaves);
+	logf("VIS data: %d -> %d bytes\n", oldVisLength, map.visDataLength);
+
+	if (map.isValid()) map.write(cli.hasOption("-o") ? cli.getOption("-o") : map.path);
+	logf("\n");
+
+	return 0;
+}
+
+int atlas(CommandLine& cli) {
+	Bsp map(cli.bspfile);
+	if (!map.valid)
+	{
+		return 1;
+	}
+
+	int atlasSize = cli.hasOption("-size") ? cli.getOptionInt("-size") : LIGHTMAP_ATLAS_SIZE;
+	if (atlasSize < LIGHTMAP_ATLAS_MIN_SIZE || atlasSize > LIGHTMAP_ATLAS_MAX_SIZE) {
+		logf("ERROR: atlas size must be between %d and %d\n", LIGHTMAP_ATLAS_MIN_SIZE, LIGHTMAP_ATLAS_MAX_SIZE);
+		return 1;
+	}
+
+	// same lightmaps as the 3D editor loads
+	std::vector<LightmapRect> rects;
+	int64_t lightmapArea = 0;
+	for (unsigned int i = 0; i < map.faceCount; i++) {
+		BSPFACE& face = map.faces[i];
+		BSPTEXTUREINFO& texinfo = map.texinfos[face.iTextureInfo];
+
+		if (face.nLightmapOffset < 0 || (texinfo.nFlags & TEX_SPECIAL) || face.nLightmapOffset >= map.header.lump[LUMP_LIGHTING].nLength)
+			continue;
+
+		int size[2];
+		GetFaceLightmapSize(&map, i, size);
+
+		for (int s = 0; s < MAXLIGHTMAPS; s++) {
+			if (face.nStyles[s] == 255)
+				continue;
+
+			LightmapRect rect;
+			rect.w = size[0];
+			rect.h = size[1];
+			rects.push_back(rect);
+			lightmapArea += size[0] * size[1];
+		}
+	}
+
+	if (rects.empty()) {
+		logf("The map has no lightmaps\n");
+		return 0;
+	}
+
+	// skyline packer in face order, trying only the newest atlas, to show what sorting and backfilling save
+	auto start = std::chrono::steady_clock::now();
+	int unsortedAtlases = 1;
+	{
+		LightmapAtlas* current = new LightmapAtlas(atlasSize, atlasSize);
+		for (LightmapRect rect : rects) {
+			if (rect.w > atlasSize || rect.h > atlasSize) {
+				continue;
+			}
+			if (!current->insert(rect.w, rect.h, rect.x, rect.y)) {
+				delete current;
+				current = new LightmapAtlas(atlasSize, atlasSize);
+				current->insert(rect.w, rect.h, rect.x, rect.y);
+				unsortedAtlases++;
+			}
+		}
+		delete current;
+	}
+	float unsortedSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	float fillRatio = 0;
+	int atlasCount = packLightmaps(rects, atlasSize, &fillRatio);
+	float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+	int tooBig = 0;
+	for (LightmapRect& rect : rects) {
+		tooBig += rect.atlasId == -1;
+	}
+
+	float atlasMb = (atlasSize * atlasSize * sizeof(COLOR3)) / (1024.0f * 1024.0f);
+	float unsortedFill = (float)((double)lightmapArea / ((double)atlasSize * atlasSize * unsortedAtlases));
+
+	logf("%d lightmaps, %d x %d atlases\n\n", (int)rects.size(), atlasSize, atlasSize);
+	logf(" Method              Atlases  Fill    Memory     Time\n");
+	logf("------------------   -------  ------  ---------  --------\n");
+	logf(" Skyline, unsorted   %7d  %5.1f%%  %6.2f MB  %.4fs\n", unsortedAtlases, unsortedFill * 100.0f, unsortedAtlases * atlasMb, unsortedSeconds);
+	logf(" Skyline, sorted     %7d  %5.1f%%  %6.2f MB  %.4fs\n", atlasCount, fillRatio * 100.0f, atlasCount * atlasMb, seconds);
+
+	if (tooBig) {
+		logf("\n%d lightmaps are too big for the atlas size\n", tooBig);
+	}
+
+	return 0;
+}
+
+int lightstyles(CommandLine& cli) {
+	Bsp map(cli.bspfile);
+	if (!map.valid)
+	{
+		return 1;
+	}
+
+	std::vector<LightStyleUsage> usage;
+	map.analyze_light_styles(usage);
+
+	logf(" Style  Layers  Black  Size        Prunable\n");
+	logf("------  ------  -----  ----------  ----------\n");
+	unsigned int prunable = 0;
+	for (int i = 0; i < 255; i++) {
+		LightStyleUsage& use = usage[i];
+		if (!use.layers && !use.neverOn) {
+			continue;
+		}
+		logf(" %5d  %6d  %5d  %7.2f KB  %7.2f KB%s\n", i, use.layers, use.blackLayers, use.bytes / 1024.0f,
+			use.prunableBytes / 1024.0f, use.neverOn ? "  (never turned on)" : "");
+		prunable += use.prunableBytes;
+	}
+	logf("\n");
+
+	if (!cli.hasOption("-prune")) {
+		Bsp::print_stat("lightdata", map.lightDataLength, MAX_MAP_LIGHTDATA, true);
+		logf("Up to %.2f KB can be pruned (before sharing duplicate lightmaps)\n", prunable / 1024.0f);
+		return 0;
+	}
+
+	unsigned int oldLength = map.lightDataLength;
+	unsigned int saved = 0;
+	int pruned = map.prune_light_styles(&saved);
+
+	logf("Deleted %d lightmap layers\n", pruned);
+	logf("lightdata: %.2f KB -> %.2f KB (%.1f%% -> %.1f%% of max)\n", oldLength / 1024.0f, map.lightDataLength / 1024.0f,
+		(oldLength / (float)MAX_MAP_LIGHTDATA) * 100.0f, (map.lightDataLength / (float)MAX_MAP_LIGHTDATA) * 100.0f);
+
+	if (pruned && map.isValid()) map.write(cli.hasOption("-o") ? cli.getOption("-o") : map.path);
+
+	return 0;
+}
+
+int relight(CommandLine& cli) {
+	Bsp map(cli.bspfile);
+	if (!map.valid)
+	{
+		return 1;
+	}
+
+	if (!cli.hasOption("--direct-only")) {
+		logf("ERROR: only direct lighting is supported. Add --direct-only to bake it.\n");
+		return 1;
+	}
+
+	int oldLightLength = map.lightDataLength;
+
+	auto start = std::chrono::steady_clock::now();
+	if (!bake_direct_lighting(&map)) {
+		return 1;
+	}
+	float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+	logf("Baked direct lighting in %.2fs\n", seconds);
+	logf("lightdata: %d -> %d bytes\n", oldLightLength, map.lightDataLength);
+
+	if (map.isValid()) map.write(cli.hasOption("-o") ? cli.getOption("-o") : map.path);
+	logf("\n");
+
+	return 0;
+}
+
+int stripdefaults(CommandLine& cli) {
+	Bsp map(cli.bspfile);
+	if (!map.valid)
+	{
+		return 1;
+	}
+
+	if (!cli.hasOption("-fgd")) {
+		logf("ERROR: -fgd is required\n");
+		return 1;
+	}
+
+	Fgd* fgd = NULL;
+	std::vector<std::string> fgdPaths = cli.getOptionList("-fgd");
+	for (int i = 0; i < fgdPaths.size(); i++) {
+		Fgd* tmp = new Fgd(fgdPaths[i]);
+		if (!tmp->parse()) {
+			delete tmp;
+			continue;
+		}
+
+		if (!fgd) {
+			fgd = tmp;
+		}
+		else {
+			fgd->merge(tmp);
+			delete tmp;
+		}
+	}
+
+	if (!fgd) {
+		logf("ERROR: Failed to load any FGDs\n");
+		return 1;
+	}
+
+	unsigned int oldEntLength = map.header.lump[LUMP_ENTITIES].nLength;
+	unsigned int saved = map.strip_default_keyvalues(fgd, cli.hasOption("-alldefaults"));
+	delete fgd;
+
+	logf("Entity data reduced by %u bytes (%.1f%%)\n", saved, oldEntLength ? (saved * 100.0f) / oldEntLength : 0.0f);
+
+	if (map.isValid()) map.write(cli.hasOption("-o") ? cli.getOption("-o") : map.path);
+	logf("\n");
+
+	return 0;
+}
+
+// a single map, or all maps in a directory
+std::vector<std::string> get_map_list(std::string input) {
+	std::vector<std::string> maps;
+
+	if (dirExists(input)) {
+		for (auto& entry : fs::directory_iterator(input)) {
+			std::string path = entry.path().string();
+			if (entry.is_regular_file() && toLowerCase(path).rfind(".bsp") == path.size() - 4) {
+				maps.push_back(path);
+			}
+		}
+		std::sort(maps.begin(), maps.end());
+		return maps;
+	}
+
+	if (!fileExists(input) && fileExists(input + ".bsp")) {
+		input += ".bsp";
+	}
+	maps.push_back(input);
+	return maps;
+}
+
+// path of the entity file for a map. dirOrFile is a directory when processing several maps.
+std::string get_ent_file_path(const std::string& mapPath, const std::string& dirOrFile, bool multipleMaps, const std::string& ext) {
+	if (dirOrFile.empty()) {
+		return stripExt(mapPath) + ext;
+	}
+	if (!multipleMaps) {
+		return dirOrFile;
+	}
+	std::string dir = dirOrFile;
+	fixupPath(dir, FIXUPPATH_SLASH::FIXUPPATH_SLASH_SKIP, FIXUPPATH_SLASH::FIXUPPATH_SLASH_CREATE);
+	return dir + stripExt(basename(mapPath)) + ext;
+}
+
+int entexport(CommandLine& cli) {
+	std::vector<std::string> maps = get_map_list(cli.bspfile);
+	if (maps.empty()) {
+		logf("ERROR: No maps found in %s\n", cli.bspfile.c_str());
+		return 1;
+	}
+
+	bool json = cli.hasOption("-json");
+	bool multipleMaps = maps.size() > 1 || dirExists(cli.bspfile);
+	std::string outPath = cli.hasOption("-o") ? cli.getOption("-o") : "";
+	std::string ext = json ? ".json" : ".ent";
+
+	if (multipleMaps && !outPath.empty() && !createDir(outPath)) {
+		return 1;
+	}
+
+	// each thread only holds the entity lump of the map it's working on
+	std::atomic<int> failed(0);
+	parallelFor((int)maps.size(), [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			std::string entData;
+			if (!readEntityLump(maps[i], entData)) {
+				failed++;
+				continue;
+			}
+
+			if (json) {
+				std::vector<Entity*> ents;
+				parseEntities(entData.c_str(), entData.size(), maps[i], ents);
+				entData = entitiesToJson(ents);
+				for (int k = 0; k < ents.size(); k++)
+					delete ents[k];
+			}
+
+			std::string entPath = get_ent_file_path(maps[i], outPath, multipleMaps, ext);
+			if (!writeFile(entPath, entData.c_str(), (int)entData.size())) {
+				logf("Failed to write %s\n", entPath.c_str());
+				failed++;
+				continue;
+			}
+			debugf("Exported %s\n", entPath.c_str());
+		}
+	}, 1);
+
+	logf("Exported entities from %d of %d maps\n", (int)maps.size() - failed, (int)maps.size());
+	return failed ? 1 : 0;
+}
+
+int entimport(CommandLine& cli) {
+	std::vector<std::string> maps = get_map_list(cli.bspfile);
+	if (maps.empty()) {
+		logf("ERROR: No maps found in %s\n", cli.bspfile.c_str());
+		return 1;
+	}
+
+	bool json = cli.hasOption("-json");
+	bool multipleMaps = maps.size() > 1 || dirExists(cli.bspfile);
+	std::string inPath = cli.hasOption("-i") ? cli.getOption("-i") : "";
+	std::string outPath = cli.hasOption("-o") ? cli.getOption("-o") : "";
+	std::string ext = json ? ".json" : ".ent";
+
+	if (multipleMaps && !outPath.empty() && !createDir(outPath)) {
+		return 1;
+	}
+
+	std::atomic<int> failed(0);
+	std::atomic<int> skipped(0);
+	parallelFor((int)maps.size(), [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			std::string entPath = get_ent_file_path(maps[i], inPath, multipleMaps, ext);
+			if (!fileExists(entPath)) {
+				if (multipleMaps) {
+					skipped++; // only some maps were edited
+				}
+				else {
+					logf("ERROR: %s not found\n", entPath.c_str());
+					failed++;
+				}
+				continue;
+			}
+
+			int len;
+			char* text = loadFile(entPath, len);
+			if (!text) {
+				logf("ERROR: Failed to read %s\n", entPath.c_str());
+				failed++;
+				continue;
+			}
+			std::vector<Entity*> ents;
+			bool ok = true;
+			if (json) {
+				ok = parseEntitiesJson(std::string(text, len), entPath, ents);
+			}
+			else {
+				parseEntities(text, len, entPath, ents);
+			}
+			delete[] text;
+
+			if (ok && (ents.empty() || ents[0]->keyvalues["classname"] != "worldspawn")) {
+				logf("ERROR: %s has no worldspawn entity\n", entPath.c_str());
+				ok = false;
+			}
+
+			std::string entData = ok ? serializeEntities(ents) : "";
+			for (int k = 0; k < ents.size(); k++)
+				delete ents[k];
+
+			std::string mapOut = outPath.empty() ? maps[i] : get_ent_file_path(maps[i], outPath, multipleMaps, ".bsp");
+			if (!ok || !writeEntityLump(maps[i], mapOut, entData)) {
+				logf("Failed to import %s\n", entPath.c_str());
+				failed++;
+				continue;
+			}
+			debugf("Imported %s into %s\n", entPath.c_str(), mapOut.c_str());
+		}
+	}, 1);
+
+	logf("Imported entities into %d of %d maps", (int)maps.size() - failed - skipped, (int)maps.size());
+	if (skipped)
+		logf(" (%d had no %s file)", (int)skipped, ext.c_str());
+	logf("\n");
+	return failed ? 1 : 0;
+}
+
 void print_help(const std::string & command) {
 	if (command == "merge") {
 		logf(
@@ -560,6 +1225,14 @@ void print_help(const std::string & command) {
 			"                 entities, and some ents might not spawn properly. The benefit\n"
 			"                 to this flag is that you don't have deal with script setup.\n"
 			"  -gap \"X,Y,Z\" : Amount of extra space to add between each map\n"
+			"  -pairwise    : Merge maps one pair at a time instead of all at once. Slower,\n"
+			"                 and the result is copied once per merged map.\n"
+			"  -dryrun      : Report the struct counts and lump sizes of the merged map, and\n"
+			"                 which limits would overflow, without merging. Exits with code 1\n"
+			"                 if any limit would overflow.\n"
+			"  -stream      : Reduce memory usage for large merges. Maps are loaded one at a\n"
+			"                 time and the output is written while it's merged. Temporary\n"
+			"                 files are created in a folder next to the output file.\n"
 			"  -v\n"
 			"  -verbose     : Verbose console output.\n"
 		);
@@ -647,6 +1320,144 @@ void print_help(const std::string & command) {
 			"Example: bspguy unembed c1a0.bsp\n"
 		);
 	}
+	else if (command == "weld") {
+		logf(
+			"weld - Merges vertices that are at the same position and deletes duplicate edges.\n"
+			"       Vertices are left alone if moving them would change a face's lightmap size.\n\n"
+
+			"Usage:   bspguy weld <mapname> [options]\n"
+			"Example: bspguy weld svencoop1.bsp -epsilon 0.1\n"
+
+			"\n[Options]\n"
+			"  -epsilon # : Max distance on each axis between welded vertices. Default is 0.01\n"
+			"  -o <file>  : Output file. By default, <mapname> is overwritten.\n"
+		);
+	}
+	else if (command == "vis") {
+		logf(
+			"vis - Shows how many leaves are visible from each leaf, or checks visibility between points.\n"
+			"      With no options, a summary is printed with the leaves that see the most of the map.\n\n"
+
+			"Usage:   bspguy vis <mapname> [options]\n"
+			"Example: bspguy vis svencoop1.bsp -top 20\n"
+			"Example: bspguy vis svencoop1.bsp -from \"0,0,64\" -to \"512,128,64\"\n"
+
+			"\n[Options]\n"
+			"  -top #          : Number of leaves to list in the summary. Default is 10\n"
+			"  -leaf #         : Show the visible leaf count for a single leaf\n"
+			"  -point \"X,Y,Z\"  : Same as -leaf, using the leaf that contains the point\n"
+			"  -list           : With -leaf or -point, list every visible leaf\n"
+			"  -from \"X,Y,Z\"   : Check if the leaf containing this point can see the -to point\n"
+			"  -to \"X,Y,Z\"     : Target point for -from\n"
+		);
+	}
+	else if (command == "buildvis") {
+		logf(
+			"buildvis - Generates approximate VIS data from the portals between leaves.\n"
+			"           Useful after merging or editing, which can leave leaves that see everything.\n"
+			"           The result is more conservative than a full hlvis compile, but\n"
+			"           takes seconds instead of hours.\n\n"
+
+			"Usage:   bspguy buildvis <mapname> [options]\n"
+			"Example: bspguy buildvis merged.bsp -changed\n"
+
+			"\n[Options]\n"
+			"  -changed        : Only update leaves that have no VIS data (all leaves visible)\n"
+			"  -mins \"X,Y,Z\"   : Only update leaves that touch this box (requires -maxs)\n"
+			"  -maxs \"X,Y,Z\"   : Max corner of the update box\n"
+			"  -o <file>       : Output file. By default, <mapname> is overwritten.\n"
+		);
+	}
+	else if (command == "atlas") {
+		logf(
+			"atlas - Packs the lightmaps of a map into atlases like the 3D editor does, and reports\n"
+			"        how many atlases are needed and how full they are. Packing without sorting the\n"
+			"        lightmaps or reusing earlier atlases is shown for comparison.\n\n"
+
+			"Usage:   bspguy atlas <mapname> [options]\n"
+			"Example: bspguy atlas svencoop1.bsp -size 1024\n"
+
+			"\n[Options]\n"
+			"  -size # : Width and height of each atlas, from 256 to 4096. Default is 512\n"
+		);
+	}
+	else if (command == "lightstyles") {
+		logf(
+			"lightstyles - Lists lightmap usage per light style. Lightmap layers that are completely\n"
+			"              black, or that use a switchable style (32+) whose lights all start off and\n"
+			"              are never triggered, can be deleted. The first layer of a face is always kept.\n\n"
+
+			"Usage:   bspguy lightstyles <mapname> [options]\n"
+			"Example: bspguy lightstyles c1a0.bsp -prune\n"
+
+			"\n[Options]\n"
+			"  -prune    : Delete unused lightmap layers and share duplicate lightmaps\n"
+			"  -o <file> : Output file. By default, <mapname> is overwritten.\n"
+		);
+	}
+	else if (command == "relight") {
+		logf(
+			"relight - Replaces the lightmaps with a quick preview of the map's lighting. Only direct\n"
+			"          light from light, light_spot, and light_environment entities is baked, and only\n"
+			"          the world casts shadows. Run hlrad for final lighting.\n\n"
+
+			"Usage:   bspguy relight <mapname> --direct-only [options]\n"
+			"Example: bspguy relight c1a0.bsp --direct-only -o c1a0_preview.bsp\n"
+
+			"\n[Options]\n"
+			"  --direct-only : Bake direct lighting only (required)\n"
+			"  -o <file>     : Output file. By default, <mapname> is overwritten.\n"
+		);
+	}
+	else if (command == "stripdefaults") {
+		logf(
+			"stripdefaults - Deletes entity keyvalues that are equal to their defaults.\n"
+			"                Empty values, zero spawnflags, and values equal to a zero/empty\n"
+			"                FGD default are deleted. classname, origin, model, and targetname\n"
+			"                are never touched.\n\n"
+
+			"Usage:   bspguy stripdefaults <mapname> -fgd \"fgd1, fgd2, ... fgdN\" [options]\n"
+			"Example: bspguy stripdefaults svencoop1.bsp -fgd \"sven-coop.fgd\"\n"
+
+			"\n[Options]\n"
+			"  -fgd \"paths\" : FGD files that define the default values. Required.\n"
+			"  -alldefaults : Also delete values equal to non-zero FGD defaults.\n"
+			"                 This can break entities if the game's defaults don't match\n"
+			"                 the FGD.\n"
+			"  -o <file>    : Output file. By default, <mapname> is overwritten.\n"
+		);
+	}
+	else if (command == "entexport") {
+		logf(
+			"entexport - Exports the entity lump to a text or JSON file, without loading\n"
+			"            the rest of the BSP. A directory exports every map inside it.\n\n"
+
+			"Usage:   bspguy entexport <mapname|directory> [options]\n"
+			"Example: bspguy entexport maps -json -o maps/ents\n"
+
+			"\n[Options]\n"
+			"  -json     : Write a JSON array of entities instead of entity lump text.\n"
+			"  -o <path> : Output file, or output directory when exporting a directory.\n"
+			"              By default, <mapname>.ent (or .json) is written next to each map.\n"
+		);
+	}
+	else if (command == "entimport") {
+		logf(
+			"entimport - Replaces the entity lump with a text or JSON file. Only the entity\n"
+			"            lump and header are changed. A directory imports every map inside\n"
+			"            it that has an entity file.\n\n"
+
+			"Usage:   bspguy entimport <mapname|directory> [options]\n"
+			"Example: bspguy entimport maps -json -i maps/ents\n"
+
+			"\n[Options]\n"
+			"  -json     : Read JSON files written by 'entexport -json'.\n"
+			"  -i <path> : Input file, or input directory when importing a directory.\n"
+			"              By default, <mapname>.ent (or .json) next to each map is used.\n"
+			"  -o <path> : Output file, or output directory when importing a directory.\n"
+			"              By default, the maps are overwritten.\n"
+		);
+	}
 	else if (command == "exportobj") {
 		logf(
 			"exportobj - Export bsp geometry to obj [WIP].\n\n"
@@ -678,6 +1489,15 @@ void print_help(const std::string & command) {
 			"  simplify  : Simplify BSP models\n"
 			"  transform : Apply 3D transformations to the BSP\n"
 			"  unembed   : Deletes embedded texture data\n"
+			"  weld      : Merges duplicate vertices and edges\n"
+			"  vis       : Show leaf visibility statistics and queries\n"
+			"  buildvis  : Generate approximate VIS data without hlvis\n"
+			"  atlas     : Benchmark lightmap atlas packing\n"
+			"  lightstyles : List and prune unused light style lightmaps\n"
+			"  relight   : Bake preview lighting without hlrad\n"
+			"  stripdefaults : Deletes entity keyvalues that are equal to their defaults\n"
+			"  entexport : Export entity lumps to text or JSON files\n"
+			"  entimport : Import entity lumps from text or JSON files\n"
 			"  exportobj   : Export bsp geometry to obj [WIP]\n"
 			"  editor, empty   : Open empty bspguy window\n"
 
@@ -703,6 +1523,10 @@ int main(int argc, char* argv[])
 	g_settings_path = fileExists(GetCurrentWorkingDir() + "bspguy.cfg") ? GetCurrentWorkingDir() + "bspguy.cfg" : getConfigDir() + "bspguy.cfg";
 	g_config_dir = fileExists(GetCurrentWorkingDir() + "bspguy.cfg") ? GetCurrentWorkingDir() : getConfigDir();
 
+	// extra classname rules for the hull/visibility heuristics (for games other than Sven Co-op)
+	if (fileExists(g_config_dir + "entrules.txt"))
+		loadClassnameRules(g_config_dir + "entrules.txt");
+
 	//return test();
 
 	CommandLine cli(argc, argv);
@@ -751,6 +1575,33 @@ int main(int argc, char* argv[])
 	else if (cli.command == "unembed") {
 		return unembed(cli);
 	}
+	else if (cli.command == "stripdefaults") {
+		return stripdefaults(cli);
+	}
+	else if (cli.command == "weld") {
+		return weld(cli);
+	}
+	else if (cli.command == "vis") {
+		return vis(cli);
+	}
+	else if (cli.command == "buildvis") {
+		return buildvis(cli);
+	}
+	else if (cli.command == "atlas") {
+		return atlas(cli);
+	}
+	else if (cli.command == "lightstyles") {
+		return lightstyles(cli);
+	}
+	else if (cli.command == "relight") {
+		return relight(cli);
+	}
+	else if (cli.command == "entexport") {
+		return entexport(cli);
+	}
+	else if (cli.command == "entimport") {
+		return entimport(cli);
+	}
 	else {
 		logf("%s\n", ("Start bspguy editor with map: " + cli.bspfile).c_str());
 		logf("Load settings from : %s\n", g_settings_path.c_str());
@@ -0,0 +1,549 @@
+#include "directlight.h"
+#include "rad.h"
+#include "winding.h"
+#include "Bsp.h"
+#include <atomic>
+#include <climits>
+#include <map>
+
+#define LIGHT_REFERENCE_DIST 128.0f // point lights are at full brightness this far away
+#define LIGHT_GAMMA 0.55f // same as the hlrad default
+#define LUXEL_SURFACE_OFFSET 1.0f // keeps samples from being shadowed by their own face
+#define SUN_TRACE_DIST 65536.0f
+#define DEFAULT_LIGHT_INTENSITY 300.0f
+#define DEFAULT_SPOT_CONE 10.0f
+
+enum direct_light_types {
+	LIGHT_POINT,
+	LIGHT_SPOT,
+	LIGHT_SUN
+};
+
+struct DirectLight
+{
+	int type;
+	int style;
+	vec3 origin;
+	vec3 color; // intensity of each channel
+	vec3 dir; // direction that spot and sun lights shine
+	float fade;
+	float stopdot; // cos of the spot light cone where falloff starts
+	float stopdot2; // cos of the spot light cone where the light ends
+	float rangeSq; // squared distance where a point light adds less than 1 to a luxel
+};
+
+// a face's lightmap layer for a single style
+struct StyleLayer
+{
+	int style;
+	std::vector<vec3> light;
+};
+
+static vec3 parse_light_color(Entity* ent) {
+	if (!ent->hasKey("_light")) {
+		return vec3(DEFAULT_LIGHT_INTENSITY, DEFAULT_LIGHT_INTENSITY, DEFAULT_LIGHT_INTENSITY);
+	}
+
+	float r = 0, g = 0, b = 0, brightness = 0;
+	int count = sscanf(ent->keyvalues["_light"].c_str(), "%f %f %f %f", &r, &g, &b, &brightness);
+
+	if (count == 4) {
+		return vec3(r, g, b) * (brightness / 255.0f);
+	}
+	if (count == 3) {
+		return vec3(r, g, b);
+	}
+	if (count == 1) {
+		return vec3(r, r, r);
+	}
+	return vec3(DEFAULT_LIGHT_INTENSITY, DEFAULT_LIGHT_INTENSITY, DEFAULT_LIGHT_INTENSITY);
+}
+
+// same angle keys as hlrad. A target overrides the angles.
+static vec3 parse_light_direction(Bsp* map, Entity* ent, const vec3& origin) {
+	if (ent->hasKey("target")) {
+		std::string target = ent->keyvalues["target"];
+		for (Entity* other : map->ents) {
+			if (other->hasKey("targetname") && other->keyvalues["targetname"] == target) {
+				vec3 dir = other->getOrigin() - origin;
+				if (dir.length() > 0) {
+					return dir.normalize();
+				}
+			}
+		}
+	}
+
+	vec3 angles = ent->hasKey("angles") ? parseVector(ent->keyvalues["angles"]) : vec3();
+	float yaw = ent->hasKey("angle") ? (float)atof(ent->keyvalues["angle"].c_str()) : angles.y;
+	float pitch = ent->hasKey("pitch") ? (float)atof(ent->keyvalues["pitch"].c_str()) : angles.x;
+
+	if (yaw == -1) {
+		return vec3(0, 0, 1);
+	}
+	if (yaw == -2) {
+		return vec3(0, 0, -1);
+	}
+
+	float yawRad = yaw * (PI / 180.0f);
+	float pitchRad = pitch * (PI / 180.0f);
+	return vec3(cosf(yawRad) * cosf(pitchRad), sinf(yawRad) * cosf(pitchRad), sinf(pitchRad));
+}
+
+// newStyles gets the named lights that were given a switchable style. They should only be saved to
+// the entities if the lighting is baked.
+static void load_lights(Bsp* map, std::vector<DirectLight>& lights, std::vector<std::pair<Entity*, int>>& newStyles) {
+	std::map<std::string, int> namedStyles;
+
+	// new styles go after the ones already used by the map, so they aren't shared with other lights
+	int nextStyle = 32;
+	for (Entity* ent : map->ents) {
+		if (ent->hasKey("style")) {
+			int style = atoi(ent->keyvalues["style"].c_str());
+			if (style >= nextStyle && style < 255) {
+				nextStyle = style + 1;
+			}
+		}
+	}
+
+	for (Entity* ent : map->ents) {
+		std::string cname = ent->keyvalues["classname"];
+
+		DirectLight light;
+		if (cname == "light") {
+			light.type = LIGHT_POINT;
+		}
+		else if (cname == "light_spot") {
+			light.type = LIGHT_SPOT;
+		}
+		else if (cname == "light_environment") {
+			light.type = LIGHT_SUN;
+		}
+		else {
+			continue;
+		}
+
+		light.origin = ent->getOrigin();
+		light.color = parse_light_color(ent);
+		light.dir = parse_light_direction(map, ent, light.origin);
+		light.style = ent->hasKey("style") ? atoi(ent->keyvalues["style"].c_str()) : 0;
+		light.fade = ent->hasKey("_fade") ? (float)atof(ent->keyvalues["_fade"].c_str()) : 1.0f;
+		if (light.fade <= 0) {
+			light.fade = 1.0f;
+		}
+
+		// hlrad gives named lights their own switchable style
+		std::string targetname = ent->hasKey("targetname") ? ent->keyvalues["targetname"] : "";
+		if (light.style == 0 && !targetname.empty() && light.type != LIGHT_SUN) {
+			if (!namedStyles.count(targetname)) {
+				namedStyles[targetname] = nextStyle++;
+			}
+			light.style = namedStyles[targetname];
+		}
+		if (light.style < 0 || light.style >= 255) {
+			logf("Skipping %s with invalid style %d\n", cname.c_str(), light.style);
+			continue;
+		}
+		if (namedStyles.count(targetname) && namedStyles[targetname] == light.style) {
+			newStyles.push_back(std::make_pair(ent, light.style));
+		}
+
+		float cone = ent->hasKey("_cone") ? (float)atof(ent->keyvalues["_cone"].c_str()) : DEFAULT_SPOT_CONE;
+		float cone2 = ent->hasKey("_cone2") ? (float)atof(ent->keyvalues["_cone2"].c_str()) : cone;
+		if (cone <= 0) {
+			cone = DEFAULT_SPOT_CONE;
+		}
+		cone2 = std::max(cone, cone2);
+		light.stopdot = cosf(cone * (PI / 180.0f));
+		light.stopdot2 = cosf(cone2 * (PI / 180.0f));
+
+		float maxIntensity = std::max(light.color.x, std::max(light.color.y, light.color.z));
+		light.rangeSq = maxIntensity * LIGHT_REFERENCE_DIST * LIGHT_REFERENCE_DIST / light.fade;
+
+		if (maxIntensity > 0) {
+			lights.push_back(light);
+		}
+	}
+
+	if (nextStyle > 255) {
+		logf("Too many named lights. Styles above 254 are skipped.\n");
+	}
+}
+
+// returns the contents of the first solid or sky leaf between start and end, or CONTENTS_EMPTY
+static int trace_line(Bsp* map, int iNode, const vec3& start, const vec3& end) {
+	while (iNode >= 0) {
+		BSPNODE& node = map->nodes[iNode];
+		BSPPLANE& plane = map->planes[node.iPlane];
+
+		float front = dotProduct(plane.vNormal, start) - plane.fDist;
+		float back = dotProduct(plane.vNormal, end) - plane.fDist;
+
+		if (front >= -ON_EPSILON && back >= -ON_EPSILON) {
+			iNode = node.iChildren[0];
+			continue;
+		}
+		if (front < ON_EPSILON && back < ON_EPSILON) {
+			iNode = node.iChildren[1];
+			continue;
+		}
+
+		int side = front < 0;
+		vec3 mid = start + (end - start) * (front / (front - back));
+
+		int contents = trace_line(map, node.iChildren[side], start, mid);
+		if (contents != CONTENTS_EMPTY) {
+			return contents;
+		}
+		return trace_line(map, node.iChildren[!side], mid, end);
+	}
+
+	int contents = map->leaves[~iNode].nContents;
+	return (contents == CONTENTS_SOLID || contents == CONTENTS_SKY) ? contents : CONTENTS_EMPTY;
+}
+
+// luxel sample positions in world space. Luxels that aren't on the face use the nearest one that is.
+static bool calc_luxel_positions(Bsp* map, int faceIdx, const vec3& offset, lightinfo_t& l,
+	std::vector<unsigned char>& flags, std::vector<vec3>& positions)
+{
+	int w = l.texsize[0] + 1;
+	int h = l.texsize[1] + 1;
+
+	matrix_t worldtotex, textoworld;
+	TranslateWorldToTex(map, faceIdx, worldtotex);
+	if (!InvertMatrix(worldtotex, textoworld)) {
+		return false;
+	}
+
+	flags.resize(w * h);
+	positions.resize(w * h);
+	CalcPoints(map, &l, &flags[0]);
+
+	BSPPLANE plane = getPlaneFromFace(map, l.face);
+	vec3 surfaceOffset = offset + plane.vNormal * LUXEL_SURFACE_OFFSET;
+
+	for (int t = 0; t < h; t++) {
+		for (int s = 0; s < w; s++) {
+			vec3_t tex = { (l.texmins[0] + s) * (float)TEXTURE_STEP, (l.texmins[1] + t) * (float)TEXTURE_STEP, 0 };
+			vec3_t world;
+			ApplyMatrix(textoworld, tex, world);
+			positions[t * w + s] = vec3(world[0], world[1], world[2]) + surfaceOffset;
+		}
+	}
+
+	bool anyInside = false;
+	for (int i = 0; i < w * h && !anyInside; i++) {
+		anyInside = flags[i] == LightNormal;
+	}
+
+	if (!anyInside) {
+		// tiny or degenerate face. Light everything from the center of the face.
+		Winding winding(map, *l.face);
+		vec3 center;
+		for (unsigned int i = 0; i < winding.m_NumPoints; i++) {
+			center += vec3(winding.m_Points[i][0], winding.m_Points[i][1], winding.m_Points[i][2]);
+		}
+		if (winding.m_NumPoints) {
+			center = center * (1.0f / winding.m_NumPoints);
+		}
+		for (int i = 0; i < w * h; i++) {
+			positions[i] = center + surfaceOffset;
+		}
+		return true;
+	}
+
+	for (int t = 0; t < h; t++) {
+		for (int s = 0; s < w; s++) {
+			if (flags[t * w + s] == LightNormal) {
+				continue;
+			}
+
+			int bestDist = INT_MAX;
+			int best = 0;
+			for (int t2 = 0; t2 < h; t2++) {
+				for (int s2 = 0; s2 < w; s2++) {
+					int dist = (s2 - s) * (s2 - s) + (t2 - t) * (t2 - t);
+					if (flags[t2 * w + s2] == LightNormal && dist < bestDist) {
+						bestDist = dist;
+						best = t2 * w + s2;
+					}
+				}
+			}
+			positions[t * w + s] = positions[best];
+		}
+	}
+
+	return true;
+}
+
+static StyleLayer* get_style_layer(std::vector<StyleLayer>& layers, int style, int luxelCount) {
+	for (StyleLayer& layer : layers) {
+		if (layer.style == style) {
+			return &layer;
+		}
+	}
+	if (layers.size() >= MAXLIGHTMAPS) {
+		return NULL;
+	}
+
+	layers.push_back(StyleLayer());
+	layers.back().style = style;
+	layers.back().light.assign(luxelCount, vec3());
+	return &layers.back();
+}
+
+static void light_face(Bsp* map, const vec3& offset, const std::vector<DirectLight>& lights,
+	std::vector<vec3>& positions, const BSPPLANE& plane, std::vector<StyleLayer>& layers, int& droppedStyles)
+{
+	int luxelCount = (int)positions.size();
+	int headnode = map->models[0].iHeadnodes[0];
+	vec3 normal = plane.vNormal;
+	float planeDist = plane.fDist + dotProduct(normal, offset);
+
+	// bounding sphere of the samples, for skipping lights that can't reach the face
+	vec3 mins = positions[0];
+	vec3 maxs = positions[0];
+	for (int i = 1; i < luxelCount; i++) {
+		expandBoundingBox(positions[i], mins, maxs);
+	}
+	vec3 center = (mins + maxs) * 0.5f;
+	float radius = (maxs - mins).length() * 0.5f;
+
+	get_style_layer(layers, 0, luxelCount);
+
+	for (const DirectLight& light : lights) {
+		if (light.type == LIGHT_SUN) {
+			if (dotProduct(normal, light.dir) >= 0) {
+				continue; // facing away from the sun
+			}
+		}
+		else {
+			if (dotProduct(normal, light.origin) - planeDist <= 0) {
+				continue; // behind the face
+			}
+			float reach = sqrtf(light.rangeSq) + radius;
+			if ((light.origin - center).length() > reach) {
+				continue;
+			}
+		}
+
+		StyleLayer* layer = get_style_layer(layers, light.style, luxelCount);
+		if (!layer) {
+			droppedStyles++;
+			continue;
+		}
+
+		for (int i = 0; i < luxelCount; i++) {
+			const vec3& pos = positions[i];
+
+			if (light.type == LIGHT_SUN) {
+				float dot = -dotProduct(normal, light.dir);
+				vec3 skyPos = pos - light.dir * SUN_TRACE_DIST;
+				if (trace_line(map, headnode, pos, skyPos) == CONTENTS_SKY) {
+					layer->light[i] += light.color * dot;
+				}
+				continue;
+			}
+
+			vec3 delta = light.origin - pos;
+			float distSq = dotProduct(delta, delta);
+			if (distSq > light.rangeSq) {
+				continue;
+			}
+
+			float dist = sqrtf(distSq);
+			vec3 dir = dist > 0 ? delta * (1.0f / dist) : normal;
+			float dot = dotProduct(normal, dir);
+			if (dot <= 0) {
+				continue;
+			}
+
+			float scale = dot * (LIGHT_REFERENCE_DIST * LIGHT_REFERENCE_DIST) / (std::max(distSq, 1.0f) * light.fade);
+
+			if (light.type == LIGHT_SPOT) {
+				float dot2 = -dotProduct(dir, light.dir);
+				if (dot2 <= light.stopdot2) {
+					continue;
+				}
+				if (dot2 <= light.stopdot && light.stopdot > light.stopdot2) {
+					scale *= (dot2 - light.stopdot2) / (light.stopdot - light.stopdot2);
+				}
+			}
+
+			if (trace_line(map, headnode, pos, light.origin) == CONTENTS_EMPTY) {
+				layer->light[i] += light.color * scale;
+			}
+		}
+	}
+
+	// switchable styles that don't reach any luxel aren't needed
+	for (int i = (int)layers.size() - 1; i > 0; i--) {
+		bool lit = false;
+		for (int k = 0; k < luxelCount && !lit; k++) {
+			const vec3& c = layers[i].light[k];
+			lit = c.x >= 0.5f || c.y >= 0.5f || c.z >= 0.5f;
+		}
+		if (!lit) {
+			layers.erase(layers.begin() + i);
+		}
+	}
+}
+
+static COLOR3 luxel_color(vec3 light) {
+	light.x = powf(std::max(light.x, 0.0f) / 255.0f, LIGHT_GAMMA) * 255.0f;
+	light.y = powf(std::max(light.y, 0.0f) / 255.0f, LIGHT_GAMMA) * 255.0f;
+	light.z = powf(std::max(light.z, 0.0f) / 255.0f, LIGHT_GAMMA) * 255.0f;
+
+	// scale down colors that are too bright instead of clamping, so the hue doesn't change
+	float maxChannel = std::max(light.x, std::max(light.y, light.z));
+	if (maxChannel > 255.0f) {
+		light = light * (255.0f / maxChannel);
+	}
+
+	return COLOR3((unsigned char)(light.x + 0.5f), (unsigned char)(light.y + 0.5f), (unsigned char)(light.z + 0.5f));
+}
+
+bool bake_direct_lighting(Bsp* map) {
+	std::vector<DirectLight> lights;
+	std::vector<std::pair<Entity*, int>> newStyles;
+	load_lights(map, lights, newStyles);
+
+	if (lights.empty()) {
+		logf("Can't bake lighting: the map has no lights\n");
+		return false;
+	}
+
+	// brush entity faces are lit where the entity is placed
+	std::vector<vec3> faceOffsets(map->faceCount);
+	for (Entity* ent : map->ents) {
+		int modelIdx = ent->getBspModelIdx();
+		if (modelIdx <= 0 || modelIdx >= (int)map->modelCount || !ent->hasKey("origin")) {
+			continue;
+		}
+		BSPMODEL& model = map->models[modelIdx];
+		vec3 origin = ent->getOrigin();
+		for (int i = model.iFirstFace; i < model.iFirstFace + model.nFaces && i < (int)map->faceCount; i++) {
+			faceOffsets[i] = origin;
+		}
+	}
+
+	logf("Baking %d lights onto %d faces\n", (int)lights.size(), map->faceCount);
+	g_progress.update("Baking direct lighting", 0);
+
+	std::vector<unsigned char> faceStyles(map->faceCount * MAXLIGHTMAPS, 255);
+	std::vector<std::vector<COLOR3>> faceLightmaps(map->faceCount);
+	std::atomic<int> droppedStyles(0);
+	std::atomic<int> keptFaces(0);
+
+	parallelFor(map->faceCount, [&](int start, int end) {
+		// reused between faces
+		std::vector<unsigned char> flags;
+		std::vector<vec3> positions;
+		std::vector<StyleLayer> layers;
+		int dropped = 0;
+
+		for (int i = start; i < end; i++) {
+			BSPFACE& face = map->faces[i];
+			if (map->texinfos[face.iTextureInfo].nFlags & TEX_SPECIAL) {
+				continue;
+			}
+
+			int size[2];
+			GetFaceLightmapSize(map, i, size);
+
+			lightinfo_t l;
+			memset(&l, 0, sizeof(l));
+			l.surfnum = i;
+			l.face = &face;
+			CalcFaceExtents(map, &l);
+
+			if (l.texsize[0] + 1 != size[0] || l.texsize[1] + 1 != size[1]) {
+				// luxels can't be placed like the game expects, so keep the old lighting instead of going black
+				int sz = GetFaceLightmapSizeBytes(map, i);
+				if (face.nStyles[0] != 255 && sz > 0 && map->lightmap_in_bounds(i, sz)) {
+					const COLOR3* src = (const COLOR3*)(map->lightdata + face.nLightmapOffset);
+					faceLightmaps[i].assign(src, src + sz / sizeof(COLOR3));
+					memcpy(&faceStyles[i * MAXLIGHTMAPS], face.nStyles, MAXLIGHTMAPS);
+					keptFaces++;
+				}
+				continue;
+			}
+
+			int luxelCount = size[0] * size[1];
+			layers.clear();
+
+			if (calc_luxel_positions(map, i, faceOffsets[i], l, flags, positions)) {
+				light_face(map, faceOffsets[i], lights, positions, getPlaneFromFace(map, &face), layers, dropped);
+			}
+			else {
+				get_style_layer(layers, 0, luxelCount); // unlit
+			}
+
+			std::vector<COLOR3>& lightmap = faceLightmaps[i];
+			lightmap.resize(luxelCount * layers.size());
+			for (int s = 0; s < (int)layers.size(); s++) {
+				faceStyles[i * MAXLIGHTMAPS + s] = layers[s].style;
+				for (int k = 0; k < luxelCount; k++) {
+					lightmap[s * luxelCount + k] = luxel_color(layers[s].light[k]);
+				}
+			}
+		}
+
+		droppedStyles += dropped;
+	}, 4);
+
+	// lightmaps are written in face order, so the lump is the same no matter how many threads are used
+	size_t lightDataSz = 0;
+	for (unsigned int i = 0; i < map->faceCount; i++) {
+		lightDataSz += faceLightmaps[i].size() * sizeof(COLOR3);
+	}
+
+	g_progress.clear();
+
+	if (lightDataSz > MAX_MAP_LIGHTDATA) {
+		logf("Can't bake lighting: %.2f MB of lightmaps is over the %.2f MB limit\n",
+			lightDataSz / (1024.0f * 1024.0f), MAX_MAP_LIGHTDATA / (1024.0f * 1024.0f));
+		return false;
+	}
+
+	unsigned char* newLightData = new unsigned char[lightDataSz];
+	int offset = 0;
+	for (unsigned int i = 0; i < map->faceCount; i++) {
+		BSPFACE& face = map->faces[i];
+		std::vector<COLOR3>& lightmap = faceLightmaps[i];
+
+		memcpy(face.nStyles, &faceStyles[i * MAXLIGHTMAPS], MAXLIGHTMAPS);
+
+		if (lightmap.empty()) {
+			face.nLightmapOffset = -1;
+			continue;
+		}
+
+		int sz = (int)(lightmap.size() * sizeof(COLOR3));
+		memcpy(newLightData + offset, &lightmap[0], sz);
+		face.nLightmapOffset = offset;
+		offset += sz;
+	}
+
+	map->replace_lump(LUMP_LIGHTING, newLightData, lightDataSz);
+
+	// unlit faces all have the same black lightmaps
+	map->deduplicate_lightmaps();
+
+	// the game only switches a style if the light entity uses it
+	for (auto& newStyle : newStyles) {
+		newStyle.first->setOrAddKeyvalue("style", std::to_string(newStyle.second));
+	}
+	if (!newStyles.empty()) {
+		map->update_ent_lump();
+		logf("Assigned switchable styles to %d named lights\n", (int)newStyles.size());
+	}
+
+	if (keptFaces) {
+		logf("%d faces kept their old lighting because their extents don't match their lightmaps\n", keptFaces.load());
+	}
+	if (droppedStyles) {
+		logf("%d face lights were skipped because the faces already have %d styles\n", droppedStyles.load(), MAXLIGHTMAPS);
+	}
+
+	return true;
+}
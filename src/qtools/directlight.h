@@ -0,0 +1,15 @@
+#pragma once
+
+class Bsp;
+
+// Replaces the lighting lump with direct light from light, light_spot, and light_environment
+// entities. This is a quick preview, not a replacement for hlrad: there are no bounces, no sky
+// diffuse light, no texture lights, and only the world model casts shadows. Luxels are placed with
+// the same CalcFaceExtents/CalcPoints code that hlrad uses, so lightmap sizes don't change.
+//
+// Point and spot lights fall off with the inverse square of the distance, scaled so that a light is
+// at full brightness 128 units away. Faces are lit in parallel.
+// Named lights without a style get new switchable styles after the highest style the map uses, like
+// hlrad assigns them. The styles are saved to the light entities.
+// Returns false if the map has no lights or the new lighting would be too large.
+bool bake_direct_lighting(Bsp* map);
@@ -0,0 +1,468 @@
+#include "portalvis.h"
+#include "vis.h"
+#include "Bsp.h"
+#include <atomic>
+
+#define PORTAL_EPSILON 0.04f
+#define MAX_POINTS_ON_PORTAL 128
+
+// one-way portal out of a leaf
+struct VisPortal
+{
+	std::vector<vec3> points;
+	vec3 normal; // faces into the destination leaf
+	float dist;
+	vec3 center;
+	float radius;
+	int leaf; // destination
+	int owner; // leaf that the portal leads out of
+};
+
+struct PortalFragment
+{
+	int leaf;
+	std::vector<vec3> points;
+};
+
+static inline float dot3(const vec3& a, const vec3& b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static std::vector<vec3> base_portal_winding(const vec3& normal, float dist, float size) {
+	// pick an up vector that isn't parallel to the plane normal
+	vec3 up = fabs(normal.z) > fabs(normal.x) && fabs(normal.z) > fabs(normal.y) ? vec3(1, 0, 0) : vec3(0, 0, 1);
+	up = (up - normal * dot3(up, normal)).normalize();
+	vec3 right = crossProduct(up, normal);
+
+	vec3 org = normal * dist;
+	up = up * size;
+	right = right * size;
+
+	std::vector<vec3> points;
+	points.push_back(org - right + up);
+	points.push_back(org + right + up);
+	points.push_back(org + right - up);
+	points.push_back(org - right - up);
+	return points;
+}
+
+// splits a polygon by a plane. Returns false if every point is on the plane.
+static bool split_portal_winding(const std::vector<vec3>& points, const vec3& normal, float dist,
+	std::vector<vec3>& front, std::vector<vec3>& back)
+{
+	front.clear();
+	back.clear();
+
+	int count = (int)points.size();
+	float dists[MAX_POINTS_ON_PORTAL + 1];
+	int sides[MAX_POINTS_ON_PORTAL + 1];
+	int numFront = 0;
+	int numBack = 0;
+
+	if (count > MAX_POINTS_ON_PORTAL) {
+		// too complex to split. Keeping it on both sides is conservative.
+		front = points;
+		back = points;
+		return true;
+	}
+
+	for (int i = 0; i < count; i++) {
+		dists[i] = dot3(points[i], normal) - dist;
+		sides[i] = dists[i] > PORTAL_EPSILON ? 1 : (dists[i] < -PORTAL_EPSILON ? -1 : 0);
+		numFront += sides[i] == 1;
+		numBack += sides[i] == -1;
+	}
+
+	if (!numFront && !numBack) {
+		return false;
+	}
+	if (!numBack) {
+		front = points;
+		return true;
+	}
+	if (!numFront) {
+		back = points;
+		return true;
+	}
+
+	for (int i = 0; i < count; i++) {
+		const vec3& p1 = points[i];
+
+		if (sides[i] == 0) {
+			front.push_back(p1);
+			back.push_back(p1);
+			continue;
+		}
+		(sides[i] == 1 ? front : back).push_back(p1);
+
+		int next = (i + 1) % count;
+		if (sides[next] == 0 || sides[next] == sides[i]) {
+			continue;
+		}
+
+		const vec3& p2 = points[next];
+		float t = dists[i] / (dists[i] - dists[next]);
+		vec3 mid = p1 + (p2 - p1) * t;
+		front.push_back(mid);
+		back.push_back(mid);
+	}
+
+	return true;
+}
+
+// keeps the part of a polygon that is in front of the plane
+static void clip_portal_winding(std::vector<vec3>& points, const vec3& normal, float dist) {
+	std::vector<vec3> front, back;
+	if (!split_portal_winding(points, normal, dist, front, back)) {
+		return; // on the plane. Shouldn't happen with a valid tree.
+	}
+	points.swap(front);
+}
+
+// pushes a polygon down the tree and collects the pieces that end up in each leaf.
+// sideNormal decides which side a polygon goes to if it's on a node's plane.
+static void find_portal_leaves(Bsp* map, int iNode, const std::vector<vec3>& points, const vec3& sideNormal,
+	std::vector<PortalFragment>& fragments)
+{
+	if (points.size() < 3) {
+		return;
+	}
+
+	if (iNode < 0) {
+		PortalFragment frag;
+		frag.leaf = ~iNode;
+		frag.points = points;
+		fragments.push_back(frag);
+		return;
+	}
+
+	BSPNODE& node = map->nodes[iNode];
+	BSPPLANE& plane = map->planes[node.iPlane];
+
+	std::vector<vec3> front, back;
+	if (!split_portal_winding(points, plane.vNormal, plane.fDist, front, back)) {
+		int child = dot3(plane.vNormal, sideNormal) > 0 ? 0 : 1;
+		find_portal_leaves(map, node.iChildren[child], points, sideNormal, fragments);
+		return;
+	}
+
+	find_portal_leaves(map, node.iChildren[0], front, sideNormal, fragments);
+	find_portal_leaves(map, node.iChildren[1], back, sideNormal, fragments);
+}
+
+static bool is_open_leaf(Bsp* map, int leafIdx, int worldLeaves) {
+	if (leafIdx <= 0 || leafIdx > worldLeaves) {
+		return false;
+	}
+	int contents = map->leaves[leafIdx].nContents;
+	return contents != CONTENTS_SOLID && contents != CONTENTS_SKY;
+}
+
+static void add_portal(std::vector<VisPortal>& portals, const std::vector<vec3>& points, const vec3& normal, float dist,
+	int owner, int leaf)
+{
+	VisPortal portal;
+	portal.points = points;
+	portal.normal = normal;
+	portal.dist = dist;
+	portal.owner = owner;
+	portal.leaf = leaf;
+
+	vec3 center;
+	for (const vec3& p : points) {
+		center += p;
+	}
+	center /= (float)points.size();
+
+	float radius = 0;
+	for (const vec3& p : points) {
+		radius = std::max(radius, (p - center).length());
+	}
+
+	portal.center = center;
+	portal.radius = radius;
+	portals.push_back(portal);
+}
+
+// creates portals for every pair of open world leaves that touch
+static std::vector<VisPortal> build_leaf_portals(Bsp* map, int worldLeaves) {
+	std::vector<VisPortal> portals;
+	int headNode = map->models[0].iHeadnodes[0];
+	if (headNode < 0 || headNode >= (int)map->nodeCount) {
+		return portals;
+	}
+
+	// find node parents, so that each node can be clipped by its ancestors on its own thread
+	std::vector<int> parents(map->nodeCount, -1);
+	std::vector<char> parentSides(map->nodeCount, 0);
+	std::vector<char> visited(map->nodeCount, 0);
+	std::vector<int> worldNodes;
+	std::vector<int> stack;
+	stack.push_back(headNode);
+	visited[headNode] = 1;
+	while (!stack.empty()) {
+		int iNode = stack.back();
+		stack.pop_back();
+		worldNodes.push_back(iNode);
+
+		for (int k = 0; k < 2; k++) {
+			int child = map->nodes[iNode].iChildren[k];
+			if (child >= 0 && child < (int)map->nodeCount && !visited[child]) {
+				visited[child] = 1;
+				parents[child] = iNode;
+				parentSides[child] = (char)k;
+				stack.push_back(child);
+			}
+		}
+	}
+
+	// everything is clipped to the world bounds, so the base windings don't need to be huge
+	vec3 mins = map->models[0].nMins - vec3(64, 64, 64);
+	vec3 maxs = map->models[0].nMaxs + vec3(64, 64, 64);
+	float size = 0;
+	for (int i = 0; i < 3; i++) {
+		size = std::max(size, (float)std::max(fabs(mins[i]), fabs(maxs[i])));
+	}
+	size *= 2.0f;
+
+	std::vector<std::vector<VisPortal>> nodePortals(worldNodes.size());
+
+	parallelFor((int)worldNodes.size(), [&](int start, int end) {
+		std::vector<PortalFragment> frontFrags, backFrags;
+
+		for (int i = start; i < end; i++) {
+			int iNode = worldNodes[i];
+			BSPNODE& node = map->nodes[iNode];
+			BSPPLANE& plane = map->planes[node.iPlane];
+
+			std::vector<vec3> points = base_portal_winding(plane.vNormal, plane.fDist, size);
+
+			for (int k = 0; k < 3 && points.size() >= 3; k++) {
+				vec3 axis(k == 0 ? 1.0f : 0.0f, k == 1 ? 1.0f : 0.0f, k == 2 ? 1.0f : 0.0f);
+				clip_portal_winding(points, axis, mins[k]);
+				clip_portal_winding(points, vec3(-axis.x, -axis.y, -axis.z), -maxs[k]);
+			}
+
+			for (int c = iNode; parents[c] != -1 && points.size() >= 3; c = parents[c]) {
+				BSPPLANE& parentPlane = map->planes[map->nodes[parents[c]].iPlane];
+				if (parentSides[c] == 0) {
+					clip_portal_winding(points, parentPlane.vNormal, parentPlane.fDist);
+				}
+				else {
+					vec3 n = parentPlane.vNormal;
+					clip_portal_winding(points, vec3(-n.x, -n.y, -n.z), -parentPlane.fDist);
+				}
+			}
+
+			if (points.size() < 3) {
+				continue;
+			}
+
+			vec3 normal = plane.vNormal;
+			vec3 backNormal = vec3(-normal.x, -normal.y, -normal.z);
+
+			frontFrags.clear();
+			find_portal_leaves(map, node.iChildren[0], points, normal, frontFrags);
+
+			for (PortalFragment& front : frontFrags) {
+				if (!is_open_leaf(map, front.leaf, worldLeaves)) {
+					continue;
+				}
+
+				backFrags.clear();
+				find_portal_leaves(map, node.iChildren[1], front.points, backNormal, backFrags);
+
+				for (PortalFragment& back : backFrags) {
+					if (!is_open_leaf(map, back.leaf, worldLeaves)) {
+						continue;
+					}
+					// the front leaf is on the front side of the plane, so its portal faces backwards
+					add_portal(nodePortals[i], back.points, backNormal, -plane.fDist, front.leaf, back.leaf);
+					add_portal(nodePortals[i], back.points, normal, plane.fDist, back.leaf, front.leaf);
+				}
+			}
+		}
+	}, 16);
+
+	for (int i = 0; i < (int)nodePortals.size(); i++) {
+		portals.insert(portals.end(), nodePortals[i].begin(), nodePortals[i].end());
+	}
+
+	return portals;
+}
+
+// true if any point of the portal is in front of the plane
+static bool portal_has_front(const VisPortal& portal, const vec3& normal, float dist) {
+	float d = dot3(portal.center, normal) - dist;
+	if (d - portal.radius > PORTAL_EPSILON) {
+		return true;
+	}
+	if (d + portal.radius <= PORTAL_EPSILON) {
+		return false;
+	}
+	for (const vec3& p : portal.points) {
+		if (dot3(p, normal) - dist > PORTAL_EPSILON) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// true if any point of the portal is behind the plane
+static bool portal_has_back(const VisPortal& portal, const vec3& normal, float dist) {
+	float d = dot3(portal.center, normal) - dist;
+	if (d + portal.radius < -PORTAL_EPSILON) {
+		return true;
+	}
+	if (d - portal.radius >= -PORTAL_EPSILON) {
+		return false;
+	}
+	for (const vec3& p : portal.points) {
+		if (dot3(p, normal) - dist < -PORTAL_EPSILON) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool build_approximate_vis(Bsp* map, const std::vector<bool>* updateLeaves) {
+	int worldLeaves = map->modelCount > 0 ? map->models[0].nVisLeafs : 0;
+	worldLeaves = std::min(worldLeaves, (int)map->leafCount - 1);
+	if (worldLeaves <= 0) {
+		logf("Can't build VIS: the map has no world leaves\n");
+		return false;
+	}
+
+	int visLeafCount = map->leafCount - 1;
+	int rowSize = ((visLeafCount + 63) & ~63) >> 3;
+	int rowWords = rowSize / 8;
+
+	std::vector<VisPortal> portals = build_leaf_portals(map, worldLeaves);
+	int portalCount = (int)portals.size();
+	int portalWords = (portalCount + 63) / 64;
+
+	std::vector<std::vector<int>> leafPortals(map->leafCount);
+	for (int i = 0; i < portalCount; i++) {
+		leafPortals[portals[i].owner].push_back(i);
+	}
+
+	// rows are recalculated for leaves that have portals. Isolated leaves keep their old rows.
+	std::vector<int> updateList;
+	std::vector<int> updateSlot(map->leafCount, -1);
+	for (int i = 1; i <= worldLeaves; i++) {
+		if ((!updateLeaves || (*updateLeaves)[i]) && !leafPortals[i].empty()) {
+			updateSlot[i] = (int)updateList.size();
+			updateList.push_back(i);
+		}
+	}
+
+	logf("Created %d portals. Flooding %d leaves\n", portalCount / 2, (int)updateList.size());
+
+	std::vector<uint64_t> newRows((size_t)updateList.size() * rowWords);
+
+	parallelFor((int)updateList.size(), [&](int start, int end) {
+		std::vector<uint64_t> portalSee(portalWords);
+		std::vector<char> flooded(worldLeaves + 1, 0);
+		std::vector<int> stack;
+		std::vector<int> floodedLeaves;
+
+		for (int u = start; u < end; u++) {
+			int leafIdx = updateList[u];
+			uint64_t* row = &newRows[(size_t)u * rowWords];
+			row[(leafIdx - 1) >> 6] |= 1ULL << ((leafIdx - 1) & 63);
+
+			for (int p : leafPortals[leafIdx]) {
+				const VisPortal& portal = portals[p];
+
+				// portals that could be seen through this one are in front of it, and face away from it
+				memset(&portalSee[0], 0, portalWords * sizeof(uint64_t));
+				for (int t = 0; t < portalCount; t++) {
+					const VisPortal& other = portals[t];
+					if (t == p || !portal_has_front(other, portal.normal, portal.dist)
+						|| !portal_has_back(portal, other.normal, other.dist)) {
+						continue;
+					}
+					portalSee[t >> 6] |= 1ULL << (t & 63);
+				}
+
+				// everything reachable through those portals might be visible
+				stack.clear();
+				stack.push_back(portal.leaf);
+				flooded[portal.leaf] = 1;
+				floodedLeaves.clear();
+				while (!stack.empty()) {
+					int leaf = stack.back();
+					stack.pop_back();
+					floodedLeaves.push_back(leaf);
+					row[(leaf - 1) >> 6] |= 1ULL << ((leaf - 1) & 63);
+
+					for (int t : leafPortals[leaf]) {
+						int dest = portals[t].leaf;
+						if (!flooded[dest] && (portalSee[t >> 6] & (1ULL << (t & 63)))) {
+							flooded[dest] = 1;
+							stack.push_back(dest);
+						}
+					}
+				}
+				for (int leaf : floodedLeaves) {
+					flooded[leaf] = 0;
+				}
+			}
+		}
+	}, 4);
+
+	// leaves that weren't updated can see the updated leaves that see them
+	std::vector<std::vector<int>> seenBy;
+	if (updateLeaves) {
+		seenBy.resize(worldLeaves + 1);
+		for (int u = 0; u < (int)updateList.size(); u++) {
+			const uint64_t* row = &newRows[(size_t)u * rowWords];
+			for (int i = 0; i < worldLeaves; i++) {
+				if (row[i >> 6] & (1ULL << (i & 63))) {
+					seenBy[i + 1].push_back(updateList[u]);
+				}
+			}
+		}
+	}
+
+	bool hasVis = map->visDataLength > 0;
+	std::vector<int> visOffsets(worldLeaves);
+
+	VisLumpWriter visWriter;
+	visWriter.addRows(worldLeaves, rowSize, [&](int i, unsigned char* row) {
+		int leafIdx = i + 1;
+		if (updateSlot[leafIdx] != -1) {
+			memcpy(row, &newRows[(size_t)updateSlot[leafIdx] * rowWords], rowSize);
+			return;
+		}
+
+		BSPLEAF& leaf = map->leaves[leafIdx];
+		if (hasVis || leaf.nVisOffset < 0) {
+			decompress_vis_row(leaf, map->visdata, row, worldLeaves, visLeafCount, visLeafCount);
+		}
+		else {
+			// no vis data = everything is visible
+			BSPLEAF allVisible = leaf;
+			allVisible.nVisOffset = -1;
+			decompress_vis_row(allVisible, map->visdata, row, worldLeaves, visLeafCount, visLeafCount);
+		}
+
+		if (updateLeaves) {
+			for (int other : seenBy[leafIdx]) {
+				row[(other - 1) >> 3] |= 1 << ((other - 1) & 7);
+			}
+		}
+	}, &visOffsets[0]);
+
+	if (visWriter.size() > MAX_MAP_VISDATA) {
+		logf("Can't build VIS: the new VIS data would be too large (%d bytes)\n", visWriter.size());
+		return false;
+	}
+
+	for (int i = 0; i < worldLeaves; i++) {
+		map->leaves[i + 1].nVisOffset = visOffsets[i];
+	}
+	map->replace_lump(LUMP_VISIBILITY, visWriter.copyData(), visWriter.size());
+
+	return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+class Bsp;
+
+// Generates an approximate PVS for the world leaves, without needing hlvis. Portals between leaves
+// are cut from the world node tree, then each leaf floods through the portals that could possibly
+// be seen through the portals it started from (the same test as "hlvis -fast"). The result is
+// conservative: leaves may be marked visible when they aren't, but never the other way around.
+//
+// updateLeaves (indexed by leaf) limits which rows are recalculated. Other rows are kept and get
+// bits added for the updated leaves that can see them. NULL updates every world leaf.
+// Leaves without any portals (e.g. sky or solid) keep their old rows.
+// Returns false if the map has no world leaves, or the new vis data would be too large.
+bool build_approximate_vis(Bsp* map, const std::vector<bool>* updateLeaves = NULL);
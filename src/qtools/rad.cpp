@@ -197,44 +197,29 @@ bool CanFindFacePosition(Bsp* bsp, int facenum)
 	return true;
 }
 
-static bool TestSampleFrag(Bsp* bsp, int facenum, vec_t s, vec_t t, const vec_t square[2][2], int maxsize)
+// texwinding = face winding in texture space, shared by every sample of the face
+static bool TestSampleFrag(const Winding& texwinding, vec_t s, vec_t t, const vec_t square[2][2])
 {
 	const vec3_t v_s = { s, 0, 0 };
 	const vec3_t v_t = { 0, t, 0 };
 
-	samplefrag_t head;
+	samplefragrect_t rect;
 
-	head.facenum = facenum;
-
-	VectorScale(v_s, 1, (vec_t*)&head.rect.planes[0].vNormal); head.rect.planes[0].fDist = square[0][0]; // smin
-	VectorScale(v_s, -1, (vec_t*)&head.rect.planes[1].vNormal); head.rect.planes[1].fDist = -square[1][0]; // smax
-	VectorScale(v_t, 1, (vec_t*)&head.rect.planes[2].vNormal); head.rect.planes[2].fDist = square[0][1]; // tmin
-	VectorScale(v_t, -1, (vec_t*)&head.rect.planes[3].vNormal); head.rect.planes[3].fDist = -square[1][1]; // tmax
+	VectorScale(v_s, 1, (vec_t*)&rect.planes[0].vNormal); rect.planes[0].fDist = square[0][0]; // smin
+	VectorScale(v_s, -1, (vec_t*)&rect.planes[1].vNormal); rect.planes[1].fDist = -square[1][0]; // smax
+	VectorScale(v_t, 1, (vec_t*)&rect.planes[2].vNormal); rect.planes[2].fDist = square[0][1]; // tmin
+	VectorScale(v_t, -1, (vec_t*)&rect.planes[3].vNormal); rect.planes[3].fDist = -square[1][1]; // tmax
 
 	// ChopFrag
 	// get the shape of the fragment by clipping the face using the boundaries
-	matrix_t worldtotex;
-	BSPFACE* f = &bsp->faces[head.facenum];
-	Winding facewinding(bsp, *f);
-
-	TranslateWorldToTex(bsp, head.facenum, worldtotex);
-	head.mywinding = new Winding(facewinding.m_NumPoints);
-	for (unsigned int x = 0; x < facewinding.m_NumPoints; x++)
-	{
-		ApplyMatrix(worldtotex, facewinding.m_Points[x], head.mywinding->m_Points[x]);
-		head.mywinding->m_Points[x][2] = 0.0;
-	}
-	head.mywinding->RemoveColinearPoints();
+	Winding frag(texwinding);
 
-	for (int x = 0; x < 4 && head.mywinding->m_NumPoints > 0; x++)
+	for (int x = 0; x < 4 && frag.m_NumPoints > 0; x++)
 	{
-		head.mywinding->Clip(head.rect.planes[x], false);
+		frag.Clip(rect.planes[x], false);
 	}
 
-	bool hasPoints = head.mywinding->m_NumPoints != 0;
-	delete head.mywinding;
-
-	return hasPoints && CanFindFacePosition(bsp, head.facenum);
+	return frag.m_NumPoints != 0;
 }
 
 float CalculatePointVecsProduct(const volatile float* point, const volatile float* vecs)
@@ -426,11 +411,31 @@ void CalcPoints(Bsp* bsp, lightinfo_t* l, unsigned char* LuxelFlags)
 	const vec_t     startt = l->texmins[1] * TEXTURE_STEP * 1.0f;
 	unsigned char* pLuxelFlags;
 
+	// these only depend on the face, so they're calculated once instead of for every sample
+	bool canFindPosition = CanFindFacePosition(bsp, facenum);
+
+	matrix_t worldtotex;
+	TranslateWorldToTex(bsp, facenum, worldtotex);
+
+	Winding facewinding(bsp, *f);
+	Winding texwinding(facewinding.m_NumPoints);
+	for (unsigned int x = 0; x < facewinding.m_NumPoints; x++)
+	{
+		ApplyMatrix(worldtotex, facewinding.m_Points[x], texwinding.m_Points[x]);
+		texwinding.m_Points[x][2] = 0.0;
+	}
+	texwinding.RemoveColinearPoints();
+
 	for (int t = 0; t < h; t++)
 	{
 		for (int s = 0; s < w; s++)
 		{
 			pLuxelFlags = &LuxelFlags[s + w * t];
+			if (!canFindPosition)
+			{
+				*pLuxelFlags = LightOutside;
+				continue;
+			}
 			vec_t us = starts + s * TEXTURE_STEP * 1.0f;
 			vec_t ut = startt + t * TEXTURE_STEP * 1.0f;
 			vec_t square[2][2];
@@ -439,7 +444,7 @@ void CalcPoints(Bsp* bsp, lightinfo_t* l, unsigned char* LuxelFlags)
 			square[1][0] = us + TEXTURE_STEP;
 			square[1][1] = ut + TEXTURE_STEP;
 
-			*pLuxelFlags = (unsigned char)(TestSampleFrag(bsp, l->surfnum, us, ut, square, 100) ? LightNormal : LightOutside);
+			*pLuxelFlags = (unsigned char)(TestSampleFrag(texwinding, us, ut, square) ? LightNormal : LightOutside);
 		}
 	}
 
@@ -112,6 +112,10 @@ void qrad_get_lightmap_flags(Bsp* bsp, int faceIdx, unsigned char* luxelFlagsOut
 
 const BSPPLANE getPlaneFromFace(Bsp* bsp, const BSPFACE* const face);
 
+void ApplyMatrix(const matrix_t& m, const vec3_t in, vec3_t& out);
+bool InvertMatrix(const matrix_t& m, matrix_t& m_inverse);
+void TranslateWorldToTex(Bsp* bsp, int facenum, matrix_t& m);
+
 bool GetFaceLightmapSize(Bsp* bsp, int facenum, int size[2]);
 int GetFaceLightmapSizeBytes(Bsp* bsp, int facenum);
 void GetFaceExtents(Bsp* bsp, int facenum, int mins_out[2], int maxs_out[2]);
@@ -1,5 +1,14 @@
 #include "vis.h"
 #include "Bsp.h"
+#include <algorithm>
+#include <bitset>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VIS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VIS_SSE2
+#endif
 
 bool g_debug_shift = false;
 
@@ -25,116 +34,111 @@ void printVisRow(unsigned char* vis, int len, int offsetLeaf, int mask) {
 	logf("\n");
 }
 
+// reads/writes 64 leaves of a vis row at once. Rows are little-endian bit arrays (leaf 0 is bit 0 of
+// byte 0), which matches the word layout on little-endian CPUs. Words past the end of the row read as 0.
+static inline uint64_t loadVisWord(const unsigned char* vis, int len, int wordIdx) {
+	int byteIdx = wordIdx * 8;
+	if (wordIdx < 0 || byteIdx >= len)
+		return 0;
+
+	uint64_t word = 0;
+	memcpy(&word, vis + byteIdx, std::min(8, len - byteIdx));
+	return word;
+}
+
+static inline void storeVisWord(unsigned char* vis, int len, int wordIdx, uint64_t word) {
+	int byteIdx = wordIdx * 8;
+	memcpy(vis + byteIdx, &word, std::min(8, len - byteIdx));
+}
+
+static inline int countBits(uint64_t word) {
+	return (int)std::bitset<64>(word).count();
+}
+
 bool shiftVis(unsigned char* vis, int len, int offsetLeaf, int shift) {
-	if (shift == 0)
+	if (shift == 0 || len <= 0)
 		return false;
 
-	unsigned char bitsPerStep = 8;
-	unsigned char offsetBit = offsetLeaf % bitsPerStep;
-	unsigned char mask = 0; // part of the unsigned char that shouldn't be shifted
-	for (int i = 0; i < offsetBit; i++) {
-		mask |= 1 << i;
-	}
+	int numBits = len * 8;
+	if (offsetLeaf >= numBits)
+		return false;
 
-	int byteShifts = abs(shift) / 8;
-	int bitShifts = abs(shift) % 8;
+	unsigned char mask = (1 << (offsetLeaf % 8)) - 1; // part of the offset byte that shouldn't be shifted
 
-	// shift until offsetLeaf isn't sharing a unsigned char with the leaves that come before it
-	// then we can do a much faster memcpy on the section that needs to be shifted
-	if ((offsetLeaf % 8) + bitShifts < 8 && byteShifts > 0) {
-		byteShifts -= 1;
-		bitShifts += 8;
+	if (g_debug_shift) {
+		logf("\nSHIFT %d\n", shift);
+		logf(" in = ");
+		printVisRow(vis, len, offsetLeaf, mask);
 	}
 
-	if (shift < 0) {
-		// TODO: memcpy for negative shifts
-		bitShifts += byteShifts * 8;
-		byteShifts = 0;
-	}
+	int wordCount = (len + 7) / 8;
+	int offsetWord = offsetLeaf / 64;
+	uint64_t keepMask = (offsetLeaf % 64) ? (~0ULL >> (64 - (offsetLeaf % 64))) : 0; // bits below offsetLeaf
 
-	if (g_debug_shift) {
-		logf("\nSHIFT\n");
-	}
+	// source word with the leaves before offsetLeaf cleared, so they aren't moved
+	auto loadShifted = [&](int wordIdx) {
+		if (wordIdx < offsetWord)
+			return (uint64_t)0;
+		uint64_t word = loadVisWord(vis, len, wordIdx);
+		return wordIdx == offsetWord ? word & ~keepMask : word;
+	};
 
+	// bits that fall off the end of the row, or below offsetLeaf for negative shifts, are lost
 	int overflow = 0;
-	for (int k = 0; k < bitShifts; k++) {
+	int lostStart = shift > 0 ? std::max(offsetLeaf, numBits - shift) : offsetLeaf;
+	int lostEnd = shift > 0 ? numBits : std::min(numBits, offsetLeaf - shift);
+	for (int w = lostStart / 64; w * 64 < lostEnd; w++) {
+		uint64_t word = loadVisWord(vis, len, w);
+		int lo = std::max(lostStart - w * 64, 0);
+		int hi = std::min(lostEnd - w * 64, 64);
+		uint64_t rangeMask = (hi - lo == 64) ? ~0ULL : (((1ULL << (hi - lo)) - 1) << lo);
+		overflow += countBits(word & rangeMask);
+	}
 
-		if (g_debug_shift) {
-			logf("%2d = ", k);
-			printVisRow(vis, len, offsetLeaf, mask);
-		}
+	// each output word is a funnel shift of the two source words it overlaps. Positive shifts read
+	// from lower words, so the row is written from the end and no temp buffer is needed.
+	int wordShift = (shift > 0 ? shift : -shift) / 64;
+	int bitShift = (shift > 0 ? shift : -shift) % 64;
 
+	auto shiftedWord = [&](int w) {
 		if (shift > 0) {
-			bool carry = 0;
-			for (int i = 0; i < len; i++) {
-				unsigned int oldCarry = carry;
-				carry = (vis[i] & 0x80) != 0;
-
-				if (offsetBit != 0 && i * bitsPerStep < offsetLeaf && i * bitsPerStep + bitsPerStep > offsetLeaf) {
-					vis[i] = (vis[i] & mask) | ((vis[i] & ~mask) << 1);
-				}
-				else if (i >= offsetLeaf / bitsPerStep) {
-					vis[i] = (vis[i] << 1) + oldCarry;
-				}
-				else {
-					carry = 0;
-				}
-			}
-
-			if (carry) {
-				overflow++;
-			}
+			uint64_t hi = loadShifted(w - wordShift);
+			uint64_t lo = loadShifted(w - wordShift - 1);
+			return bitShift ? (hi << bitShift) | (lo >> (64 - bitShift)) : hi;
 		}
-		else {
-			bool carry = 0;
-			for (int i = len - 1; i >= 0; i--) {
-				unsigned int oldCarry = carry;
-				carry = (vis[i] & 0x01) != 0;
-
-				if (offsetBit != 0 && i * bitsPerStep < offsetLeaf && i * bitsPerStep + bitsPerStep > offsetLeaf) {
-					vis[i] = (vis[i] & mask) | ((vis[i] >> 1) & ~mask) | (oldCarry << 7);
-				}
-				else if (i >= offsetLeaf / bitsPerStep) {
-					vis[i] = (vis[i] >> 1) + (oldCarry << 7);
-				}
-				else {
-					carry = 0;
-				}
-			}
-
-			if (carry) {
-				overflow++;
-			}
+		uint64_t lo = loadShifted(w + wordShift);
+		uint64_t hi = loadShifted(w + wordShift + 1);
+		return bitShift ? (lo >> bitShift) | (hi << (64 - bitShift)) : lo;
+	};
+
+	auto outputWord = [&](int w) {
+		uint64_t word = shiftedWord(w);
+		if (w == offsetWord) {
+			word = (loadVisWord(vis, len, w) & keepMask) | (word & ~keepMask);
 		}
+		return word;
+	};
 
-		if (g_debug_shift && k == bitShifts - 1) {
-			logf("%2d = ", k + 1);
-			printVisRow(vis, len, offsetLeaf, mask);
+	if (shift > 0) {
+		for (int w = wordCount - 1; w >= offsetWord; w--) {
+			storeVisWord(vis, len, w, outputWord(w));
 		}
 	}
-	if (overflow)
-		logf("OVERFLOWED %d VIS LEAVES WHILE SHIFTING\n", overflow);
-
-
-	if (byteShifts > 0) {
-		// TODO: detect overflows here too
-		static unsigned char temp[MAX_MAP_LEAVES / 8];
-
-		if (shift > 0) {
-			int startByte = (offsetLeaf + bitShifts) / 8;
-			int moveSize = len - (startByte + byteShifts);
-
-			memcpy(temp, (unsigned char*)vis + startByte, moveSize);
-			memset((unsigned char*)vis + startByte, 0, byteShifts);
-			memcpy((unsigned char*)vis + startByte + byteShifts, temp, moveSize);
-		}
-		else {
-			// TODO LOL
+	else {
+		for (int w = offsetWord; w < wordCount; w++) {
+			storeVisWord(vis, len, w, outputWord(w));
 		}
+	}
 
+	if (g_debug_shift) {
+		logf("out = ");
+		printVisRow(vis, len, offsetLeaf, mask);
 	}
 
-	return overflow;
+	if (overflow)
+		logf("OVERFLOWED %d VIS LEAVES WHILE SHIFTING\n", overflow);
+
+	return overflow != 0;
 }
 
 // decompress this map's vis data into arrays of bits where each bit indicates if a leaf is visible or not
@@ -144,10 +148,21 @@ bool shiftVis(unsigned char* vis, int len, int offsetLeaf, int shift) {
 void decompress_vis_lump(BSPLEAF* leafLump, unsigned char* visLump, unsigned char* output,
 	int iterationLeaves, int visDataLeafCount, int newNumLeaves)
 {
-	unsigned char* dest;
+	int newVisRowSize = ((newNumLeaves + 63) & ~63) >> 3;
+
+	// rows don't depend on each other
+	parallelFor(iterationLeaves, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			decompress_vis_row(leafLump[i + 1], visLump, output + i * newVisRowSize, iterationLeaves, visDataLeafCount, newNumLeaves);
+		}
+	}, 64);
+}
+
+void decompress_vis_row(const BSPLEAF& leaf, const unsigned char* visLump, unsigned char* dest,
+	int iterationLeaves, int visDataLeafCount, int newNumLeaves)
+{
 	int oldVisRowSize = ((visDataLeafCount + 63) & ~63) >> 3;
 	int newVisRowSize = ((newNumLeaves + 63) & ~63) >> 3;
-	int len = 0;
 
 	// calculate which bits of an uncompressed visibility row are used/unused
 	unsigned char lastChunkMask = 0;
@@ -156,47 +171,174 @@ void decompress_vis_lump(BSPLEAF* leafLump, unsigned char* visLump, unsigned cha
 		lastChunkMask = lastChunkMask | (1 << k);
 	}
 
-	for (int i = 0; i < iterationLeaves; i++)
-	{
-		g_progress.tick();
-		dest = output + i * newVisRowSize;
-		if (lastUsedIdx >= 0)
-		{
-			if (leafLump[i + 1].nVisOffset < 0) {
-				memset(dest, 255, lastUsedIdx);
-				dest[lastUsedIdx] |= lastChunkMask;
-				continue;
-			}
+	if (leaf.nVisOffset < 0) {
+		memset(dest, 255, lastUsedIdx);
+		dest[lastUsedIdx] |= lastChunkMask;
+		return;
+	}
+
+	DecompressVis(visLump + leaf.nVisOffset, dest, oldVisRowSize, visDataLeafCount);
 
-			DecompressVis((const unsigned char*)(visLump + leafLump[i + 1].nVisOffset), dest, oldVisRowSize, visDataLeafCount);
+	// Leaf visibility row lengths are multiples of 64 leaves, so there are usually some unused bits at the end.
+	// Maps sometimes set those unused bits randomly (e.g. leaf index 100 is marked visible, but there are only 90 leaves...)
+	// Leaves for submodels also don't matter and can be set to 0 to save space during recompression.
+	if (lastUsedIdx < newVisRowSize) {
+		dest[lastUsedIdx] &= lastChunkMask;
+		memset(dest + lastUsedIdx + 1, 0, newVisRowSize - (lastUsedIdx + 1));
+	}
+}
+
+int VisLumpWriter::addRow(const unsigned char* row, int rowSize) {
+	if ((int)compressed.size() < rowSize * 2 + 2) {
+		compressed.resize(rowSize * 2 + 2); // worst case is a zero run for every other byte
+	}
+
+	int compressedLen = (int)CompressVis(row, rowSize, &compressed[0], (unsigned int)compressed.size());
+
+	return addCompressedRow(&compressed[0], compressedLen);
+}
 
-			// Leaf visibility row lengths are multiples of 64 leaves, so there are usually some unused bits at the end.
-			// Maps sometimes set those unused bits randomly (e.g. leaf index 100 is marked visible, but there are only 90 leaves...)
-			// Leaves for submodels also don't matter and can be set to 0 to save space during recompression.
-			if (lastUsedIdx < newVisRowSize) {
-				dest[lastUsedIdx] &= lastChunkMask;
-				int sz = newVisRowSize - (lastUsedIdx + 1);
-				int last = lastUsedIdx + 1 + sz;
-				memset(dest + lastUsedIdx + 1, 0, sz);
+void VisLumpWriter::addRows(int count, int rowSize, const std::function<void(int i, unsigned char* row)>& getRow, int* offsets) {
+	// rows are decompressed and compressed in parallel, one batch at a time so that only a batch of
+	// compressed rows is held in memory. Rows are then added in order so the lump is the same as when
+	// adding them one at a time.
+	int batchSize = getThreadCount() * 256;
+	std::vector<std::vector<unsigned char>> batch(std::min(batchSize, count));
+
+	for (int batchStart = 0; batchStart < count; batchStart += batchSize) {
+		int batchCount = std::min(batchSize, count - batchStart);
+
+		parallelFor(batchCount, [&](int start, int end) {
+			std::vector<unsigned char> row(rowSize);
+			std::vector<unsigned char> rowCompressed(rowSize * 2 + 2);
+
+			for (int i = start; i < end; i++) {
+				memset(&row[0], 0, rowSize);
+				getRow(batchStart + i, &row[0]);
+				int len = (int)CompressVis(&row[0], rowSize, &rowCompressed[0], (unsigned int)rowCompressed.size());
+				batch[i].assign(rowCompressed.begin(), rowCompressed.begin() + len);
 			}
+		}, 16);
+
+		for (int i = 0; i < batchCount; i++) {
+			offsets[batchStart + i] = addCompressedRow(batch[i].empty() ? NULL : &batch[i][0], (int)batch[i].size());
+			g_progress.tick();
 		}
-		else {
-			logf("Overflow decompressing VIS lump!");
-			return;
+	}
+}
+
+int VisLumpWriter::addCompressedRow(const unsigned char* rowData, int len) {
+	std::vector<int>& candidates = rowOffsets[hashBytes(rowData, len)];
+	for (int offset : candidates) {
+		if (offset + len <= (int)data.size() && memcmp(&data[offset], rowData, len) == 0) {
+			sharedRows++;
+			sharedBytes += len;
+			return offset;
 		}
 	}
+
+	int offset = (int)data.size();
+	candidates.push_back(offset);
+	data.insert(data.end(), rowData, rowData + len);
+
+	return offset;
+}
+
+unsigned char* VisLumpWriter::copyData() const {
+	unsigned char* copy = new unsigned char[data.size()];
+	if (data.size())
+		memcpy(copy, &data[0], data.size());
+	return copy;
 }
 
 //
 // BEGIN COPIED QVIS CODE
 //
 
+static inline int lowestSetBit(unsigned int mask) {
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, mask);
+	return (int)idx;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// returns the index of the first byte in [start, end) that is zero (findZero) or non-zero (!findZero),
+// or end if there isn't one. Blocks of 16/32 bytes are checked at once. Only bytes before end are read.
+static inline unsigned int findVisByte(const unsigned char* data, unsigned int start, unsigned int end, bool findZero) {
+	unsigned int i = start;
+#if defined(VIS_AVX2)
+	const __m256i zero = _mm256_setzero_si256();
+	for (; i + 32 <= end; i += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+		unsigned int zeroMask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+		unsigned int mask = findZero ? zeroMask : ~zeroMask;
+		if (mask)
+			return i + lowestSetBit(mask);
+	}
+#elif defined(VIS_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= end; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+		unsigned int zeroMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+		unsigned int mask = findZero ? zeroMask : (~zeroMask & 0xffff);
+		if (mask)
+			return i + lowestSetBit(mask);
+	}
+#else
+	for (; i + 8 <= end; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		bool found = findZero ? ((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL) != 0 : word != 0;
+		if (found)
+			break;
+	}
+#endif
+	for (; i < end; i++) {
+		if ((data[i] == 0) == findZero)
+			return i;
+	}
+	return end;
+}
+
+int CompressedVisRowLength(const unsigned char* src, const unsigned char* srcEnd, unsigned int numLeaves)
+{
+	// follows the same steps as DecompressVis without writing the row
+	unsigned int row = (numLeaves + 7) >> 3;
+	unsigned int outLen = 0;
+	const unsigned char* start = src;
+
+	while (outLen < row)
+	{
+		if (src >= srcEnd)
+			return -1;
+
+		if (*src)
+		{
+			unsigned int c = findVisByte(src, 0, std::min(row - outLen, (unsigned int)(srcEnd - src)), true);
+			outLen += c;
+			src += c;
+			continue;
+		}
+
+		if (src + 1 >= srcEnd)
+			return -1;
+
+		outLen += src[1];
+		src += 2;
+	}
+
+	return (int)(src - start);
+}
+
 void DecompressVis(const unsigned char* src, unsigned char* const dest, const unsigned int dest_length, unsigned int numLeaves)
 {
 	unsigned int    current_length = 0;
-	int             c;
+	unsigned int    c;
 	unsigned char* out;
-	int             row;
+	unsigned int    row;
 
 	row = (numLeaves + 7) >> 3; // same as the length used by VIS program in CompressVis
 	// The wrong size will cause DecompressVis to spend extremely long time once the source pointer runs into the invalid area in g_dvisdata (for example, in BuildFaceLights, some faces could hang for a few seconds), and sometimes to crash.
@@ -207,33 +349,32 @@ void DecompressVis(const unsigned char* src, unsigned char* const dest, const un
 		//hlassume(src - g_dvisdata < g_visdatasize, assume_DECOMPRESSVIS_OVERFLOW);
 		if (*src)
 		{
-			current_length++;
+			// copy all visible bytes up to the next zero run. Each one fills an output byte, so the
+			// search doesn't read past the end of the row data.
+			c = findVisByte(src, 0, row - (unsigned int)(out - dest), true);
+			current_length += c;
 			hlassume(current_length <= dest_length, assume_DECOMPRESSVIS_OVERFLOW);
+			if (current_length > dest_length)
+				return;
 
-			*out = *src;
-			out++;
-			src++;
+			memcpy(out, src, c);
+			out += c;
+			src += c;
 			continue;
 		}
 
 		//hlassume(&src[1] - g_dvisdata < g_visdatasize, assume_DECOMPRESSVIS_OVERFLOW);
-		c = src[1];
+		c = std::min((unsigned int)src[1], row - (unsigned int)(out - dest));
 		src += 2;
-		while (c)
-		{
-			current_length++;
-			hlassume(current_length <= dest_length, assume_DECOMPRESSVIS_OVERFLOW);
 
-			*out = 0;
-			out++;
-			c--;
+		current_length += c;
+		hlassume(current_length <= dest_length, assume_DECOMPRESSVIS_OVERFLOW);
+		if (current_length > dest_length)
+			return;
 
-			if (out - dest >= row)
-			{
-				return;
-			}
-		}
-	} while (out - dest < row);
+		memset(out, 0, c);
+		out += c;
+	} while ((unsigned int)(out - dest) < row);
 }
 
 int64_t CompressVis(const unsigned char* const src, const unsigned int src_length, unsigned char* dest, unsigned int dest_length)
@@ -255,25 +396,16 @@ int64_t CompressVis(const unsigned char* const src, const unsigned int src_lengt
 			continue;
 		}
 
-		unsigned char   rep = 1;
+		// zero runs are stored as a 0 followed by the run length (max 255)
+		unsigned int runEnd = findVisByte(src, j + 1, std::min(src_length, j + 255), false);
+		unsigned char   rep = (unsigned char)(runEnd - j);
 
-		for (j++; j < src_length; j++)
-		{
-			if (src[j] || rep == 255)
-			{
-				break;
-			}
-			else
-			{
-				rep++;
-			}
-		}
 		current_length++;
 		hlassume(current_length <= dest_length, assume_COMPRESSVIS_OVERFLOW);
 
 		*dest_p = rep;
 		dest_p++;
-		j--;
+		j = runEnd - 1;
 	}
 
 	return dest_p - dest;
@@ -281,60 +413,75 @@ int64_t CompressVis(const unsigned char* const src, const unsigned int src_lengt
 
 int64_t CompressAll(BSPLEAF* leafs, unsigned char* uncompressed, unsigned char* output, int numLeaves, int iterLeaves, int bufferSize)
 {
-	int64_t x = 0;
-	unsigned char* dest;
-	unsigned char* src;
-	unsigned char compressed[MAX_MAP_LEAVES / 8];
 	unsigned int g_bitbytes = ((numLeaves + 63) & ~63) >> 3;
 
-	unsigned char* vismap_p = output;
+	// identical rows share the first copy. Rows are grouped by hash so each row is only compared
+	// against earlier rows that are likely to match.
+	std::vector<unsigned int> rowHashes(iterLeaves);
+	parallelFor(iterLeaves, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			rowHashes[i] = hashBytes(uncompressed + i * g_bitbytes, g_bitbytes);
+		}
+	}, 64);
 
 	int* sharedRows = new int[iterLeaves];
+	std::unordered_map<unsigned int, std::vector<int>> hashRows;
 	for (int i = 0; i < iterLeaves; i++) {
-		src = uncompressed + i * g_bitbytes;
+		unsigned char* src = uncompressed + i * g_bitbytes;
 
 		sharedRows[i] = i;
-		for (int k = 0; k < i; k++) {
-			if (sharedRows[k] != k) {
-				continue; // already compared in an earlier row
-			}
+		std::vector<int>& candidates = hashRows[rowHashes[i]];
+		for (int k : candidates) {
 			unsigned char* previous = uncompressed + k * g_bitbytes;
 			if (memcmp(src, previous, g_bitbytes) == 0) {
 				sharedRows[i] = k;
 				break;
 			}
 		}
+		if (sharedRows[i] == i) {
+			candidates.push_back(i);
+		}
 		g_progress.tick();
 	}
 
-	for (int i = 0; i < iterLeaves; i++)
-	{
-		if (sharedRows[i] != i) {
-			leafs[i + 1].nVisOffset = leafs[sharedRows[i] + 1].nVisOffset;
-			continue;
-		}
-
-		memset(&compressed, 0, sizeof(compressed));
+	// compress rows in parallel into separate buffers
+	std::vector<std::vector<unsigned char>> compressedRows(iterLeaves);
+	parallelFor(iterLeaves, [&](int start, int end) {
+		std::vector<unsigned char> compressed(g_bitbytes * 2 + 2);
 
-		src = uncompressed + i * g_bitbytes;
-
-		// Compress all leafs into global compression buffer
-		x = CompressVis(src, g_bitbytes, compressed, sizeof(compressed));
-
-		dest = vismap_p;
-		vismap_p += x;
-
-		if (vismap_p > output + bufferSize)
-		{
-			logf("Vismap expansion overflow\n");
+		for (int i = start; i < end; i++) {
+			if (sharedRows[i] != i) {
+				continue;
+			}
+			int64_t len = CompressVis(uncompressed + i * g_bitbytes, g_bitbytes, &compressed[0], (unsigned int)compressed.size());
+			compressedRows[i].assign(compressed.begin(), compressed.begin() + len);
 		}
+	}, 64);
 
-		leafs[i + 1].nVisOffset = (int)( dest - output );            // leaf 0 is a common solid
+	// row offsets are a prefix sum of the compressed row sizes
+	std::vector<int64_t> rowOffsets(iterLeaves);
+	int64_t visLen = 0;
+	for (int i = 0; i < iterLeaves; i++) {
+		rowOffsets[i] = visLen;
+		visLen += compressedRows[i].size();
+	}
 
-		memcpy(dest, compressed, x);
+	if (visLen > bufferSize)
+	{
+		logf("Vismap expansion overflow\n");
+		delete[] sharedRows;
+		return -1;
 	}
 
+	parallelFor(iterLeaves, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			if (compressedRows[i].size())
+				memcpy(output + rowOffsets[i], &compressedRows[i][0], compressedRows[i].size());
+			leafs[i + 1].nVisOffset = (int)rowOffsets[sharedRows[i]]; // leaf 0 is a common solid
+		}
+	}, 64);
+
 	delete[] sharedRows;
 
-	return vismap_p - output;
+	return visLen;
 }
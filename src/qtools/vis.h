@@ -1,7 +1,14 @@
+#pragma once
 #include "util.h"
+#include <functional>
+#include <unordered_map>
+#include <vector>
 
 struct BSPLEAF;
 
+// moves the bits of a vis row at or after offsetLeaf by shift bits (negative = toward leaf 0).
+// Bits before offsetLeaf are left alone and vacated bits are cleared. Returns true if any visible
+// leaves were shifted out of the row, or below offsetLeaf. Safe to call from multiple threads.
 bool shiftVis(unsigned char* vis, int len, int offsetLeaf, int shift);
 
 // decompress the given vis data into arrays of bits where each bit indicates if a leaf is visible or not
@@ -11,10 +18,54 @@ bool shiftVis(unsigned char* vis, int len, int offsetLeaf, int shift);
 void decompress_vis_lump(BSPLEAF* leafLump, unsigned char* visLump, unsigned char* output,
 	int iterationLeaves, int visDataLeafCount, int newNumLeaves);
 
+// decompresses the vis row of a single leaf into dest (newNumLeaves bits, rounded up like decompress_vis_lump)
+void decompress_vis_row(const BSPLEAF& leaf, const unsigned char* visLump, unsigned char* dest,
+	int iterationLeaves, int visDataLeafCount, int newNumLeaves);
+
+// returns the number of bytes in a compressed row of numLeaves leaves, or -1 if the row would read
+// past srcEnd
+int CompressedVisRowLength(const unsigned char* src, const unsigned char* srcEnd, unsigned int numLeaves);
+
 void DecompressVis(const unsigned char* src, unsigned char* const dest, const unsigned int dest_length, unsigned int numLeaves);
 
 int64_t CompressVis(const unsigned char* const src, const unsigned int src_length, unsigned char* dest, unsigned int dest_length);
 
+// compresses the rows of the first iterLeaves leaves into output and sets their vis offsets.
+// Returns the vis lump size, or -1 if it doesn't fit in bufferSize.
 int64_t CompressAll(BSPLEAF* leafs, unsigned char* uncompressed, unsigned char* output, int numLeaves, int iterLeaves, int bufferSize);
 
-extern bool g_debug_shift;
\ No newline at end of file
+extern bool g_debug_shift;
+
+// Builds a compressed vis lump one row at a time, so the decompressed vis matrix never has to be
+// held in memory. Rows that compress to the same bytes are stored once and share an offset, which
+// gives the same lump as CompressAll.
+class VisLumpWriter
+{
+public:
+	// compresses a decompressed row of rowSize bytes and returns the offset of its compressed data
+	int addRow(const unsigned char* row, int rowSize);
+
+	// adds rows [0, count) and stores their offsets in offsets. Rows are compressed in parallel.
+	// getRow(i, row) fills the decompressed row i (rowSize bytes, zeroed before the call) and is
+	// called from worker threads. g_progress is ticked once per row.
+	void addRows(int count, int rowSize, const std::function<void(int i, unsigned char* row)>& getRow, int* offsets);
+
+	int size() const { return (int)data.size(); }
+
+	// rows that reused an earlier copy, and the bytes that would have been written for them
+	int getSharedRows() const { return sharedRows; }
+	int getSharedBytes() const { return sharedBytes; }
+
+	// adds a row that is already compressed and returns its offset
+	int addCompressedRow(const unsigned char* rowData, int len);
+
+	// returns a copy of the lump allocated with new[], for Bsp::replace_lump
+	unsigned char* copyData() const;
+
+private:
+	std::vector<unsigned char> data;
+	std::unordered_map<unsigned int, std::vector<int>> rowOffsets; // compressed row hash -> offsets
+	std::vector<unsigned char> compressed;
+	int sharedRows = 0;
+	int sharedBytes = 0;
+};
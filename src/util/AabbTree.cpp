@@ -0,0 +1,280 @@
+#include "AabbTree.h"
+#include <algorithm>
+
+AabbTree::AabbTree() {
+	root = AABB_NULL_NODE;
+	freeList = AABB_NULL_NODE;
+	proxyCount = 0;
+}
+
+static inline void combineBoxes(const AabbNode& a, const AabbNode& b, vec3& mins, vec3& maxs) {
+	mins = vec3(std::min(a.mins.x, b.mins.x), std::min(a.mins.y, b.mins.y), std::min(a.mins.z, b.mins.z));
+	maxs = vec3(std::max(a.maxs.x, b.maxs.x), std::max(a.maxs.y, b.maxs.y), std::max(a.maxs.z, b.maxs.z));
+}
+
+static inline float boxArea(const vec3& mins, const vec3& maxs) {
+	vec3 d = maxs - mins;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+int AabbTree::allocNode() {
+	if (freeList == AABB_NULL_NODE) {
+		AabbNode node;
+		node.parent = AABB_NULL_NODE;
+		node.height = -1;
+		nodes.push_back(node);
+		freeList = (int)nodes.size() - 1;
+	}
+
+	int nodeId = freeList;
+	AabbNode& node = nodes[nodeId];
+	freeList = node.parent;
+	node.parent = AABB_NULL_NODE;
+	node.child[0] = node.child[1] = AABB_NULL_NODE;
+	node.height = 0;
+	node.userData = -1;
+	return nodeId;
+}
+
+void AabbTree::freeNode(int nodeId) {
+	nodes[nodeId].parent = freeList;
+	nodes[nodeId].height = -1;
+	freeList = nodeId;
+}
+
+void AabbTree::clear() {
+	nodes.clear();
+	root = AABB_NULL_NODE;
+	freeList = AABB_NULL_NODE;
+	proxyCount = 0;
+}
+
+int AabbTree::insert(const vec3& mins, const vec3& maxs, int userData) {
+	int proxyId = allocNode();
+	AabbNode& node = nodes[proxyId];
+	node.mins = mins - AABB_FAT_MARGIN;
+	node.maxs = maxs + AABB_FAT_MARGIN;
+	node.userData = userData;
+
+	insertLeaf(proxyId);
+	proxyCount++;
+	return proxyId;
+}
+
+void AabbTree::remove(int proxyId) {
+	if (proxyId < 0 || proxyId >= (int)nodes.size() || nodes[proxyId].height != 0) {
+		return;
+	}
+	removeLeaf(proxyId);
+	freeNode(proxyId);
+	proxyCount--;
+}
+
+bool AabbTree::update(int proxyId, const vec3& mins, const vec3& maxs) {
+	AabbNode& node = nodes[proxyId];
+
+	if (node.mins.x <= mins.x && node.mins.y <= mins.y && node.mins.z <= mins.z &&
+		node.maxs.x >= maxs.x && node.maxs.y >= maxs.y && node.maxs.z >= maxs.z) {
+		// still inside the fat box. Shrink it only if the box got much smaller.
+		vec3 fatSize = node.maxs - node.mins;
+		vec3 newSize = maxs - mins;
+		float slack = AABB_FAT_MARGIN * 4.0f;
+		if (fatSize.x - newSize.x < slack && fatSize.y - newSize.y < slack && fatSize.z - newSize.z < slack) {
+			return false;
+		}
+	}
+
+	removeLeaf(proxyId);
+	node.mins = mins - AABB_FAT_MARGIN;
+	node.maxs = maxs + AABB_FAT_MARGIN;
+	insertLeaf(proxyId);
+	return true;
+}
+
+void AabbTree::insertLeaf(int leaf) {
+	if (root == AABB_NULL_NODE) {
+		root = leaf;
+		nodes[root].parent = AABB_NULL_NODE;
+		return;
+	}
+
+	// find the best sibling using the surface area heuristic
+	int index = root;
+	while (!nodes[index].isLeaf()) {
+		const AabbNode& node = nodes[index];
+		int c0 = node.child[0];
+		int c1 = node.child[1];
+
+		vec3 mins, maxs;
+		float area = boxArea(node.mins, node.maxs);
+		combineBoxes(node, nodes[leaf], mins, maxs);
+		float combinedArea = boxArea(mins, maxs);
+
+		float cost = 2.0f * combinedArea;
+		float inheritanceCost = 2.0f * (combinedArea - area);
+
+		float childCost[2];
+		for (int i = 0; i < 2; i++) {
+			const AabbNode& child = nodes[node.child[i]];
+			combineBoxes(child, nodes[leaf], mins, maxs);
+			childCost[i] = boxArea(mins, maxs) + inheritanceCost;
+			if (!child.isLeaf()) {
+				childCost[i] -= boxArea(child.mins, child.maxs);
+			}
+		}
+
+		if (cost < childCost[0] && cost < childCost[1]) {
+			break;
+		}
+
+		index = childCost[0] < childCost[1] ? c0 : c1;
+	}
+
+	int sibling = index;
+	int oldParent = nodes[sibling].parent;
+	int newParent = allocNode();
+	combineBoxes(nodes[sibling], nodes[leaf], nodes[newParent].mins, nodes[newParent].maxs);
+	nodes[newParent].parent = oldParent;
+	nodes[newParent].height = nodes[sibling].height + 1;
+	nodes[newParent].child[0] = sibling;
+	nodes[newParent].child[1] = leaf;
+	nodes[sibling].parent = newParent;
+	nodes[leaf].parent = newParent;
+
+	if (oldParent != AABB_NULL_NODE) {
+		AabbNode& parent = nodes[oldParent];
+		parent.child[parent.child[0] == sibling ? 0 : 1] = newParent;
+	}
+	else {
+		root = newParent;
+	}
+
+	refitParents(nodes[leaf].parent);
+}
+
+void AabbTree::removeLeaf(int leaf) {
+	if (leaf == root) {
+		root = AABB_NULL_NODE;
+		return;
+	}
+
+	int parent = nodes[leaf].parent;
+	int grandParent = nodes[parent].parent;
+	int sibling = nodes[parent].child[0] == leaf ? nodes[parent].child[1] : nodes[parent].child[0];
+
+	if (grandParent != AABB_NULL_NODE) {
+		AabbNode& gp = nodes[grandParent];
+		gp.child[gp.child[0] == parent ? 0 : 1] = sibling;
+		nodes[sibling].parent = grandParent;
+		freeNode(parent);
+		refitParents(grandParent);
+	}
+	else {
+		root = sibling;
+		nodes[sibling].parent = AABB_NULL_NODE;
+		freeNode(parent);
+	}
+	nodes[leaf].parent = AABB_NULL_NODE;
+}
+
+void AabbTree::refitParents(int nodeId) {
+	while (nodeId != AABB_NULL_NODE) {
+		nodeId = balance(nodeId);
+
+		AabbNode& node = nodes[nodeId];
+		const AabbNode& c0 = nodes[node.child[0]];
+		const AabbNode& c1 = nodes[node.child[1]];
+		node.height = 1 + std::max(c0.height, c1.height);
+		combineBoxes(c0, c1, node.mins, node.maxs);
+
+		nodeId = node.parent;
+	}
+}
+
+// Rotates the subtree if one child is more than 1 level taller than the other.
+// Returns the index of the node that replaced nodeId.
+int AabbTree::balance(int iA) {
+	AabbNode& A = nodes[iA];
+	if (A.isLeaf() || A.height < 2) {
+		return iA;
+	}
+
+	int iB = A.child[0];
+	int iC = A.child[1];
+	int diff = nodes[iC].height - nodes[iB].height;
+
+	if (diff > 1 || diff < -1) {
+		// promote the taller child
+		int iUp = diff > 1 ? iC : iB;
+		int iSide = diff > 1 ? iB : iC;
+		AabbNode& Up = nodes[iUp];
+		int iF = Up.child[0];
+		int iG = Up.child[1];
+
+		Up.child[0] = iA;
+		Up.parent = A.parent;
+		A.parent = iUp;
+
+		if (Up.parent != AABB_NULL_NODE) {
+			AabbNode& p = nodes[Up.parent];
+			p.child[p.child[0] == iA ? 0 : 1] = iUp;
+		}
+		else {
+			root = iUp;
+		}
+
+		// the taller grandchild stays under Up, the other moves down to A
+		int iKeep = nodes[iF].height > nodes[iG].height ? iF : iG;
+		int iMove = iKeep == iF ? iG : iF;
+		Up.child[1] = iKeep;
+		A.child[0] = iSide;
+		A.child[1] = iMove;
+		nodes[iMove].parent = iA;
+
+		combineBoxes(nodes[iSide], nodes[iMove], A.mins, A.maxs);
+		A.height = 1 + std::max(nodes[iSide].height, nodes[iMove].height);
+		combineBoxes(A, nodes[iKeep], Up.mins, Up.maxs);
+		Up.height = 1 + std::max(A.height, nodes[iKeep].height);
+
+		return iUp;
+	}
+
+	return iA;
+}
+
+float AabbTree::rayBoxDist(const vec3& start, const vec3& invDir, const vec3& mins, const vec3& maxs, float maxDist) {
+	const float* origin = (const float*)&start;
+	const float* inv = (const float*)&invDir;
+	const float* minB = (const float*)&mins;
+	const float* maxB = (const float*)&maxs;
+	float tmin = 0.0f;
+	float tmax = maxDist;
+
+	for (int i = 0; i < 3; i++) {
+		float t1 = (minB[i] - origin[i]) * inv[i];
+		float t2 = (maxB[i] - origin[i]) * inv[i];
+
+		// NaN from 0 * inf means the ray is parallel and inside the slab
+		if (t1 != t1 || t2 != t2)
+			continue;
+
+		tmin = std::max(tmin, std::min(t1, t2));
+		tmax = std::min(tmax, std::max(t1, t2));
+		if (tmin > tmax)
+			return -1.0f;
+	}
+
+	return tmin;
+}
+
+float AabbTree::pointBoxDistSquared(const vec3& pos, const vec3& mins, const vec3& maxs) {
+	const float* p = (const float*)&pos;
+	const float* minB = (const float*)&mins;
+	const float* maxB = (const float*)&maxs;
+	float distSq = 0.0f;
+	for (int i = 0; i < 3; i++) {
+		float d = p[i] < minB[i] ? minB[i] - p[i] : (p[i] > maxB[i] ? p[i] - maxB[i] : 0.0f);
+		distSq += d * d;
+	}
+	return distSq;
+}
@@ -0,0 +1,202 @@
+#pragma once
+#include "vectors.h"
+#include <vector>
+
+#define AABB_NULL_NODE -1
+#define AABB_FAT_MARGIN 8.0f // boxes are enlarged so small moves don't need a reinsert
+
+struct AabbNode {
+	vec3 mins;
+	vec3 maxs;
+	int parent; // next free node if unused
+	int child[2];
+	int height; // 0 = leaf, -1 = unused
+	int userData;
+
+	bool isLeaf() const { return child[0] == AABB_NULL_NODE; }
+};
+
+// Dynamic bounding volume hierarchy (insert/update/remove) with ray, box, and nearest queries.
+// Leaves store a user index (e.g. entity index). The tree is kept balanced with AVL rotations,
+// so queries touch O(log n) nodes for sparse scenes.
+class AabbTree
+{
+public:
+	AabbTree();
+
+	// returns a proxy id used to update or remove the box
+	int insert(const vec3& mins, const vec3& maxs, int userData);
+	void remove(int proxyId);
+
+	// returns true if the proxy was reinserted
+	bool update(int proxyId, const vec3& mins, const vec3& maxs);
+
+	void clear();
+
+	int getUserData(int proxyId) const { return nodes[proxyId].userData; }
+	int getProxyCount() const { return proxyCount; }
+	int getHeight() const { return root == AABB_NULL_NODE ? 0 : nodes[root].height; }
+
+	// Calls callback(userData) for every leaf the ray might hit closer than maxDist.
+	// The callback may lower maxDist to skip farther boxes. Closer children are visited first.
+	template<typename Callback>
+	void rayQuery(const vec3& start, const vec3& dir, float& maxDist, Callback callback) const;
+
+	// calls callback(userData) for every leaf that intersects the box. Return false to stop.
+	template<typename Callback>
+	void boxQuery(const vec3& mins, const vec3& maxs, Callback callback) const;
+
+	// returns the userData of the leaf closest to the point (distance to its box), or -1 if none
+	// is within maxDist. filter(userData) can reject leaves.
+	template<typename Filter>
+	int nearestQuery(const vec3& pos, float maxDist, Filter filter) const;
+
+	// distance from the ray start to where it enters the box, or -1 if it misses
+	static float rayBoxDist(const vec3& start, const vec3& invDir, const vec3& mins, const vec3& maxs, float maxDist);
+	static float pointBoxDistSquared(const vec3& pos, const vec3& mins, const vec3& maxs);
+
+private:
+	std::vector<AabbNode> nodes;
+	int root;
+	int freeList;
+	int proxyCount;
+
+	int allocNode();
+	void freeNode(int nodeId);
+	void insertLeaf(int leaf);
+	void removeLeaf(int leaf);
+	int balance(int nodeId);
+	void refitParents(int nodeId);
+};
+
+template<typename Callback>
+void AabbTree::rayQuery(const vec3& start, const vec3& dir, float& maxDist, Callback callback) const {
+	if (root == AABB_NULL_NODE)
+		return;
+
+	vec3 invDir = vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+	struct StackEntry {
+		int node;
+		float dist;
+	};
+	std::vector<StackEntry> stack;
+	stack.reserve(64);
+
+	float rootDist = rayBoxDist(start, invDir, nodes[root].mins, nodes[root].maxs, maxDist);
+	if (rootDist < 0)
+		return;
+	stack.push_back({ root, rootDist });
+
+	while (!stack.empty()) {
+		StackEntry entry = stack.back();
+		stack.pop_back();
+
+		if (entry.dist > maxDist)
+			continue; // a closer hit was found after this node was pushed
+
+		const AabbNode& node = nodes[entry.node];
+		if (node.isLeaf()) {
+			callback(node.userData);
+			continue;
+		}
+
+		int c0 = node.child[0];
+		int c1 = node.child[1];
+		float d0 = rayBoxDist(start, invDir, nodes[c0].mins, nodes[c0].maxs, maxDist);
+		float d1 = rayBoxDist(start, invDir, nodes[c1].mins, nodes[c1].maxs, maxDist);
+
+		// push the farther child first so the closer one is popped next
+		if (d0 >= 0 && d1 >= 0) {
+			if (d0 < d1) {
+				stack.push_back({ c1, d1 });
+				stack.push_back({ c0, d0 });
+			}
+			else {
+				stack.push_back({ c0, d0 });
+				stack.push_back({ c1, d1 });
+			}
+		}
+		else if (d0 >= 0) {
+			stack.push_back({ c0, d0 });
+		}
+		else if (d1 >= 0) {
+			stack.push_back({ c1, d1 });
+		}
+	}
+}
+
+template<typename Callback>
+void AabbTree::boxQuery(const vec3& mins, const vec3& maxs, Callback callback) const {
+	if (root == AABB_NULL_NODE)
+		return;
+
+	std::vector<int> stack;
+	stack.reserve(64);
+	stack.push_back(root);
+
+	while (!stack.empty()) {
+		const AabbNode& node = nodes[stack.back()];
+		stack.pop_back();
+
+		if (node.maxs.x < mins.x || node.mins.x > maxs.x ||
+			node.maxs.y < mins.y || node.mins.y > maxs.y ||
+			node.maxs.z < mins.z || node.mins.z > maxs.z) {
+			continue;
+		}
+
+		if (node.isLeaf()) {
+			if (!callback(node.userData))
+				return;
+		}
+		else {
+			stack.push_back(node.child[0]);
+			stack.push_back(node.child[1]);
+		}
+	}
+}
+
+template<typename Filter>
+int AabbTree::nearestQuery(const vec3& pos, float maxDist, Filter filter) const {
+	if (root == AABB_NULL_NODE)
+		return -1;
+
+	int best = -1;
+	float bestDistSq = maxDist * maxDist;
+
+	std::vector<int> stack;
+	stack.reserve(64);
+	stack.push_back(root);
+
+	while (!stack.empty()) {
+		const AabbNode& node = nodes[stack.back()];
+		stack.pop_back();
+
+		if (pointBoxDistSquared(pos, node.mins, node.maxs) > bestDistSq)
+			continue;
+
+		if (node.isLeaf()) {
+			// leaf boxes are fattened, so the distance is slightly underestimated
+			if (filter(node.userData)) {
+				best = node.userData;
+				bestDistSq = pointBoxDistSquared(pos, node.mins, node.maxs);
+			}
+			continue;
+		}
+
+		int c0 = node.child[0];
+		int c1 = node.child[1];
+		float d0 = pointBoxDistSquared(pos, nodes[c0].mins, nodes[c0].maxs);
+		float d1 = pointBoxDistSquared(pos, nodes[c1].mins, nodes[c1].maxs);
+		if (d0 < d1) {
+			stack.push_back(c1);
+			stack.push_back(c0);
+		}
+		else {
+			stack.push_back(c0);
+			stack.push_back(c1);
+		}
+	}
+
+	return best;
+}
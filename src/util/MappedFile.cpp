@@ -0,0 +1,102 @@
+#include "MappedFile.h"
+#include "util.h"
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+#ifdef WIN32
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		logf("Failed to open %s\n", path.c_str());
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		logf("Failed to map %s (empty file)\n", path.c_str());
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		logf("Failed to map %s\n", path.c_str());
+		CloseHandle(file);
+		return false;
+	}
+
+	data = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		logf("Failed to map %s\n", path.c_str());
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	size = (size_t)fileSize.QuadPart;
+	fileHandle = file;
+	mappingHandle = mapping;
+	return true;
+}
+
+void MappedFile::close() {
+	if (data) {
+		UnmapViewOfFile(data);
+		CloseHandle((HANDLE)mappingHandle);
+		CloseHandle((HANDLE)fileHandle);
+	}
+	data = NULL;
+	size = 0;
+	fileHandle = NULL;
+	mappingHandle = NULL;
+}
+#else
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		logf("Failed to open %s\n", path.c_str());
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		logf("Failed to map %s (empty file)\n", path.c_str());
+		::close(fd);
+		return false;
+	}
+
+	void* mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // the mapping keeps its own reference to the file
+
+	if (mem == MAP_FAILED) {
+		logf("Failed to map %s\n", path.c_str());
+		return false;
+	}
+
+	data = (unsigned char*)mem;
+	size = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::close() {
+	if (data) {
+		munmap(data, size);
+	}
+	data = NULL;
+	size = 0;
+}
+#endif
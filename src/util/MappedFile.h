@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+
+// Read-only memory-mapped file. Pages are loaded by the OS as they're accessed and can be
+// dropped again under memory pressure, so large files can be read without loading them.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+
+	bool open(const std::string& path);
+	void close();
+
+	bool isOpen() const { return data != NULL; }
+	const unsigned char* getData() const { return data; }
+	size_t getSize() const { return size; }
+
+private:
+	unsigned char* data = NULL;
+	size_t size = 0;
+#ifdef WIN32
+	void* fileHandle = NULL;
+	void* mappingHandle = NULL;
+#endif
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+};
@@ -225,6 +225,21 @@ bool isNumeric(const std::string& s)
 	return !s.empty() && it == s.end();
 }
 
+bool isZeroValue(const std::string& value) {
+	std::vector<std::string> parts = splitString(value, " ");
+	if (parts.empty()) {
+		return false;
+	}
+	for (int i = 0; i < parts.size(); i++) {
+		char* end = NULL;
+		const char* str = parts[i].c_str();
+		if (strtod(str, &end) != 0 || end == str || *end != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
 std::string toLowerCase(std::string str)
 {
 	transform(str.begin(), str.end(), str.begin(), ::tolower);
@@ -260,6 +275,16 @@ int getBspTextureSize(BSPMIPTEX* bspTexture) {
 	return sz;
 }
 
+unsigned int hashBytes(const void* data, size_t len) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 float clamp(float val, float min, float max) {
 	if (val > max) {
 		return max;
@@ -286,41 +311,6 @@ vec3 parseVector(const std::string& s) {
 	return v;
 }
 
-bool IsEntNotSupportAngles(std::string& entname)
-{
-	if (entname == "func_wall" ||
-		entname == "func_illusionary" ||
-		entname == "spark_shower" ||
-		entname == "func_plat" ||
-		entname == "func_door" ||
-		entname == "momentary_door" ||
-		entname == "func_water" ||
-		entname == "func_conveyor" ||
-		entname == "func_rot_button" ||
-		entname == "func_button" ||
-		entname == "env_blood" ||
-		entname == "gibshooter" ||
-		entname == "trigger" ||
-		entname == "trigger_monsterjump" ||
-		entname == "trigger_hurt" ||
-		entname == "trigger_multiple" ||
-		entname == "trigger_push" ||
-		entname == "trigger_teleport" ||
-		entname == "func_bomb_target" ||
-		entname == "func_hostage_rescue" ||
-		entname == "func_vip_safetyzone" ||
-		entname == "func_escapezone" ||
-		entname == "trigger_autosave" ||
-		entname == "trigger_endsection" ||
-		entname == "trigger_gravity" ||
-		entname == "env_snow" ||
-		entname == "func_snow" ||
-		entname == "env_rain" ||
-		entname == "func_rain")
-		return true;
-	return false;
-}
-
 COLOR3 operator*(COLOR3 c, float scale)
 {
 	c.r = (unsigned char)(c.r * scale);
@@ -965,6 +955,18 @@ void removeDir(const std::string& dirName)
 #endif
 }
 
+bool removeEmptyDir(const std::string& dirName)
+{
+#ifdef USE_FILESYSTEM
+	std::error_code e;
+	return fs::remove(dirName, e);
+#elif WIN32
+	return RemoveDirectoryA(dirName.c_str());
+#else 
+	return rmdir(dirName.c_str()) == 0;
+#endif
+}
+
 
 void replaceAll(std::string& str, const std::string& from, const std::string& to) {
 	if (from.empty())
@@ -1105,4 +1107,37 @@ std::string getConfigDir()
 {
 	return std::string("") + getenv("HOME") + "/.config/bspguy/";
 }
-#endif
\ No newline at end of file
+#endif
+
+int getThreadCount()
+{
+	unsigned int threads = std::thread::hardware_concurrency();
+	return threads > 0 ? (int)threads : 4;
+}
+
+void parallelFor(int count, const std::function<void(int start, int end)>& func, int minChunkSize)
+{
+	if (count <= 0)
+		return;
+
+	int chunkCount = std::min(getThreadCount(), count / std::max(1, minChunkSize));
+	if (chunkCount <= 1)
+	{
+		func(0, count);
+		return;
+	}
+
+	int chunkSize = (count + chunkCount - 1) / chunkCount;
+	std::vector<std::future<void>> futures;
+	for (int start = chunkSize; start < count; start += chunkSize)
+	{
+		futures.push_back(std::async(std::launch::async, func, start, std::min(start + chunkSize, count)));
+	}
+
+	func(0, chunkSize);
+
+	for (int i = 0; i < futures.size(); i++)
+	{
+		futures[i].get();
+	}
+}
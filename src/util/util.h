@@ -21,6 +21,7 @@ namespace fs = std::experimental::filesystem;
 #include <cmath>
 #include <thread>
 #include <future>
+#include <functional>
 #include "ProgressMeter.h"
 #include "bsptypes.h"
 
@@ -70,6 +71,9 @@ std::string stripExt(const std::string& filename);
 
 bool isNumeric(const std::string& s);
 
+// true for values like "0", "0.0", and "0 0 0"
+bool isZeroValue(const std::string& value);
+
 void print_color(int colors);
 
 std::string getConfigDir();
@@ -80,18 +84,22 @@ bool createDir(const std::string& dirName);
 
 void removeDir(const std::string& dirName);
 
+// removes a directory only if it is empty
+bool removeEmptyDir(const std::string& dirName);
+
 std::string toLowerCase(std::string str);
 
 std::string trimSpaces(std::string s);
 
 int getBspTextureSize(BSPMIPTEX* bspTexture);
 
+// FNV-1a hash of raw bytes
+unsigned int hashBytes(const void* data, size_t len);
+
 float clamp(float val, float min, float max);
 
 vec3 parseVector(const std::string & s);
 
-bool IsEntNotSupportAngles(std::string& entname);
-
 bool pickAABB(vec3 start, vec3 rayDir, vec3 mins, vec3 maxs, float& bestDist);
 
 bool rayPlaneIntersect(const vec3& start, const vec3& dir, const vec3& normal, float fdist, float& intersectDist);
@@ -144,4 +152,10 @@ void replaceAll(std::string& str, const std::string& from, const std::string& to
 
 void WriteBMP(const std::string & fileName, unsigned char* pixels, int width, int height, int bytesPerPixel);
 
-std::string GetCurrentWorkingDir();
\ No newline at end of file
+std::string GetCurrentWorkingDir();
+
+int getThreadCount();
+
+// splits [0, count) into one chunk per CPU core and runs func(start, end) on each chunk in parallel.
+// Returns after all chunks are finished. Runs on the calling thread if count < minChunkSize * 2
+void parallelFor(int count, const std::function<void(int start, int end)>& func, int minChunkSize = 64);
\ No newline at end of file